@@ -0,0 +1,105 @@
+/**
+ * @file glob_bench.cpp
+ * @brief Compares glob_expand with glob(3) on a large directory, and the
+ * ** walk with a single threaded nftw
+ *
+ * Usage: glob_bench [n_files] [iterations]
+ * A scratch directory with n_files entries (default 1000000) is created
+ * under $TMPDIR, a quarter of them .log files spread over 16 directories,
+ * and removed afterwards.
+ */
+#define SHELL_LITE_NO_MAIN
+#include "../shell.cpp"
+
+#include <chrono>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <glob.h>
+
+// subdirectories the files of the ** case are spread over
+const size_t N_SUBDIRS = 16;
+
+// matches of the nftw walk, a global because nftw takes no context
+size_t nftw_matches = 0;
+
+/**
+ * @brief Counts the .log files, the nftw counterpart of **\/\*.log
+ */
+int count_log(const char* path, const struct stat*, int type, FTW* ftw) {
+    if (type == FTW_F && fnmatch("*.log", path + ftw->base, FNM_PERIOD) == 0)
+        nftw_matches++;
+    return 0;
+}
+
+/**
+ * @brief Runs fn iterations times
+ * @return Mean milliseconds per run
+ */
+template<typename F>
+double measure(size_t iterations, F fn) {
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        fn();
+    auto elapsed = chrono::steady_clock::now() - start;
+    return chrono::duration<double, milli>(elapsed).count() / iterations;
+}
+
+int main(int argc, char** argv) {
+    size_t n_files = argc > 1 ? stoul(argv[1]) : 1000000;
+    size_t iterations = argc > 2 ? stoul(argv[2]) : 5;
+
+    const char* tmp = getenv("TMPDIR");
+    string root = string(tmp ? tmp : "/tmp") + "/glob_bench.XXXXXX";
+    if (!mkdtemp(&root[0])) {
+        perror("[glob_bench] mkdtemp");
+        return 1;
+    }
+    string flat = root + "/flat";
+    string tree = root + "/tree";
+    mkdir(flat.c_str(), 0755);
+    mkdir(tree.c_str(), 0755);
+    for (size_t d = 0; d < N_SUBDIRS; ++d)
+        mkdir((tree + "/d" + to_string(d)).c_str(), 0755);
+
+    cout << "creating " << n_files << " files in " << root << endl;
+    for (size_t i = 0; i < n_files; ++i) {
+        string name = "/app-" + to_string(i) + (i % 4 == 0 ? ".log" : ".txt");
+        close(open((flat + name).c_str(), O_CREAT | O_WRONLY, 0644));
+        close(open((tree + "/d" + to_string(i % N_SUBDIRS) + name).c_str(), O_CREAT | O_WRONLY, 0644));
+    }
+
+    vector<string> matches;
+    double ours = measure(iterations, [&] {
+        matches.clear();
+        glob_expand((flat + "/*.log").c_str(), matches);
+    });
+    size_t n_ours = matches.size();
+
+    size_t n_glob = 0;
+    double libc = measure(iterations, [&] {
+        glob_t g;
+        glob((flat + "/*.log").c_str(), 0, nullptr, &g);
+        n_glob = g.gl_pathc;
+        globfree(&g);
+    });
+    cout << "*.log     glob_expand " << ours << " ms, glob(3) " << libc << " ms ("
+         << n_ours << "/" << n_glob << " matches)" << endl;
+
+    double walk = measure(iterations, [&] {
+        matches.clear();
+        glob_expand((tree + "/**/*.log").c_str(), matches);
+    });
+    n_ours = matches.size();
+
+    double ftw = measure(iterations, [&] {
+        nftw_matches = 0;
+        nftw(tree.c_str(), count_log, 64, FTW_PHYS);
+    });
+    cout << "**/*.log  glob_expand " << walk << " ms, nftw " << ftw << " ms ("
+         << n_ours << "/" << nftw_matches << " matches)" << endl;
+
+    // rm -r of the scratch directory
+    nftw(root.c_str(), [](const char* path, const struct stat*, int, FTW*) { return remove(path); },
+         64, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
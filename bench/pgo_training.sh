@@ -0,0 +1,21 @@
+# Training workload for make pgo-generate: the kind of commands the shell
+# spends its time on, built-ins, external commands, pipelines, redirections,
+# quoting and long argument lists
+hash true ls cat
+cd /tmp
+true && echo "training run" > /dev/null || echo failed
+false || true
+ls -la / > /dev/null 2>&1
+ls -l "/" '/tmp' /usr\ bin > /dev/null 2>&1
+echo a b c "d  e" 'f  g' h\ i > /dev/null
+seq 1 20000 | cat | cat > /dev/null
+seq 1 20000 | tee /dev/null | cat > /dev/null
+cat < /dev/null
+echo one; echo two; echo three > /dev/null
+true & true & true & wait
+time true 2> /dev/null
+bench -n 20 -w 2 true > /dev/null
+seq 1 50 | parallel -j 4 -k echo {} > /dev/null
+echo logs/2024/app-server-1.log logs/2024/app-server-2.log logs/2024/app-server-3.log logs/2024/app-server-4.log logs/2024/app-server-5.log logs/2024/app-server-6.log logs/2024/app-server-7.log logs/2024/app-server-8.log logs/2024/app-server-9.log logs/2024/app-server-10.log logs/2024/app-server-11.log logs/2024/app-server-12.log logs/2024/app-server-13.log logs/2024/app-server-14.log logs/2024/app-server-15.log logs/2024/app-server-16.log > /dev/null
+jobs
+allocs > /dev/null
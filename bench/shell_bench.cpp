@@ -0,0 +1,287 @@
+/**
+ * @file shell_bench.cpp
+ * @brief Benchmarks of the hot paths of the shell, for regression tracking
+ *
+ * Usage: shell_bench [min_seconds]
+ * Every case is run in batches until a batch takes at least min_seconds
+ * (default 0.2), then timed over REPETITIONS batches. The results are
+ * written to stdout as JSON, a readable summary goes to stderr.
+ */
+#define SHELL_LITE_NO_MAIN
+#include "../shell.cpp"
+
+#include <chrono>
+
+// timed batches per case, the median is reported
+const int REPETITIONS = 5;
+
+struct bench_result {
+    string name;
+    size_t iterations;
+    double ns_per_op;
+    double min_ns_per_op;
+};
+
+/**
+ * @brief Times fn(n), which performs n * ops_per_call operations
+ * @param min_seconds Minimum duration of a batch
+ * @param ops_per_call Operations done per unit of n, e.g. lines of a script
+ */
+template<typename F>
+bench_result run_case(const string& name, double min_seconds, F fn, size_t ops_per_call = 1) {
+    using clock = chrono::steady_clock;
+
+    // grow the batch till it is long enough to time reliably
+    size_t n = 1;
+    while (true) {
+        auto start = clock::now();
+        fn(n);
+        double seconds = chrono::duration<double>(clock::now() - start).count();
+        if (seconds >= min_seconds || n >= (size_t(1) << 32))
+            break;
+        n = seconds < min_seconds / 100 ? n * 10 : (size_t) (n * min_seconds / seconds * 1.2) + 1;
+    }
+
+    vector<double> samples;
+    for (int r = 0; r < REPETITIONS; ++r) {
+        auto start = clock::now();
+        fn(n);
+        samples.push_back(chrono::duration<double, nano>(clock::now() - start).count() / (n * ops_per_call));
+    }
+    sort(samples.begin(), samples.end());
+
+    bench_result result = { name, n * ops_per_call, samples[REPETITIONS / 2], samples[0] };
+    cerr << name << string(name.size() < 32 ? 32 - name.size() : 1, ' ')
+         << format_ns((uint64_t) result.ns_per_op) << "/op  (" << result.iterations << " ops per batch)" << endl;
+    return result;
+}
+
+/**
+ * @brief Builds a command line of n_args file names
+ */
+string make_line(size_t n_args) {
+    string line = "ls -l";
+    for (size_t i = 0; i < n_args; ++i)
+        line += " logs/2024/app-server-" + to_string(i) + ".log";
+    return line + "\n";
+}
+
+/**
+ * @brief Built-in that does nothing, isolates the cost of the dispatch
+ */
+int cmd_noop(char** args) {
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    double min_seconds = argc > 1 ? atof(argv[1]) : 0.2;
+    init_vars();
+    init_launch_backend();
+    init_char_scanner();
+    interactive = false;
+
+    vector<bench_result> results;
+
+    string short_line = "ls -la /tmp\n";
+    results.push_back(run_case("tokenize_line/short", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            line_arena.reset();
+            tokenize_line(short_line.c_str(), short_line.size());
+        }
+    }));
+
+    string long_line = make_line(20000);
+    results.push_back(run_case("tokenize_line/long_20000_args", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            line_arena.reset();
+            tokenize_line(long_line.c_str(), long_line.size());
+        }
+    }));
+
+    results.push_back(run_case("parse_source/short", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            line_arena.reset();
+            ast tree;
+            parse_source(short_line.c_str(), short_line.size(), line_arena, tree);
+        }
+    }));
+
+    register_builtin("noop", cmd_noop, "Does nothing");
+    char* noop_args[] = { (char*) "noop", nullptr };
+    results.push_back(run_case("builtin_dispatch", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            execute_cmd(noop_args, 1);
+    }));
+
+    char* true_args[] = { (char*) "/bin/true", nullptr };
+    results.push_back(run_case("launch_cmd/bin_true", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            launch_cmd(true_args);
+    }));
+
+    // startup of the shell binary built by make, once with a command string
+    // and once with a script piped in (no banner, no prompt)
+    char* startup_c_args[] = { (char*) "./shell", (char*) "-c", (char*) "cd .", nullptr };
+    results.push_back(run_case("startup/command_string", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            launch_cmd(startup_c_args);
+    }));
+
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    fd_remap stdin_null = { null_fd, STDIN_FILENO };
+    launch_opts piped = { &stdin_null, 1 };
+    char* startup_args[] = { (char*) "./shell", nullptr };
+    results.push_back(run_case("startup/piped_stdin", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            launch_cmd(startup_args, piped);
+    }));
+    close(null_fd);
+
+    // the envp is cached, a large environment shouldn't slow launches down
+    for (int i = 0; i < 500; ++i)
+        set_var(("BENCH_VAR_" + to_string(i)).c_str(), "some exported value", true);
+    results.push_back(run_case("launch_cmd/bin_true_500_exports", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            launch_cmd(true_args);
+    }));
+    for (int i = 0; i < 500; ++i)
+        unset_var(("BENCH_VAR_" + to_string(i)).c_str(), strlen("BENCH_VAR_") + to_string(i).size());
+
+    // end to end: parse and run a whole script, reported per command,
+    // ops_per_sec of these is the throughput in commands per second
+    const size_t SCRIPT_LINES = 1000;
+    string builtin_script, external_script;
+    for (size_t i = 0; i < SCRIPT_LINES; ++i) {
+        builtin_script += "noop arg" + to_string(i) + " && noop\n";
+        external_script += "/bin/true arg" + to_string(i) + "\n";
+    }
+
+    // the same commands as built-ins and as the external binaries
+    string echo_script, echo_external_script, test_script, test_external_script;
+    for (size_t i = 0; i < SCRIPT_LINES; ++i) {
+        echo_script += "echo line " + to_string(i) + " > /dev/null\n";
+        echo_external_script += "/bin/echo line " + to_string(i) + " > /dev/null\n";
+        test_script += "[ " + to_string(i) + " -lt 500 ]\n";
+        test_external_script += "/usr/bin/test " + to_string(i) + " -lt 500\n";
+    }
+
+    results.push_back(run_case("script/builtins", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            run_source(builtin_script.c_str(), builtin_script.size());
+    }, SCRIPT_LINES * 2));
+
+    results.push_back(run_case("script/external", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            run_source(external_script.c_str(), external_script.size());
+    }, SCRIPT_LINES));
+
+    // variables: assignment and expansion in the shell
+    string var_script;
+    for (size_t i = 0; i < SCRIPT_LINES; ++i)
+        var_script += "v=" + to_string(i) + "; noop $v \"$v\" ${v}\n";
+    results.push_back(run_case("script/variables", min_seconds, [&](size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            run_source(var_script.c_str(), var_script.size());
+    }, SCRIPT_LINES * 2));
+
+    // command substitution: in-process, launched and in a forked shell
+    string subst_script, subst_external_script, subst_forked_script;
+    for (size_t i = 0; i < SCRIPT_LINES; ++i) {
+        subst_script += "v=$(echo line " + to_string(i) + ")\n";
+        subst_external_script += "v=$(/bin/echo line " + to_string(i) + ")\n";
+        subst_forked_script += "v=$(cd /; echo line " + to_string(i) + ")\n";
+    }
+    const pair<const char*, const string*> subst_scripts[] = {
+        { "script/subst_builtin", &subst_script },
+        { "script/subst_external", &subst_external_script },
+        { "script/subst_forked", &subst_forked_script },
+    };
+    for (auto& [name, script]: subst_scripts) {
+        results.push_back(run_case(name, min_seconds, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                run_source(script->c_str(), script->size());
+        }, SCRIPT_LINES));
+    }
+
+    // arithmetic: a counter in the shell against expr
+    string arith_script, arith_cmd_script, expr_script;
+    for (size_t i = 0; i < SCRIPT_LINES; ++i) {
+        arith_script += "i=$((i + " + to_string(i % 7) + " * 2))\n";
+        arith_cmd_script += "((n += i % 3, n > 100 ? n = 0 : n))\n";
+        expr_script += "i=$(expr $i + 1)\n";
+    }
+    set_var("i", "0");
+    const pair<const char*, const string*> arith_scripts[] = {
+        { "script/arith_expansion", &arith_script },
+        { "script/arith_command", &arith_cmd_script },
+        { "script/arith_expr_external", &expr_script },
+    };
+    for (auto& [name, script]: arith_scripts) {
+        results.push_back(run_case(name, min_seconds, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                run_source(script->c_str(), script->size());
+        }, SCRIPT_LINES));
+    }
+
+    // brace expansion: into arguments and streamed through a loop, per value
+    const size_t BRACE_VALUES = 100000;
+    string brace_args = "noop {1.." + to_string(BRACE_VALUES) + "}\n";
+    string brace_loop = "for i in {1.." + to_string(BRACE_VALUES) + "}; do noop $i; done\n";
+    const pair<const char*, const string*> brace_scripts[] = {
+        { "brace/args_100000", &brace_args },
+        { "brace/for_loop_100000", &brace_loop },
+    };
+    for (auto& [name, script]: brace_scripts) {
+        results.push_back(run_case(name, min_seconds, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                run_source(script->c_str(), script->size());
+        }, BRACE_VALUES));
+    }
+
+    // pathname expansion: a pattern and a quoted one over 100 files, see
+    // glob_bench for large directories
+    char glob_dir[] = "/tmp/shell_bench.XXXXXX";
+    if (mkdtemp(glob_dir)) {
+        for (int i = 0; i < 100; ++i)
+            close(open((string(glob_dir) + "/file-" + to_string(i) + (i % 4 ? ".txt" : ".log")).c_str(),
+                       O_CREAT | O_WRONLY, 0644));
+        string glob_script;
+        for (size_t i = 0; i < SCRIPT_LINES; ++i)
+            glob_script += string("noop ") + glob_dir + "/*.log '*.log'\n";
+        results.push_back(run_case("script/glob_100_files", min_seconds, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                run_source(glob_script.c_str(), glob_script.size());
+        }, SCRIPT_LINES));
+        run_source(("rm -r " + string(glob_dir)).c_str(), strlen("rm -r ") + strlen(glob_dir));
+    }
+
+    const pair<const char*, const string*> command_scripts[] = {
+        { "script/echo_builtin", &echo_script },
+        { "script/echo_external", &echo_external_script },
+        { "script/test_builtin", &test_script },
+        { "script/test_external", &test_external_script },
+    };
+    for (auto& [name, script]: command_scripts) {
+        results.push_back(run_case(name, min_seconds, [&](size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                run_source(script->c_str(), script->size());
+        }, SCRIPT_LINES));
+    }
+
+    cout << "{\n  \"shell_version\": \"" << SHELL_VERSION << "\",\n"
+         << "  \"scanner\": \"" << active_scanner->name << "\",\n"
+         << "  \"launch_backend\": \"" << (launch_backend == launch_mode::fork ? "fork"
+                                          : launch_backend == launch_mode::zygote ? "zygote" : "spawn") << "\",\n"
+         << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const bench_result& r = results[i];
+        char buf[256];
+        snprintf(buf, sizeof(buf),
+                 "    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, \"ops_per_sec\": %.1f}%s\n",
+                 r.name.c_str(), r.iterations, r.ns_per_op, r.min_ns_per_op, 1e9 / r.ns_per_op,
+                 i + 1 < results.size() ? "," : "");
+        cout << buf;
+    }
+    cout << "  ]\n}" << endl;
+    return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file tokenize_bench.cpp
+ * @brief Compares tokenize_line with every character scanner against the
+ * original strtok based tokenizer
+ *
+ * Usage: tokenize_bench [n_args] [iterations]
+ * The line is made of n_args file names, like the generated scripts that
+ * pass tens of thousands of files to a command.
+ */
+#define SHELL_LITE_NO_MAIN
+#include "../shell.cpp"
+
+#include <chrono>
+
+// delimiters of the original tokenizer
+const char STRTOK_DELIMS[] = " \t\r\n\a";
+
+/**
+ * @brief The tokenizer as it was before the scanners, used as the baseline
+ */
+size_t tokenize_strtok(char* line, vector<char*>& tokens) {
+    tokens.clear();
+    for (char* token = strtok(line, STRTOK_DELIMS); token; token = strtok(NULL, STRTOK_DELIMS))
+        tokens.push_back(token);
+    return tokens.size();
+}
+
+/**
+ * @brief Builds a command line of n_args file names
+ */
+string make_line(size_t n_args) {
+    string line = "ls -l";
+    for (size_t i = 0; i < n_args; ++i) {
+        line += (i % 7 == 0) ? "\t " : " ";
+        line += "logs/2024/app-server-" + to_string(i) + ".log";
+    }
+    line += "\n";
+    return line;
+}
+
+/**
+ * @brief Runs fn on a fresh copy of the line, iterations times
+ * @return Mean nanoseconds per line
+ */
+template<typename F>
+double measure(const string& line, size_t iterations, F fn) {
+    vector<char> buf(line.size() + 1);
+    auto start = chrono::steady_clock::now();
+
+    for (size_t i = 0; i < iterations; ++i) {
+        memcpy(buf.data(), line.c_str(), line.size() + 1);
+        fn(buf.data());
+    }
+
+    auto elapsed = chrono::steady_clock::now() - start;
+    return chrono::duration<double, nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char** argv) {
+    size_t n_args = argc > 1 ? stoul(argv[1]) : 20000;
+    size_t iterations = argc > 2 ? stoul(argv[2]) : 200;
+    string line = make_line(n_args);
+
+    // the expected tokens
+    vector<string> expected;
+    {
+        vector<char> buf(line.begin(), line.end());
+        buf.push_back('\0');
+        vector<char*> tokens;
+        tokenize_strtok(buf.data(), tokens);
+        expected.assign(tokens.begin(), tokens.end());
+    }
+
+    cout << "line: " << line.size() << " bytes, " << expected.size() << " tokens, "
+         << iterations << " iterations" << endl;
+
+    // strtok writes into the line, so it has to run on a fresh copy each
+    // time. The copy is timed on its own and not counted.
+    double copy = measure(line, iterations, [](char*) {});
+    vector<char*> tokens;
+    double base = measure(line, iterations, [&](char* buf) { tokenize_strtok(buf, tokens); }) - copy;
+    cout << "strtok   " << base / 1000 << " us/line (+" << copy / 1000 << " us copy)" << endl;
+
+    for (const char_scanner& scanner: char_scanners) {
+#ifdef SHELL_LITE_X86
+        if (strcmp(scanner.name, "avx2") == 0 && !__builtin_cpu_supports("avx2"))
+            continue;
+#endif
+        active_scanner = &scanner;
+
+        // check that the words match strtok before timing it, the line has
+        // no quotes or operators so only the final newline token is extra
+        line_arena.reset();
+        auto [tokens, n] = tokenize_line(line.c_str(), line.size());
+        bool same = n == expected.size() + 2;
+        for (size_t i = 0; same && i < expected.size(); ++i)
+            same = tokens[i].type == TOK_WORD && line.compare(tokens[i].start, tokens[i].len, expected[i]) == 0;
+
+        if (!same) {
+            cerr << scanner.name << ": tokens differ from strtok" << endl;
+            return EXIT_FAILURE;
+        }
+
+        double ns = measure(line, iterations, [&](char* buf) {
+            line_arena.reset();
+            tokenize_line(buf, line.size());
+        }) - copy;
+        cout << scanner.name << string(9 - strlen(scanner.name), ' ') << ns / 1000
+             << " us/line (" << base / ns << "x strtok)" << endl;
+    }
+
+    return 0;
+}
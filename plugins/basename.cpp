@@ -0,0 +1,72 @@
+/**
+ * @file basename.cpp
+ * @brief basename and dirname as loadable built-ins
+ *
+ * Build with `make plugins`, then in the shell:
+ *     enable -f ./plugins/basename.so basename dirname
+ */
+#include <iostream>
+#include <string_view>
+
+#include "../shell_plugin.h"
+using namespace std;
+
+/**
+ * @brief Strips the trailing slashes of a path, keeping a lone "/"
+ */
+static string_view strip_slashes(string_view path) {
+    while (path.size() > 1 && path.back() == '/')
+        path.remove_suffix(1);
+    return path;
+}
+
+/**
+ * @brief Prints the last component of a path, without suffix if given
+ * @param args basename path [suffix]
+ * @return 1 on success, 0 on failure
+ */
+int cmd_basename(char** args) {
+    if (!args[1]) {
+        cerr << "basename: missing operand" << '\n';
+        return 0;
+    }
+
+    string_view name = strip_slashes(args[1]);
+    size_t slash = name.rfind('/');
+    if (slash != string_view::npos && name.size() > 1)
+        name.remove_prefix(slash + 1);
+
+    if (args[2]) {
+        string_view suffix = args[2];
+        if (name.size() > suffix.size() && name.substr(name.size() - suffix.size()) == suffix)
+            name.remove_suffix(suffix.size());
+    }
+
+    cout << name << '\n';
+    return 1;
+}
+
+/**
+ * @brief Prints a path without its last component
+ * @param args dirname path
+ * @return 1 on success, 0 on failure
+ */
+int cmd_dirname(char** args) {
+    if (!args[1]) {
+        cerr << "dirname: missing operand" << '\n';
+        return 0;
+    }
+
+    string_view dir = strip_slashes(args[1]);
+    size_t slash = dir.rfind('/');
+    if (slash == string_view::npos)
+        dir = ".";
+    else
+        dir = strip_slashes(dir.substr(0, slash ? slash : 1));
+
+    cout << dir << '\n';
+    return 1;
+}
+
+SHELL_BUILTIN(basename, cmd_basename, "Print the last component of a path. Usage: basename path [suffix]")
+SHELL_BUILTIN(dirname, cmd_dirname, "Print a path without its last component. Usage: dirname path")
@@ -4,328 +4,8409 @@
  * 
  * This shell provides a command-line interface with the following features:
  * - Basic REPL (Read-Evaluate-Print Loop) interface
- * - Built-in commands: cd, help, exit
- * - External command execution using fork/exec pattern
- * - Command line parsing with argument tokenization
+ * - Non-interactive execution of script files and `-c` command strings
+ * - On-disk cache of parsed scripts, memory mapped on load
+ * - Built-in commands: cd, help, exit, echo, printf, test/[, pwd, true, false
+ * - Shell and exported variables, $NAME/${NAME}/$?/$$ expansion with field
+ *   splitting, NAME=value assignments, export and unset
+ * - Built-ins loaded from shared objects at runtime (enable -f)
+ * - External command execution using posix_spawn, with opt-in fork/exec
+ *   and an optional zygote process launching commands from a small address space
+ * - Hashed PATH lookup of external commands
+ * - Quote and escape aware lexer, SSE2/AVX2 accelerated
+ * - Recursive descent parser producing a flat AST: lists, &&, ||, pipelines, redirections
+ * - Pipelines over enlarged pipes, built-in cat/tee forwarding data with splice/tee
+ * - Background jobs (&, jobs, fg, bg, wait), reaped through pidfds and epoll
+ * - parallel built-in running a command template over input lines on a worker pool
+ * - time built-in reporting rusage and where the shell spends its own time
+ * - bench built-in running a command repeatedly with statistics and JSON export
+ * - Server mode executing requests from shell_client over a Unix socket
+ * - Line scoped arena, steady state command processing doesn't touch the heap
  * - Child process management and wait status handling
  */
 #include <iostream>
 #include <vector>
 #include <cstdio>
 #include <cstring>
+#include <cerrno>
 #include <unordered_map>
 #include <sstream>
-#include <functional>
+#include <new>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <bitset>
+#include <charconv>
+#include <algorithm>
+#include <cmath>
+#include <cinttypes>
+#include <climits>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
+
+#include "shell_server.h"
+#include "shell_plugin.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHELL_LITE_X86 1
+#endif
 using namespace std;
 
-////////////////////////// Prototypes //////////////////////////
-// External commands
-int execute_cmd(char** args, size_t n_args);
-int launch_cmd(char** args);
+// environment of the shell, passed on to the launched commands
+extern char** environ;
+
+////////////////////////// Prototypes //////////////////////////
+// built-in function template
+using func = int (*)(char**);
+
+struct launch_opts;
+struct job;
+struct token;
+struct ast;
+struct ast_node;
+struct expansion;
+struct builtin_desc;
+class arena;
+
+// External commands
+int execute_cmd(char** args, size_t n_args, const launch_opts& opts);
+int launch_cmd(char** args, const launch_opts& opts);
+pid_t start_external_cmd(char** args, const launch_opts& opts);
+pid_t start_cmd(char** args, const launch_opts& opts);
+char** script_args(const char* path, char** args);
+pid_t spawn_child(const char* path, char** args, const launch_opts& opts);
+pid_t fork_child(const char* path, char** args, const launch_opts& opts);
+pid_t zygote_child(const char* path, char** args, const launch_opts& opts);
+bool start_zygote();
+void zygote_loop(int sock);
+pid_t fork_builtin(func builtin, char** args, const launch_opts& opts);
+int run_builtin(func builtin, char** args);
+func find_builtin(const char* name);
+const builtin_desc* find_builtin_desc(const char* name);
+bool register_builtin(const char* name, func fn, const char* description, void* handle);
+bool load_builtin(const char* path, const char* name);
+bool unload_builtin(const char* name);
+int wait_child(pid_t pid, struct rusage* usage = nullptr);
+int exit_status(int wait_status);
+
+// jobs
+int add_job(const pid_t* pids, size_t n_pids, pid_t pgid, string cmd);
+size_t reap_jobs(int timeout);
+void update_job_states();
+void report_done_jobs();
+job* find_job(const char* spec);
+int wait_foreground_job(job& j);
+bool apply_fd_remaps(const launch_opts& opts, int* saved);
+bool write_all(int fd, const char* buf, size_t len);
+bool read_exact(int fd, char* buf, size_t len);
+void restore_fd_remaps(const launch_opts& opts, const int* saved);
+
+// variables
+struct shell_var;
+struct saved_var;
+bool parse_arith_int(const char* s, int64_t& value);
+int64_t arith_eval_text(const char* text, const char*& error);
+const char* get_var(const char* name);
+char** shell_envp();
+void init_vars();
+size_t count_assignments(const ast& tree, const ast_node& cmd);
+saved_var* save_assignments(const ast& tree, const ast_node& cmd, size_t n_assigns);
+void restore_assignments(const saved_var* saved, size_t n_assigns);
+
+// Command lookup
+const char* find_cmd(const char* name);
+string search_path(const char* name);
+void clear_cmd_hash();
+void check_path_changes();
+void watch_path_dirs();
+
+// Built-ins
+int cmd_cd(char** args);
+int cmd_help(char** args);
+int cmd_exit(char** args);
+int cmd_echo(char** args);
+int cmd_printf(char** args);
+int cmd_test(char** args);
+int cmd_pwd(char** args);
+int cmd_true(char** args);
+int cmd_false(char** args);
+int cmd_export(char** args);
+int cmd_unset(char** args);
+int cmd_hash(char** args);
+int cmd_allocs(char** args);
+int cmd_cat(char** args);
+int cmd_tee(char** args);
+int cmd_jobs(char** args);
+int cmd_fg(char** args);
+int cmd_bg(char** args);
+int cmd_wait(char** args);
+int cmd_parallel(char** args);
+int cmd_time(char** args);
+int cmd_bench(char** args);
+int cmd_enable(char** args);
+int cmd_arith(char** args);
+
+// test/[ expressions
+struct test_parser;
+bool test_or(test_parser& p);
+
+// shell operations
+void print_prompt();
+pair<token*, size_t> tokenize_line(const char* text, size_t len);
+bool parse_source(const char* text, size_t len, arena& mem, ast& tree);
+char* expand_word(const ast& tree, const ast_node& word);
+char** expand_cmd(const ast& tree, const ast_node& cmd, size_t skip, size_t& n_args);
+size_t find_subst_end(const char* text, size_t len, size_t at);
+size_t expand_subst(const char* src, size_t len, size_t at, expansion& e, bool quoted);
+int execute_node(const ast& tree, uint32_t index);
+int execute_simple_cmd(const ast& tree, const ast_node& cmd);
+int start_pipeline(const ast& tree, uint32_t first, uint32_t count, pid_t pgid, pid_t* pids, size_t& n_pids);
+int execute_pipeline(const ast& tree, const ast_node& pipeline);
+int execute_background(const ast& tree, uint32_t index);
+int execute_for(const ast& tree, const ast_node& loop);
+char* read_line();
+void repl_loop();
+void init_launch_backend();
+void init_char_scanner();
+
+// non-interactive execution
+int run_source(const char* text, size_t len);
+int run_script(const char* path);
+int run_string(const char* cmds);
+
+// server mode
+int run_server(const char* socket_path);
+void serve_connection(int conn);
+
+// script cache
+string script_cache_path(const char* script);
+bool load_script_cache(const string& cache_path, const struct stat& st, ast& tree, size_t& map_size);
+void store_script_cache(const string& cache_path, const struct stat& st, const ast& tree, size_t text_len);
+
+/*
+    Constants
+*/
+const string PROMPT = "> ";
+
+// printed when the interactive shell starts
+const char BANNER[] = R"(
+               ════════════════════════════════════               
+                      Shell lite started....                      
+               ════════════════════════════════════               
+
+    ███████╗██╗  ██╗███████╗██╗     ██╗         ██╗     ██╗████████╗███████╗
+    ██╔════╝██║  ██║██╔════╝██║     ██║         ██║     ██║╚══██╔══╝██╔════╝
+    ███████╗███████║█████╗  ██║     ██║         ██║     ██║   ██║   █████╗  
+    ╚════██║██╔══██║██╔══╝  ██║     ██║         ██║     ██║   ██║   ██╔══╝  
+    ███████║██║  ██║███████╗███████╗███████╗    ███████╗██║   ██║   ███████╗
+    ╚══════╝╚═╝  ╚═╝╚══════╝╚══════╝╚══════╝    ╚══════╝╚═╝   ╚═╝   ╚══════╝
+                                                                            
+    Type 'help' for available commands
+    
+)";
+const char SHELL_VERSION[] = "0.2.0";
+
+/*
+    Allocation counters
+    Every heap allocation made by the shell itself goes through operator new
+    or the line arena, both bump these so that `allocs` can show whether
+    command processing allocates at all. Atomic, the ** walker allocates
+    from several threads.
+*/
+atomic<size_t> heap_allocs{0};
+atomic<size_t> heap_frees{0};
+
+/**
+ * @brief Allocates for all the forms of operator new, counted
+ * @param align Alignment, 0 for the default one of malloc
+ * @return The memory, nullptr if there is none
+ */
+void* counted_alloc(size_t size, size_t align) {
+    heap_allocs.fetch_add(1, memory_order_relaxed);
+    size = size ? size : 1;
+    if (align <= alignof(max_align_t))
+        return malloc(size);
+    // aligned_alloc wants a multiple of the alignment
+    return aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+void counted_free(void* ptr) noexcept {
+    if (ptr)
+        heap_frees.fetch_add(1, memory_order_relaxed);
+    free(ptr);
+}
+
+// every form of new and delete is replaced, so that whichever pair the
+// compiler picks they match
+void* operator new(size_t size) {
+    if (void* ptr = counted_alloc(size, 0))
+        return ptr;
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    if (void* ptr = counted_alloc(size, 0))
+        return ptr;
+    throw bad_alloc();
+}
+
+void* operator new(size_t size, align_val_t align) {
+    if (void* ptr = counted_alloc(size, (size_t) align))
+        return ptr;
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size, align_val_t align) {
+    if (void* ptr = counted_alloc(size, (size_t) align))
+        return ptr;
+    throw bad_alloc();
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return counted_alloc(size, 0);
+}
+
+void operator delete(void* ptr) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, align_val_t) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, align_val_t) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, size_t, align_val_t) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, size_t, align_val_t) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, const nothrow_t&) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, const nothrow_t&) noexcept { counted_free(ptr); }
+
+/*
+    Line arena
+    Bump allocator for everything that lives only as long as one command
+    line: the line buffer, the token array and expansion results. It is
+    reset, not freed, before each line so the memory is reused.
+*/
+class arena {
+public:
+    // position in the arena, see mark() and release()
+    struct position {
+        void* chunk;
+        size_t used;
+    };
+
+    arena() = default;
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    ~arena() {
+        while (head) {
+            chunk* prev = head->prev;
+            free(head);
+            head = prev;
+        }
+        free(spare);
+    }
+
+    /**
+     * @brief Allocates memory from the arena
+     * @param size Number of bytes
+     * @param align Alignment of the memory
+     * @return Pointer to the memory, valid till the next reset()
+     */
+    void* alloc(size_t size, size_t align = alignof(max_align_t)) {
+        size_t offset = head ? align_up(head->used, align) : 0;
+
+        if (!head || offset + size > head->size) {
+            add_chunk(size + align);
+            offset = align_up(head->used, align);
+        }
+
+        head->used = offset + size;
+        return data(head) + offset;
+    }
+
+    /**
+     * @brief Resizes an allocation, in place if it is the latest one
+     * @param ptr Pointer returned by alloc()
+     * @param old_size Current size of the allocation
+     * @param new_size Required size
+     * @return Pointer to the resized memory, the contents are preserved
+     */
+    void* extend(void* ptr, size_t old_size, size_t new_size) {
+        char* p = (char*) ptr;
+
+        // the latest allocation can just grow into the free space of the chunk
+        if (head && p + old_size == data(head) + head->used
+            && (p - data(head)) + new_size <= head->size) {
+            head->used = (p - data(head)) + new_size;
+            return p;
+        }
+
+        void* moved = alloc(new_size);
+        memcpy(moved, p, old_size);
+        return moved;
+    }
+
+    /**
+     * @brief Makes all the memory available again
+     * @remark If the last line needed more than one chunk, the chunks are
+     * replaced by a single one large enough for all of them, so a line of
+     * the same size fits in one chunk next time.
+     */
+    void reset() {
+        if (head && head->prev) {
+            size_t total = 0;
+            while (head) {
+                total += head->size;
+                chunk* prev = head->prev;
+                free(head);
+                head = prev;
+            }
+            n_chunks = 0;
+            add_chunk(total);
+        }
+
+        if (head)
+            head->used = 0;
+    }
+
+    /**
+     * @brief Remembers the current position, everything allocated after it
+     * can be dropped with release()
+     * @remark Used for memory that lives shorter than the line, e.g. the
+     * expansion results of one command, so it doesn't pile up in long lines.
+     */
+    position mark() const {
+        return { head, head ? head->used : 0 };
+    }
+
+    /**
+     * @brief Drops everything allocated after the mark
+     * @param pos Position returned by mark()
+     */
+    void release(position pos) {
+        while (head && head != pos.chunk) {
+            chunk* prev = head->prev;
+            // the largest dropped chunk is kept for the next add_chunk(), so
+            // a command that overflows the chunk doesn't malloc every time
+            if (!spare || head->size > spare->size)
+                swap(head, spare);
+            free(head);
+            head = prev;
+            n_chunks--;
+        }
+
+        if (head)
+            head->used = pos.used;
+    }
+
+    // bytes handed out from the current chunk
+    size_t used() const { return head ? head->used : 0; }
+    // total bytes owned by the arena
+    size_t capacity() const {
+        size_t total = 0;
+        for (chunk* c = head; c; c = c->prev)
+            total += c->size;
+        return total;
+    }
+    size_t chunks() const { return n_chunks; }
+
+private:
+    struct chunk {
+        chunk* prev;
+        size_t size;
+        size_t used;
+    };
+
+    static constexpr size_t MIN_CHUNK_SIZE = 4096;
+
+    chunk* head = nullptr;
+    size_t n_chunks = 0;
+    // a chunk dropped by release(), reused by add_chunk()
+    chunk* spare = nullptr;
+
+    static char* data(chunk* c) { return (char*) (c + 1); }
+
+    static size_t align_up(size_t n, size_t align) {
+        return (n + align - 1) & ~(align - 1);
+    }
+
+    void add_chunk(size_t min_size) {
+        size_t size = max(MIN_CHUNK_SIZE, head ? head->size * 2 : 0);
+        while (size < min_size)
+            size *= 2;
+
+        chunk* c;
+        if (spare && spare->size >= min_size) {
+            c = spare;
+            size = spare->size;
+            spare = nullptr;
+        }
+        else {
+            c = (chunk*) malloc(sizeof(chunk) + size);
+            if (!c) {
+                perror("[shell] Error allocating memory.");
+                exit(EXIT_FAILURE);
+            }
+            heap_allocs.fetch_add(1, memory_order_relaxed);
+        }
+
+        c->prev = head;
+        c->size = size;
+        c->used = 0;
+        head = c;
+        n_chunks++;
+    }
+};
+
+arena line_arena;
+
+/*
+    Character classification
+    The lexer looks at the input in windows of 64 bytes: a scanner turns a
+    window into two bitmasks with one bit per byte, one for the delimiters
+    and one for the special characters (newlines, quotes, operators...).
+    Runs of plain words and delimiters are then split with a few bit
+    operations, only the special characters are handled one at a time.
+    There is a scalar scanner and SSE2/AVX2 ones that classify 16/32 bytes
+    per instruction, the best one for the CPU is picked at startup.
+*/
+#define DELIM_CHARS ' ', '\t', '\r', '\a'
+#define SPECIAL_CHARS '\n', '\'', '"', '\\', '|', '&', ';', '<', '>', '(', ')', '#', '$', \
+                      '*', '?', '[', '{'
+
+struct char_masks {
+    uint64_t delims;
+    uint64_t specials;
+};
+
+struct char_scanner {
+    const char* name;
+    // classifies p[0..63], p must have 64 readable bytes
+    char_masks (*classify)(const char* p);
+};
+
+// character classes of the scalar scanner
+const uint8_t CHAR_DELIM = 1 << 0;
+const uint8_t CHAR_SPECIAL = 1 << 1;
+
+template<char... Cs>
+constexpr bool char_in(unsigned char c) {
+    return ((c == (unsigned char) Cs) || ...);
+}
+
+struct char_class_table {
+    uint8_t classes[256];
+
+    constexpr char_class_table() : classes() {
+        for (int c = 0; c < 256; ++c)
+            classes[c] = (char_in<DELIM_CHARS>(c) ? CHAR_DELIM : 0)
+                       | (char_in<SPECIAL_CHARS>(c) ? CHAR_SPECIAL : 0);
+    }
+};
+
+constexpr char_class_table CHAR_CLASSES;
+
+char_masks classify_scalar(const char* p) {
+    char_masks masks = {0, 0};
+
+    for (int i = 0; i < 64; ++i) {
+        uint64_t cls = CHAR_CLASSES.classes[(unsigned char) p[i]];
+        masks.delims |= (cls & CHAR_DELIM) << i;
+        masks.specials |= (cls >> 1) << i;
+    }
+    return masks;
+}
+
+#ifdef SHELL_LITE_X86
+template<char... Cs>
+__attribute__((target("sse2")))
+inline uint64_t match_16_sse2(__m128i block) {
+    __m128i hits = _mm_setzero_si128();
+    ((hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(Cs)))), ...);
+    return (unsigned) _mm_movemask_epi8(hits);
+}
+
+__attribute__((target("sse2")))
+char_masks classify_sse2(const char* p) {
+    char_masks masks = {0, 0};
+
+    for (int i = 0; i < 64; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (p + i));
+        masks.delims |= match_16_sse2<DELIM_CHARS>(block) << i;
+        masks.specials |= match_16_sse2<SPECIAL_CHARS>(block) << i;
+    }
+    return masks;
+}
+
+/*
+    The AVX2 scanner classifies with two table lookups (vpshufb) instead of
+    one comparison per character: every class bit stands for a group of
+    characters sharing the high nibble, a byte is in the group if both its
+    high and its low nibble look up a table entry with that bit set.
+*/
+struct nibble_tables {
+    uint8_t high[16];
+    uint8_t low[16];
+    // class bits of the delimiter groups, the rest are special groups
+    uint8_t delim_bits;
+};
+
+constexpr nibble_tables make_nibble_tables() {
+    nibble_tables tables = {};
+    // one group per high nibble and kind, the characters in use fit in 8
+    int group_of[16][2] = {};
+    int n_groups = 0;
+
+    for (int c = 0; c < 256; ++c) {
+        int kind = char_in<DELIM_CHARS>(c) ? 0 : char_in<SPECIAL_CHARS>(c) ? 1 : -1;
+        if (kind < 0)
+            continue;
+
+        int& group = group_of[c >> 4][kind];
+        if (group == 0)
+            group = ++n_groups;
+        uint8_t bit = 1 << (group - 1);
+
+        tables.high[c >> 4] |= bit;
+        tables.low[c & 15] |= bit;
+        if (kind == 0)
+            tables.delim_bits |= bit;
+    }
+    return tables;
+}
+
+constexpr nibble_tables NIBBLE_TABLES = make_nibble_tables();
+
+__attribute__((target("avx2")))
+char_masks classify_avx2(const char* p) {
+    const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) NIBBLE_TABLES.high));
+    const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) NIBBLE_TABLES.low));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i delim_bits = _mm256_set1_epi8(NIBBLE_TABLES.delim_bits);
+    const __m256i special_bits = _mm256_set1_epi8(~NIBBLE_TABLES.delim_bits);
+    const __m256i zero = _mm256_setzero_si256();
+
+    char_masks masks = {0, 0};
+
+    for (int i = 0; i < 64; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (p + i));
+        __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+        __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(block, nibble));
+        __m256i classes = _mm256_and_si256(high, low);
+
+        // movemask of "no bit of the kind set", inverted
+        uint32_t not_delim = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(classes, delim_bits), zero));
+        uint32_t not_special = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(classes, special_bits), zero));
+        masks.delims |= (uint64_t) ~not_delim << i;
+        masks.specials |= (uint64_t) ~not_special << i;
+    }
+    return masks;
+}
+#endif
+
+const char_scanner char_scanners[] = {
+    {"scalar", classify_scalar},
+#ifdef SHELL_LITE_X86
+    {"sse2", classify_sse2},
+    {"avx2", classify_avx2},
+#endif
+};
+
+// scanner used by tokenize_line, set by init_char_scanner()
+const char_scanner* active_scanner = &char_scanners[0];
+
+/*
+    Tokens
+    Produced by tokenize_line, they refer to the source text by offset.
+*/
+enum token_type : uint8_t {
+    TOK_WORD,
+    TOK_NEWLINE,
+    TOK_SEMI,       // ;
+    TOK_AMP,        // &
+    TOK_AND_IF,     // &&
+    TOK_OR_IF,      // ||
+    TOK_PIPE,       // |
+    TOK_LESS,       // <
+    TOK_GREAT,      // >
+    TOK_DGREAT,     // >>
+    TOK_LESSAND,    // <&
+    TOK_GREATAND,   // >&
+    TOK_DLESS,      // <<
+    TOK_LPAREN,     // (
+    TOK_RPAREN,     // )
+    TOK_END
+};
+
+// the word has quotes or backslashes that have to be removed
+const uint8_t WORD_QUOTED = 1 << 0;
+// the word has $ expansions
+const uint8_t WORD_EXPAND = 1 << 1;
+// the word has unquoted *, ? or [ and may be a pattern
+const uint8_t WORD_GLOB = 1 << 2;
+// the word is a ((expression)) command
+const uint8_t WORD_ARITH = 1 << 3;
+// the word has unquoted { and may be a brace expansion
+const uint8_t WORD_BRACE = 1 << 4;
+
+struct token {
+    token_type type;
+    // WORD_* flags of words
+    uint8_t flags;
+    // redirections: the fd written before the operator, -1 if there is none
+    int16_t fd;
+    // position of the token in the source text
+    uint32_t start;
+    uint32_t len;
+};
+
+/*
+    Abstract syntax tree
+    All the nodes of a parsed line or script live in one contiguous array
+    and refer to each other by index, words refer to the source text by
+    offset. A parsed tree can be executed any number of times and, having
+    no pointers in it, stored and loaded as it is.
+
+    LIST      items separated by ; & or newlines, children: the items
+    AND, OR   children: the left and the right side
+    PIPELINE  children: the commands
+    CMD       simple command, children: words and redirections in order
+    FOR       for loop, children: the variable name, the len words after
+              `in`, the body LIST, then the redirections after `done`
+    REDIR     child: the target word
+    WORD      the text [first, first + len) of the source
+*/
+enum ast_kind : uint8_t {
+    AST_LIST,
+    AST_AND,
+    AST_OR,
+    AST_PIPELINE,
+    AST_CMD,
+    AST_FOR,
+    AST_REDIR,
+    AST_WORD
+};
+
+// the list item was terminated by '&'
+const uint8_t NODE_BACKGROUND = 1 << 0;
+
+// fields produced by expanding the words of a command, in the line arena
+struct expansion {
+    char** fields;
+    size_t n_fields;
+    size_t max_fields;
+    // the field being built
+    char* buf;
+    size_t len;
+    size_t capacity;
+    // the field exists even if it is empty, e.g. it had quotes
+    bool started;
+    // unquoted expansion results are split into fields at $IFS
+    bool split;
+    // the fields are patterns: quoted *?[\ are escaped with a backslash
+    bool glob;
+    // the current field has unquoted glob characters
+    bool field_globs;
+};
+
+struct ast_node {
+    ast_kind kind;
+    // WORD: WORD_* flags, REDIR: the operator token, others: NODE_* flags
+    uint8_t flags;
+    // REDIR: the fd being redirected
+    int16_t fd;
+    // index of the first child, WORD: offset of the text
+    uint32_t first;
+    // number of children, CMD: number of words, WORD: length of the text
+    uint32_t len;
+    // index of the next sibling, 0 for the last one. The root is node 0
+    // and is never anyone's sibling.
+    uint32_t next;
+};
+
+struct ast {
+    // source text the words point into
+    const char* text;
+    const ast_node* nodes;
+    uint32_t n_nodes;
+};
+
+/*
+    Launch backends
+    spawn: posix_spawn(), glibc implements it with clone(CLONE_VM | CLONE_VFORK)
+           so the page tables of the shell are never copied. The default,
+           spawn file actions and attributes cover all the setup a command
+           needs: fd remaps and the process group.
+    fork: classic fork() + execve(), only used when pinned. Built-ins and
+          compound commands that run in a child fork on their own.
+    zygote: a helper process forked when the shell starts, while it is still
+            small, forks the commands on behalf of the shell. Its children
+            are created with CLONE_PARENT, so they are children of the shell.
+*/
+enum class launch_mode { automatic, spawn, fork, zygote };
+
+// Can be pinned with SHELL_LITE_LAUNCH=spawn|fork|zygote, mostly useful for
+// comparing the backends. The zygote is only started when asked for.
+launch_mode launch_backend = launch_mode::automatic;
+
+// socket to the zygote, -1 when there is none
+int zygote_fd = -1;
+
+// the process that started the zygote, the only one its children belong to
+pid_t zygote_owner = -1;
+
+// fds passed with every request: cwd, stdin, stdout, stderr
+const size_t ZYGOTE_BASE_FDS = 4;
+
+// most fds a single SCM_RIGHTS message can carry (SCM_MAX_FD)
+const size_t ZYGOTE_MAX_FDS = 253;
+
+// launch request, followed by n_remaps {fd index, dst} pairs of int32_t and
+// the NUL terminated path, arguments and environment
+struct zygote_request {
+    uint32_t n_args;
+    uint32_t n_env;
+    uint32_t n_remaps;
+    int32_t pgid;
+    uint32_t umask;
+    uint32_t payload_len;
+};
+
+struct zygote_reply {
+    int32_t pid;
+    // errno of the failed fork or exec, 0 on success
+    int32_t err;
+};
+
+// src is duplicated onto dst in the child, a src of -1 closes dst
+struct fd_remap {
+    int src;
+    int dst;
+};
+
+// what has to be set up for a launched command
+struct launch_opts {
+    // applied in order, like the redirections they come from
+    const fd_remap* remaps = nullptr;
+    size_t n_remaps = 0;
+    // process group to put the child in: -1 keeps the group of the shell,
+    // 0 makes the child the leader of a new group
+    pid_t pgid = -1;
+};
+
+// false when running a script or a -c command string, there is no
+// banner, prompt or chatter on stdout in that case
+bool interactive = true;
+
+// exit status of the last command, like $? in other shells
+int last_status = 0;
+
+// set by built-ins that need an exit status other than 0 or 1, see run_builtin()
+int builtin_status = -1;
+
+// expansions that failed so far, e.g. $((1/0)). A command is not run if the
+// count changed while its words were expanded.
+size_t expansion_errors = 0;
+
+/*
+    Command timing
+    Where the time of the last command went, reported by the time built-in.
+    The parse times belong to the line (or script) the command is on.
+*/
+struct cmd_timing {
+    uint64_t tokenize_ns;
+    uint64_t parse_ns;
+    // PATH lookup of the last external command
+    uint64_t lookup_ns;
+    // from the launch call till it returned the pid
+    uint64_t spawn_ns;
+    // from the launch till the child was reaped
+    uint64_t wait_ns;
+    // resource usage of the last waited for command, from wait4
+    struct rusage usage;
+    bool have_usage;
+};
+
+cmd_timing timing;
+
+// capacity requested for pipeline pipes, the default 64KB makes
+// the stages of a pipeline take turns far too often
+const int PIPE_SIZE = 1 << 20;
+
+// amount of data moved per splice/tee call by the forwarding built-ins
+const size_t FORWARD_CHUNK = 1 << 20;
+
+/*
+    Jobs
+    Commands started with & keep running while the shell reads the next
+    line. Every process of a job gets a pidfd registered in one epoll
+    instance, so finished processes are found without polling them one by one.
+*/
+enum class job_state { running, stopped, done };
+
+struct job_process {
+    pid_t pid;
+    // -1 when the kernel has no pidfd_open, the process is polled then
+    int pidfd;
+    // wait status, once done
+    int status;
+    bool done;
+};
+
+struct job {
+    int id;
+    // -1 when the job shares the process group of the shell
+    pid_t pgid;
+    job_state state;
+    // source text of the job, for listings
+    string cmd;
+    vector<job_process> procs;
+};
+
+// ordered by job id
+vector<job> job_table;
+
+// epoll instance the pidfds are registered with, created with the first job
+int job_epoll_fd = -1;
+
+/*
+    Command hash
+    Resolved locations of external commands, so that a repeated command
+    doesn't walk every $PATH directory again.
+*/
+struct hashed_cmd {
+    string path;
+    // number of times the entry was used
+    size_t hits;
+};
+
+unordered_map<string, hashed_cmd> cmd_hash_table;
+
+// PATH value the hash table was built against
+string hashed_path_env;
+
+// inotify fd watching the PATH directories, -1 when watching is disabled
+int path_watch_fd = -1;
+
+/*
+    Variables
+    Shell and exported variables live in an open addressing table probed
+    linearly by name. Names are interned in var_names and a slot is never
+    emptied again, an unset variable just loses its value, so there are no
+    tombstones. Every variable keeps its NAME=value entry, the envp of the
+    launched commands points at the entries of the exported ones and is
+    only rebuilt after one of them changed.
+*/
+struct shell_var {
+    // interned, nullptr for an empty slot
+    const char* name;
+    uint32_t name_len;
+    uint32_t hash;
+    // NAME=value, the value starts at name_len + 1
+    string entry;
+    bool set;
+    bool exported;
+    // the value as an integer, for arithmetic, see var_int()
+    bool int_valid;
+    int64_t int_value;
+};
+
+// power of two sized, at most half full
+vector<shell_var> var_table;
+size_t n_var_slots = 0;
+// changes whenever the variables move, pointers into var_table kept
+// with the same generation are still valid
+uint32_t var_generation = 0;
+
+// names of the variables, they live as long as the shell
+arena var_names;
+
+// NULL-terminated envp of launched commands, see shell_envp()
+vector<char*> env_cache;
+bool env_dirty = true;
+
+// $$, the shell itself also in subshells
+pid_t shell_pid;
+
+// a variable before the assignments of a command, see save_assignments()
+struct saved_var {
+    const char* name;
+    size_t len;
+    // copy of the value, nullptr if it wasn't set
+    char* value;
+    bool was_set;
+    bool was_exported;
+};
+
+// a built-in command, its function and the line shown by help
+struct builtin_desc {
+    const char* name;
+    func fn;
+    const char* description;
+    // only writes to cout and leaves the shell as it was, so a command
+    // substitution can run it in-process
+    bool pure = false;
+};
+
+// the built-in commands of the shell, looked up through builtin_index
+constexpr builtin_desc builtin_table[] = {
+    {"cd", cmd_cd, "Change the current working directory"},
+    {"help", cmd_help, "Help menu for the shell", true},
+    {"exit", cmd_exit, "Exit the shell. Usage: exit [status]"},
+    {"echo", cmd_echo, "Write the arguments. Usage: echo [-neE] [arg ...]", true},
+    {"printf", cmd_printf, "Write formatted output. Usage: printf format [arg ...]", true},
+    {"test", cmd_test, "Evaluate a condition. Usage: test expr", true},
+    {"[", cmd_test, "Evaluate a condition. Usage: [ expr ]", true},
+    {"pwd", cmd_pwd, "Print the current directory. Usage: pwd [-L | -P]", true},
+    {"true", cmd_true, "Do nothing, successfully", true},
+    {"false", cmd_false, "Do nothing, unsuccessfully", true},
+    {"export", cmd_export, "Export variables to the launched commands. Usage: export [-p] [name[=value] ...]"},
+    {"unset", cmd_unset, "Remove variables. Usage: unset [-v] name ..."},
+    {"hash", cmd_hash, "Remember command locations. Usage: hash [-r] [-l] [-p path name] [name ...]"},
+    {"allocs", cmd_allocs, "Show the heap allocation counters of the shell"},
+    {"cat", cmd_cat, "Concatenate files, moving the data inside the kernel. Usage: cat [file ...]"},
+    {"tee", cmd_tee, "Copy stdin to stdout and files without copying it through the shell. Usage: tee [-a] [file ...]"},
+    {"jobs", cmd_jobs, "List the background jobs. Usage: jobs [-l]"},
+    {"fg", cmd_fg, "Move a job to the foreground. Usage: fg [%job]"},
+    {"bg", cmd_bg, "Resume a stopped job in the background. Usage: bg [%job]"},
+    {"wait", cmd_wait, "Wait for background jobs to finish. Usage: wait [%job | pid ...]"},
+    {"parallel", cmd_parallel, "Run a command for every input line, N at a time. Usage: parallel [-j N] [-k] [-a file] command [arg ...], {} is replaced by the line"},
+    {"time", cmd_time, "Run a command and report its resource usage and the overhead of the shell. Usage: time command [arg ...]"},
+    {"bench", cmd_bench, "Run a command repeatedly and report timing statistics. Usage: bench [-n runs] [-w warmup] [-p prepare] [-i] [-o] [-j file] command [arg ...]"},
+    {"enable", cmd_enable, "Load built-ins from a shared object, see shell_plugin.h. Usage: enable [-f lib.so | -d] [name ...]"},
+    {"((", cmd_arith, "Evaluate an arithmetic expression, true if it isn't 0. Usage: ((expression))"}
+};
+
+constexpr size_t N_BUILTINS = sizeof(builtin_table) / sizeof(builtin_table[0]);
+
+// slots of the perfect hash over the built-in names, a power of two
+constexpr size_t BUILTIN_SLOTS = 64;
+
+/**
+ * @brief Seeded FNV-1a hash of a built-in name
+ * @param name NUL-terminated name
+ * @param seed Seed picked by make_builtin_index
+ * @return The hash, masked with BUILTIN_SLOTS - 1 it is the slot of the name
+ */
+constexpr uint32_t builtin_hash(const char* name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (; *name; ++name)
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+// slot -> position in builtin_table, -1 for an empty slot
+struct builtin_index {
+    uint32_t seed;
+    int8_t slots[BUILTIN_SLOTS];
+};
+
+/**
+ * @brief Searches for a seed that gives every built-in its own slot
+ * @return The index, with seed 0 if there is none
+ * @remark Evaluated by the compiler, a name is found with one hash and
+ * one strcmp at runtime.
+ */
+constexpr builtin_index make_builtin_index() {
+    for (uint32_t seed = 1; seed < (1u << 16); ++seed) {
+        builtin_index index{seed, {}};
+        for (int8_t& slot: index.slots)
+            slot = -1;
+
+        bool collision = false;
+        for (size_t i = 0; i < N_BUILTINS && !collision; ++i) {
+            int8_t& slot = index.slots[builtin_hash(builtin_table[i].name, seed) & (BUILTIN_SLOTS - 1)];
+            collision = slot >= 0;
+            slot = (int8_t) i;
+        }
+        if (!collision)
+            return index;
+    }
+    return {0, {}};
+}
+
+constexpr builtin_index builtin_lookup = make_builtin_index();
+static_assert(builtin_lookup.seed != 0, "no perfect hash for the built-in names, increase BUILTIN_SLOTS");
+
+// a built-in added at runtime
+struct extra_builtin {
+    builtin_desc desc;
+    // dlopen handle of the plugin it comes from, nullptr if there is none
+    void* handle;
+};
+
+// arguments of test/[ and the position they are parsed at
+struct test_parser {
+    char** args;
+    int n;
+    int pos;
+    // set on an invalid expression, the exit status is 2 then
+    bool error;
+};
+
+// built-ins added at runtime, searched after builtin_table
+vector<extra_builtin> extra_builtins;
+
+////////////////////////// Implementations //////////////////////////
+
+/**
+ * @brief Monotonic clock in nanoseconds, for timing the stages of a command
+ */
+inline uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+    Command execution
+*/
+
+/**
+ * @brief Arguments that run an executable without a #! line with /bin/sh
+ * @param path Resolved location of the executable
+ * @param args NULL-terminated array of command arguments
+ * @return /bin/sh, path and the arguments after args[0], allocated from the
+ * line arena
+ * @remark For an exec that failed with ENOEXEC, execvp does the same.
+ */
+char** script_args(const char* path, char** args) {
+    size_t n_args = 0;
+    while (args[n_args])
+        n_args++;
+
+    char** sh_args = (char**) line_arena.alloc(sizeof(char*) * (n_args + 2), alignof(char*));
+    sh_args[0] = (char*) _PATH_BSHELL;
+    sh_args[1] = (char*) path;
+    // args[1] up to and with the terminating NULL
+    memcpy(sh_args + 2, args + 1, sizeof(char*) * n_args);
+    return sh_args;
+}
+
+/**
+ * @brief Launches a command using posix_spawn
+ * @param path Resolved location of the command
+ * @param args NULL-terminated array of command arguments
+ * @param opts fd setup of the child, done with spawn file actions
+ * @return pid of the child process, -1 on failure
+ * @remark The child shares the memory of the shell until it calls exec, the
+ * parent is suspended till then. This makes the launch cost independent of
+ * the size of the shell process, unlike fork() which has to copy the page tables.
+ */
+pid_t spawn_child(const char* path, char** args, const launch_opts& opts) {
+    pid_t pid;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t* actions_ptr = nullptr;
+
+    if (opts.n_remaps > 0) {
+        posix_spawn_file_actions_init(&actions);
+        for (size_t i = 0; i < opts.n_remaps; ++i) {
+            const fd_remap& remap = opts.remaps[i];
+            if (remap.src < 0)
+                posix_spawn_file_actions_addclose(&actions, remap.dst);
+            else
+                posix_spawn_file_actions_adddup2(&actions, remap.src, remap.dst);
+        }
+        actions_ptr = &actions;
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_t* attr_ptr = nullptr;
+
+    if (opts.pgid >= 0) {
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, opts.pgid);
+        attr_ptr = &attr;
+    }
+
+    // posix_spawn returns the error number instead of setting errno, the
+    // exec errors of the child (e.g. command not found) are also reported here.
+    int err = posix_spawn(&pid, path, actions_ptr, attr_ptr, args, shell_envp());
+    if (err == ENOEXEC)
+        err = posix_spawn(&pid, _PATH_BSHELL, actions_ptr, attr_ptr, script_args(path, args), shell_envp());
+
+    if (actions_ptr)
+        posix_spawn_file_actions_destroy(actions_ptr);
+    if (attr_ptr)
+        posix_spawnattr_destroy(attr_ptr);
+
+    if (err != 0) {
+        errno = err;
+        perror("[shell] Error launching command.");
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * @brief Launches a command using fork and execve
+ * @param path Resolved location of the command
+ * @param args NULL-terminated array of command arguments
+ * @param opts fd setup of the child, done between fork and exec
+ * @return pid of the child process, -1 on failure
+ */
+pid_t fork_child(const char* path, char** args, const launch_opts& opts) {
+    char** envp = shell_envp();
+    pid_t pid = fork();
+
+    // child process
+    if (pid == 0) {
+        if (opts.pgid >= 0)
+            setpgid(0, opts.pgid);
+        for (size_t i = 0; i < opts.n_remaps; ++i) {
+            const fd_remap& remap = opts.remaps[i];
+            if (remap.src < 0)
+                close(remap.dst);
+            else
+                dup2(remap.src, remap.dst);
+        }
+
+        execve(path, args, envp);
+        if (errno == ENOEXEC)
+            execve(_PATH_BSHELL, script_args(path, args), envp);
+        // exec only returns on error. The child must not return to the
+        // caller, otherwise there will be two shells reading the same input.
+        perror("[shell] Error launching command.");
+        _exit(127);
+    }
+    // error forking
+    else if (pid < 0) {
+        cerr << "Error forking process: " <<  getpid() << '\n';
+        perror("[shell] Error forking child process.");
+    }
+    // also done by the parent, so that the group exists before the next
+    // command of a pipeline joins it, whichever process runs first
+    else if (opts.pgid >= 0) {
+        setpgid(pid, opts.pgid == 0 ? pid : opts.pgid);
+    }
+    return pid;
+}
+
+/*
+    Zygote
+    posix_spawn doesn't copy the page tables of the shell, but the kernel
+    still has to set up the child from the shell process. The zygote is
+    forked right at startup and stays small, the shell sends it the resolved
+    path, arguments, environment and fds of a command and it forks the
+    command from its own address space.
+*/
+
+/**
+ * @brief Sends a whole buffer, without dying of SIGPIPE if the peer is gone
+ * @return true on success
+ */
+bool send_all(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Launches a command through the zygote
+ * @param path Resolved location of the command
+ * @param args NULL-terminated array of command arguments
+ * @param opts fd setup of the child, the fds are passed to the zygote
+ * @return pid of the child process, -1 on failure
+ * @remark Falls back to posix_spawn in forked copies of the shell, whose
+ * children the zygote can't create, and when the zygote is gone.
+ */
+pid_t zygote_child(const char* path, char** args, const launch_opts& opts) {
+    if (zygote_fd < 0 || getpid() != zygote_owner || ZYGOTE_BASE_FDS + opts.n_remaps > ZYGOTE_MAX_FDS)
+        return spawn_child(path, args, opts);
+
+    arena::position mark = line_arena.mark();
+
+    zygote_request req = {};
+    req.pgid = opts.pgid;
+    req.umask = umask(0);
+    umask(req.umask);
+
+    // the shell may have changed directory or its stdio since the zygote started
+    int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int* fds = (int*) line_arena.alloc(sizeof(int) * (ZYGOTE_BASE_FDS + opts.n_remaps), alignof(int));
+    size_t n_fds = 0;
+    fds[n_fds++] = cwd_fd;
+    fds[n_fds++] = STDIN_FILENO;
+    fds[n_fds++] = STDOUT_FILENO;
+    fds[n_fds++] = STDERR_FILENO;
+
+    size_t len = sizeof(int32_t) * 2 * opts.n_remaps + strlen(path) + 1;
+    for (; args[req.n_args]; ++req.n_args)
+        len += strlen(args[req.n_args]) + 1;
+    char** envp = shell_envp();
+    for (; envp[req.n_env]; ++req.n_env)
+        len += strlen(envp[req.n_env]) + 1;
+
+    char* msg_buf = (char*) line_arena.alloc(sizeof(req) + len, alignof(zygote_request));
+    int32_t* remaps = (int32_t*) (msg_buf + sizeof(req));
+    for (size_t i = 0; i < opts.n_remaps; ++i) {
+        const fd_remap& remap = opts.remaps[i];
+        remaps[2 * i] = remap.src < 0 ? -1 : (int32_t) n_fds;
+        remaps[2 * i + 1] = remap.dst;
+        if (remap.src >= 0)
+            fds[n_fds++] = remap.src;
+    }
+    req.n_remaps = opts.n_remaps;
+
+    char* p = (char*) (remaps + 2 * opts.n_remaps);
+    p = stpcpy(p, path) + 1;
+    for (uint32_t i = 0; i < req.n_args; ++i)
+        p = stpcpy(p, args[i]) + 1;
+    for (uint32_t i = 0; i < req.n_env; ++i)
+        p = stpcpy(p, envp[i]) + 1;
+    req.payload_len = len;
+    memcpy(msg_buf, &req, sizeof(req));
+
+    // the fds go with the first bytes of the request
+    size_t control_len = CMSG_SPACE(sizeof(int) * n_fds);
+    char* control = (char*) line_arena.alloc(control_len, alignof(cmsghdr));
+    memset(control, 0, control_len);
+
+    iovec iov = { msg_buf, sizeof(req) + len };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = control_len;
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+
+    ssize_t sent;
+    while ((sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+
+    zygote_reply reply;
+    bool ok = cwd_fd >= 0 && sent > 0
+        && send_all(zygote_fd, msg_buf + sent, sizeof(req) + len - sent)
+        && read_exact(zygote_fd, (char*) &reply, sizeof(reply));
+
+    if (cwd_fd >= 0)
+        close(cwd_fd);
+    line_arena.release(mark);
+
+    if (!ok) {
+        // the zygote is gone, the shell launches on its own from now on
+        cerr << "[shell] zygote unavailable, falling back to posix_spawn" << '\n';
+        close(zygote_fd);
+        zygote_fd = -1;
+        return spawn_child(path, args, opts);
+    }
+
+    if (reply.err != 0) {
+        // a child whose exec failed is still a child of the shell
+        if (reply.pid > 0)
+            waitpid(reply.pid, nullptr, 0);
+        errno = reply.err;
+        perror("[shell] Error launching command.");
+        return -1;
+    }
+    return reply.pid;
+}
+
+/**
+ * @brief Forks a command in the zygote, as a child of the shell
+ * @param req The request
+ * @param fds The fds that came with the request
+ * @param payload Remaps, path, arguments and environment of the request
+ * @return pid of the child and the error of a failed fork or exec
+ * @remark The zygote waits till the child has called exec, a close-on-exec
+ * pipe reports an exec error, so the shell gets errors like posix_spawn's.
+ */
+zygote_reply zygote_launch(const zygote_request& req, int* fds, size_t n_fds, char* payload) {
+    const int32_t* remaps = (const int32_t*) payload;
+    char* p = payload + sizeof(int32_t) * 2 * req.n_remaps;
+    char* path = p;
+    p += strlen(p) + 1;
+
+    vector<char*> args(req.n_args + 1, nullptr);
+    for (uint32_t i = 0; i < req.n_args; ++i, p += strlen(p) + 1)
+        args[i] = p;
+    vector<char*> env(req.n_env + 1, nullptr);
+    for (uint32_t i = 0; i < req.n_env; ++i, p += strlen(p) + 1)
+        env[i] = p;
+
+    int err_pipe[2];
+    if (pipe2(err_pipe, O_CLOEXEC) != 0)
+        return { -1, errno };
+
+    // like fork, except that the parent of the child is the shell
+    pid_t pid = (pid_t) syscall(SYS_clone, CLONE_PARENT | SIGCHLD, nullptr, nullptr, nullptr, nullptr);
+
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+
+        if (req.pgid >= 0)
+            setpgid(0, req.pgid);
+        fchdir(fds[0]);
+        umask(req.umask);
+
+        // move the received fds out of the way of the fds being set up
+        for (size_t k = 1; k < n_fds; ++k) {
+            bool taken = fds[k] <= STDERR_FILENO;
+            for (uint32_t i = 0; i < req.n_remaps && !taken; ++i)
+                taken = fds[k] == remaps[2 * i + 1];
+            if (taken)
+                fds[k] = fcntl(fds[k], F_DUPFD_CLOEXEC, 10);
+        }
+
+        for (int fd = 0; fd < 3; ++fd)
+            dup2(fds[fd + 1], fd);
+        for (uint32_t i = 0; i < req.n_remaps; ++i) {
+            int32_t src = remaps[2 * i];
+            if (src < 0 || (size_t) src >= n_fds)
+                close(remaps[2 * i + 1]);
+            else
+                dup2(fds[src], remaps[2 * i + 1]);
+        }
+
+        execve(path, args.data(), env.data());
+        if (errno == ENOEXEC)
+            execve(_PATH_BSHELL, script_args(path, args.data()), env.data());
+        int err = errno;
+        write(err_pipe[1], &err, sizeof(err));
+        _exit(127);
+    }
+
+    zygote_reply reply = { pid, 0 };
+    close(err_pipe[1]);
+    if (pid < 0) {
+        reply.err = errno;
+    }
+    else {
+        ssize_t n;
+        // EOF: the exec went through
+        while ((n = read(err_pipe[0], &reply.err, sizeof(reply.err))) < 0 && errno == EINTR);
+        if (n != sizeof(reply.err))
+            reply.err = 0;
+    }
+    close(err_pipe[0]);
+    return reply;
+}
+
+/**
+ * @brief Serves the launch requests of the shell, runs in the zygote
+ * @param sock Socket to the shell, the zygote exits when the shell closes it
+ */
+void zygote_loop(int sock) {
+    // Ctrl-C and Ctrl-Z at the terminal are meant for the commands
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+
+    vector<char> payload;
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+
+    while (true) {
+        zygote_request req;
+        iovec iov = { &req, sizeof(req) };
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n;
+        while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+        if (n <= 0)
+            _exit(0);
+
+        int fds[ZYGOTE_MAX_FDS];
+        size_t n_fds = 0;
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+            n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n_fds);
+        }
+
+        if ((size_t) n < sizeof(req) && !read_exact(sock, (char*) &req + n, sizeof(req) - n))
+            _exit(0);
+        payload.resize(req.payload_len + 1);
+        if (!read_exact(sock, payload.data(), req.payload_len))
+            _exit(0);
+        payload[req.payload_len] = '\0';
+
+        zygote_reply reply = n_fds < ZYGOTE_BASE_FDS ? zygote_reply{ -1, EINVAL }
+                                                     : zygote_launch(req, fds, n_fds, payload.data());
+
+        for (size_t k = 0; k < n_fds; ++k)
+            close(fds[k]);
+        if (!send_all(sock, (const char*) &reply, sizeof(reply)))
+            _exit(0);
+    }
+}
+
+/**
+ * @brief Forks the zygote, has to be called before the shell grows
+ * @return true if the zygote is running
+ */
+bool start_zygote() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        perror("[shell] Error creating the zygote socket.");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_loop(sv[1]);
+    }
+    close(sv[1]);
+
+    if (pid < 0) {
+        perror("[shell] Error forking the zygote.");
+        close(sv[0]);
+        return false;
+    }
+
+    zygote_fd = sv[0];
+    zygote_owner = getpid();
+    return true;
+}
+
+/**
+ * @brief Waits for a child process to terminate
+ * @param pid Process id of the child
+ * @param usage Receives the resource usage of the child, if not null
+ * @return wait status of the child, an exit status of 127 if it can't be
+ * waited for
+ */
+int wait_child(pid_t pid, struct rusage* usage) {
+    int status = 0;
+    do {
+        // wait till the child is not stopped, when
+        // it does, return the status of the child.
+        // A signal interrupting the wait retries it, status is not set then
+        int r;
+        while ((r = wait4(pid, &status, WUNTRACED, usage)) == -1 && errno == EINTR);
+        if (r == -1) {
+            perror("[shell] Error waiting for child process.");
+            // the status of the child is lost, it must not look like a success
+            status = W_EXITCODE(127, 0);
+            break;
+        }
+    }
+    // the child process state can change multiple times
+    // during its execution and due to that it can be at "Stopped"
+    // state.
+    // WIFEXITED(status) returns true if the child terminated normally
+    // WIFSIGNALED(status) returns true if the child process was terminated by a signal
+    // So we continue only if the child process didnt exit or wasnt
+    // signalled to stop 
+    while(!WIFEXITED(status) && !WIFSIGNALED(status));
+
+    return status;
+}
+
+/**
+ * @brief Runs a built-in in a child process, for pipeline stages
+ * @param builtin The built-in
+ * @param args NULL-terminated array of command arguments
+ * @param opts fd setup of the child
+ * @return pid of the child process, -1 on failure
+ * @remark This is the in-child setup that needs fork, posix_spawn can
+ * only run another program.
+ */
+pid_t fork_builtin(func builtin, char** args, const launch_opts& opts) {
+    // the child would write out a copy of whatever is buffered
+    cout.flush();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (opts.pgid >= 0)
+            setpgid(0, opts.pgid);
+        for (size_t i = 0; i < opts.n_remaps; ++i) {
+            const fd_remap& remap = opts.remaps[i];
+            if (remap.src < 0)
+                close(remap.dst);
+            else
+                dup2(remap.src, remap.dst);
+        }
+
+        int status = run_builtin(builtin, args);
+        cout.flush();
+        _exit(status);
+    }
+    else if (pid < 0) {
+        perror("[shell] Error forking child process.");
+    }
+    else if (opts.pgid >= 0) {
+        setpgid(pid, opts.pgid == 0 ? pid : opts.pgid);
+    }
+    return pid;
+}
+
+/**
+ * @brief Starts an external command without waiting for it
+ * @param args NULL-terminated array of command arguments
+ * @param opts fd setup of the child
+ * @return pid of the child process, -1 on failure (last_status is set)
+ * @remark posix_spawn is used unless SHELL_LITE_LAUNCH pins another
+ * backend, fd remapping is done by spawn file actions. Every backend runs
+ * an executable without a #! line with /bin/sh, like execvp.
+ */
+pid_t start_external_cmd(char** args, const launch_opts& opts) {
+    // the child writes to the same stdout, whatever the shell buffered goes first
+    cout.flush();
+
+    uint64_t start = now_ns();
+    const char* path = find_cmd(args[0]);
+    uint64_t found = now_ns();
+    timing.lookup_ns = found - start;
+
+    if (!path) {
+        cerr << "[shell] " << args[0] << ": command not found" << '\n';
+        last_status = 127;
+        return -1;
+    }
+
+    pid_t pid = launch_backend == launch_mode::fork   ? fork_child(path, args, opts)
+              : launch_backend == launch_mode::zygote ? zygote_child(path, args, opts)
+                                                      : spawn_child(path, args, opts);
+    timing.spawn_ns = now_ns() - found;
+
+    if (pid < 0) {
+        // the hashed location can go stale when the binary is removed, forget it
+        // so that the next attempt searches PATH again
+        cmd_hash_table.erase(args[0]);
+        // same status as other shells use for a command that can't be run
+        last_status = 127;
+    }
+    return pid;
+}
+
+/**
+ * @brief Starts a built-in or external command without waiting for it
+ * @param args NULL-terminated array of command arguments
+ * @param opts fd setup of the child
+ * @return pid of the child process, -1 on failure (last_status is set)
+ */
+pid_t start_cmd(char** args, const launch_opts& opts) {
+    if (func builtin = find_builtin(args[0]))
+        return fork_builtin(builtin, args, opts);
+    return start_external_cmd(args, opts);
+}
+
+/**
+ * @brief Converts a wait status into an exit status like $?
+ */
+int exit_status(int wait_status) {
+    return WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 128 + WTERMSIG(wait_status);
+}
+
+/**
+ * @brief Launches an external command in a child process
+ * @param args NULL-terminated array of command arguments
+ * @param opts fd setup of the child
+ * @return 1 on success, 0 on failure
+ */
+int launch_cmd(char** args, const launch_opts& opts = {}) {
+    pid_t pid = start_external_cmd(args, opts);
+
+    if (pid < 0)
+        return 0;
+
+    uint64_t start = now_ns();
+    last_status = exit_status(wait_child(pid, &timing.usage));
+    timing.wait_ns = now_ns() - start;
+    timing.have_usage = true;
+    return 1;
+}
+
+/**
+ * @brief Applies fd remaps to the shell itself, for built-in commands
+ * @param opts Remaps to apply
+ * @param saved Receives a copy of every overwritten fd, -1 if it wasn't open
+ * @return true on success
+ */
+bool apply_fd_remaps(const launch_opts& opts, int* saved) {
+    // output buffered so far belongs to the old fds
+    cout.flush();
+
+    for (size_t i = 0; i < opts.n_remaps; ++i) {
+        const fd_remap& remap = opts.remaps[i];
+        // keep the copy away from the low fds a redirection could name
+        saved[i] = fcntl(remap.dst, F_DUPFD_CLOEXEC, 10);
+
+        if (remap.src < 0) {
+            close(remap.dst);
+        }
+        else if (dup2(remap.src, remap.dst) < 0) {
+            perror("[shell] Error redirecting.");
+            restore_fd_remaps({opts.remaps, i + 1}, saved);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Undoes apply_fd_remaps
+ * @param opts Remaps that were applied
+ * @param saved Copies made by apply_fd_remaps
+ */
+void restore_fd_remaps(const launch_opts& opts, const int* saved) {
+    cout.flush();
+
+    // in reverse, so an fd remapped twice ends up with its first copy
+    for (size_t i = opts.n_remaps; i-- > 0;) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], opts.remaps[i].dst);
+            close(saved[i]);
+        }
+        else {
+            close(opts.remaps[i].dst);
+        }
+    }
+}
+
+/**
+ * @brief Executes a command based on whether built-in or external command.
+ * @param args Array of command arguments (NULL-terminated)
+ * @param n_args Number of arguments
+ * @param opts fd setup of the command
+ * @return 1 on success, 0 on failure
+ */
+int execute_cmd(char** args, size_t n_args, const launch_opts& opts = {}) {
+    if (n_args == 0) {
+        cout << "Empty command entered, please enter your input..." << '\n';
+        return 1;
+    }
+
+    // check if it is one of the built-in commands
+    if (func builtin = find_builtin(args[0])) {
+        // built-ins run inside the shell, so the redirections are applied
+        // to the shell for the duration of the command
+        int* saved = (int*) line_arena.alloc(sizeof(int) * opts.n_remaps, alignof(int));
+        if (!apply_fd_remaps(opts, saved)) {
+            last_status = 1;
+            return 0;
+        }
+
+        last_status = run_builtin(builtin, args);
+
+        restore_fd_remaps(opts, saved);
+        return last_status == 0;
+    }
+
+    // Launch the external command
+    return launch_cmd(args, opts);
+}
+
+/**
+ * @brief Looks up a built-in command
+ * @param name Name of the command
+ * @return The built-in, nullptr if there is none with that name
+ */
+func find_builtin(const char* name) {
+    const builtin_desc* desc = find_builtin_desc(name);
+    return desc ? desc->fn : nullptr;
+}
+
+/**
+ * @brief Looks up the table entry of a built-in command
+ * @param name Name of the command
+ * @return The entry, nullptr if there is no built-in with that name
+ */
+const builtin_desc* find_builtin_desc(const char* name) {
+    int8_t i = builtin_lookup.slots[builtin_hash(name, builtin_lookup.seed) & (BUILTIN_SLOTS - 1)];
+    if (i >= 0 && strcmp(builtin_table[i].name, name) == 0)
+        return &builtin_table[i];
+
+    for (const extra_builtin& builtin: extra_builtins)
+        if (strcmp(builtin.desc.name, name) == 0)
+            return &builtin.desc;
+    return nullptr;
+}
+
+/**
+ * @brief Adds a built-in command at runtime
+ * @param name Name of the command
+ * @param fn Function of the command
+ * @param description Line shown by help
+ * @param handle dlopen handle of the plugin, closed when the built-in is removed
+ * @return false if there already is a built-in with that name
+ * @remark The strings are not copied, they have to outlive the built-in.
+ */
+bool register_builtin(const char* name, func fn, const char* description, void* handle = nullptr) {
+    if (find_builtin(name))
+        return false;
+    extra_builtins.push_back({ { name, fn, description }, handle });
+    return true;
+}
+
+/**
+ * @brief Loads a built-in from a plugin
+ * @param path Path of the shared object
+ * @param name Name of the built-in, the plugin defines it as name_builtin
+ * @return true if the built-in was added
+ * @remark Every loaded built-in holds its own reference to the shared
+ * object, so that they can be removed one by one. The name in the
+ * descriptor has to match, the built-in is registered under it. Static
+ * builds (SHELL_LITE_STATIC) can't load plugins: the plugin would bring its
+ * own libstdc++, and its cout would bypass the buffering of the shell.
+ */
+bool load_builtin(const char* path, const char* name) {
+#ifdef SHELL_LITE_STATIC
+    cerr << "[shell] enable: " << path << ": loading plugins is not supported by static builds" << '\n';
+    return false;
+#else
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        cerr << "[shell] enable: " << dlerror() << '\n';
+        return false;
+    }
+
+    string symbol = string(name) + "_builtin";
+    auto* builtin = (const shell_builtin*) dlsym(handle, symbol.c_str());
+    if (!builtin)
+        cerr << "[shell] enable: " << path << ": no " << symbol << " defined" << '\n';
+    else if (builtin->api_version != SHELL_PLUGIN_API_VERSION)
+        cerr << "[shell] enable: " << path << ": plugin API version " << builtin->api_version
+             << ", expected " << SHELL_PLUGIN_API_VERSION << '\n';
+    else if (strcmp(builtin->name, name) != 0)
+        // it would be installed under another name than the one asked for
+        cerr << "[shell] enable: " << path << ": " << symbol << " is named `" << builtin->name << "'" << '\n';
+    else if (!register_builtin(builtin->name, builtin->func, builtin->description, handle))
+        cerr << "[shell] enable: " << name << ": already a built-in" << '\n';
+    else
+        return true;
+
+    dlclose(handle);
+    return false;
+#endif
+}
+
+/**
+ * @brief Removes a built-in loaded from a plugin
+ * @param name Name of the built-in
+ * @return false if no loaded built-in has that name
+ */
+bool unload_builtin(const char* name) {
+    for (auto it = extra_builtins.begin(); it != extra_builtins.end(); ++it) {
+        if (it->handle && strcmp(it->desc.name, name) == 0) {
+            void* handle = it->handle;
+            extra_builtins.erase(it);
+#ifndef SHELL_LITE_STATIC
+            dlclose(handle);
+#endif
+            return true;
+        }
+    }
+    cerr << "[shell] enable: " << name << ": not a loaded built-in" << '\n';
+    return false;
+}
+
+/**
+ * @brief Runs a built-in command
+ * @param builtin The built-in
+ * @param args NULL-terminated array of command arguments
+ * @return Exit status of the built-in
+ * @remark Built-ins return 1 on success and 0 on failure, which becomes
+ * the exit status 0 or 1. One that needs another status sets builtin_status.
+ */
+int run_builtin(func builtin, char** args) {
+    builtin_status = -1;
+    int ret = builtin(args);
+    return builtin_status >= 0 ? builtin_status : ret ? 0 : 1;
+}
+
+/*
+    Jobs
+*/
+
+/**
+ * @brief Opens a pidfd, it becomes readable once the process exits
+ * @return The pidfd, -1 if the kernel doesn't support them
+ */
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Adds a job to the job table
+ * @param pids Processes of the job, the last one decides its exit status
+ * @param n_pids Number of processes
+ * @param pgid Process group of the job, -1 if it shares the one of the shell
+ * @param cmd Source text of the job
+ * @return Id of the job
+ */
+int add_job(const pid_t* pids, size_t n_pids, pid_t pgid, string cmd) {
+    if (job_epoll_fd < 0)
+        job_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    job j = { job_table.empty() ? 1 : job_table.back().id + 1, pgid, job_state::running, move(cmd), {} };
+
+    for (size_t k = 0; k < n_pids; ++k) {
+        int fd = job_epoll_fd >= 0 ? open_pidfd(pids[k]) : -1;
+        if (fd >= 0) {
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = (uint64_t) pids[k];
+            if (epoll_ctl(job_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        j.procs.push_back({ pids[k], fd, 0, false });
+    }
+
+    job_table.push_back(move(j));
+    if (interactive)
+        cerr << "[" << job_table.back().id << "] " << pids[n_pids - 1] << '\n';
+    return job_table.back().id;
+}
+
+/**
+ * @brief Records the wait status of a finished process of a job
+ */
+void finish_process(job& j, job_process& proc, int status) {
+    proc.done = true;
+    proc.status = status;
+
+    if (proc.pidfd >= 0) {
+        // forked built-ins inherit the pidfd, so closing it alone doesn't
+        // take it out of the epoll set
+        epoll_ctl(job_epoll_fd, EPOLL_CTL_DEL, proc.pidfd, nullptr);
+        close(proc.pidfd);
+        proc.pidfd = -1;
+    }
+
+    for (const job_process& p: j.procs)
+        if (!p.done)
+            return;
+    j.state = job_state::done;
+}
+
+/**
+ * @brief Collects the wait status of a process if it has finished
+ * @return true if it was finished
+ */
+bool try_reap(job& j, job_process& proc) {
+    int status = 0;
+    pid_t ret = waitpid(proc.pid, &status, WNOHANG);
+
+    // ECHILD: already reaped, e.g. by fg
+    if (ret == proc.pid || (ret < 0 && errno == ECHILD)) {
+        finish_process(j, proc, status);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Reaps the finished processes of the background jobs
+ * @param timeout Milliseconds to wait for one to finish, -1 waits till one does
+ * @return Number of processes reaped
+ * @remark The pidfds of all the jobs are waited on with a single epoll_wait,
+ * only the processes that have finished are touched. Processes without a
+ * pidfd are checked on every call instead.
+ */
+size_t reap_jobs(int timeout) {
+    size_t reaped = 0;
+    bool polled = false;
+
+    for (job& j: job_table) {
+        for (job_process& proc: j.procs) {
+            if (proc.done || proc.pidfd >= 0)
+                continue;
+            polled = true;
+            reaped += try_reap(j, proc);
+        }
+    }
+
+    if (reaped > 0)
+        timeout = 0;
+    // there is nothing to be woken up by for the polled ones
+    else if (polled && (timeout < 0 || timeout > 10))
+        timeout = 10;
+
+    if (job_epoll_fd < 0) {
+        if (timeout > 0)
+            usleep(timeout * 1000);
+        return reaped;
+    }
+
+    epoll_event events[64];
+    int n = epoll_wait(job_epoll_fd, events, 64, timeout);
+
+    for (int e = 0; e < n; ++e) {
+        pid_t pid = (pid_t) events[e].data.u64;
+        for (job& j: job_table) {
+            for (job_process& proc: j.procs) {
+                if (proc.pid == pid && !proc.done)
+                    reaped += try_reap(j, proc);
+            }
+        }
+    }
+    return reaped;
+}
+
+/**
+ * @brief Picks up jobs that were stopped or continued
+ * @remark pidfds only report exits, so this asks every running process
+ * and is only used when listing the jobs.
+ */
+void update_job_states() {
+    reap_jobs(0);
+
+    for (job& j: job_table) {
+        for (job_process& proc: j.procs) {
+            int status;
+            if (proc.done || waitpid(proc.pid, &status, WNOHANG | WUNTRACED | WCONTINUED) != proc.pid)
+                continue;
+
+            if (WIFSTOPPED(status))
+                j.state = job_state::stopped;
+            else if (WIFCONTINUED(status))
+                j.state = job_state::running;
+            else
+                finish_process(j, proc, status);
+        }
+    }
+}
+
+/**
+ * @brief The job %+ refers to, the latest job that hasn't finished or
+ * the latest job if they all have
+ */
+job* current_job() {
+    for (auto it = job_table.rbegin(); it != job_table.rend(); ++it)
+        if (it->state != job_state::done)
+            return &*it;
+    return job_table.empty() ? nullptr : &job_table.back();
+}
+
+/**
+ * @brief Looks up a job
+ * @param spec %n, %+, %% or a pid of the job, nullptr for the current job
+ * @return The job, nullptr if there is none
+ */
+job* find_job(const char* spec) {
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0)
+        return current_job();
+
+    char* end;
+    long n = strtol(spec + (spec[0] == '%'), &end, 10);
+    if (*end != '\0' || end == spec + (spec[0] == '%'))
+        return nullptr;
+
+    for (job& j: job_table) {
+        if (spec[0] == '%' && j.id == n)
+            return &j;
+        for (const job_process& proc: j.procs)
+            if (spec[0] != '%' && proc.pid == n)
+                return &j;
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Exit status of a job, the status of its last process
+ */
+int job_status(const job& j) {
+    return exit_status(j.procs.back().status);
+}
+
+void print_job(const job& j, bool current, bool pids) {
+    char state[32];
+    if (j.state == job_state::running)
+        strcpy(state, "Running");
+    else if (j.state == job_state::stopped)
+        strcpy(state, "Stopped");
+    else if (WIFSIGNALED(j.procs.back().status))
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(j.procs.back().status)));
+    else if (job_status(j) != 0)
+        snprintf(state, sizeof(state), "Exit %d", job_status(j));
+    else
+        strcpy(state, "Done");
+
+    cout << "[" << j.id << "]" << (current ? '+' : ' ') << "  ";
+    if (pids)
+        cout << j.procs.back().pid << " ";
+    cout << state << string(max<int>(24 - strlen(state), 1), ' ')
+         << j.cmd << (j.state == job_state::running ? " &" : "") << '\n';
+}
+
+/**
+ * @brief Removes the finished jobs from the job table
+ */
+void forget_done_jobs() {
+    for (size_t k = job_table.size(); k-- > 0;)
+        if (job_table[k].state == job_state::done)
+            job_table.erase(job_table.begin() + k);
+}
+
+/**
+ * @brief Reports the finished jobs and forgets them
+ */
+void report_done_jobs() {
+    const job* current = current_job();
+
+    for (const job& j: job_table)
+        if (j.state == job_state::done)
+            print_job(j, &j == current, false);
+
+    forget_done_jobs();
+}
+
+/**
+ * @brief Hands the terminal to a process group
+ * @remark A process that isn't in the foreground group gets SIGTTOU for
+ * this, unless it blocks the signal.
+ */
+void set_terminal_pgrp(pid_t pgid) {
+    sigset_t ttou, old;
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &ttou, &old);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+}
+
+/**
+ * @brief Sends a signal to every process of a job
+ */
+void signal_job(const job& j, int sig) {
+    if (j.pgid > 0) {
+        kill(-j.pgid, sig);
+        return;
+    }
+    for (const job_process& proc: j.procs)
+        if (!proc.done)
+            kill(proc.pid, sig);
+}
+
+/**
+ * @brief Runs a job in the foreground till it finishes or is stopped
+ * @param j The job, resumed if it is stopped
+ * @return Exit status of the job, 128 + signal if it was stopped
+ * @remark The job gets the terminal while it runs, so that Ctrl-C and Ctrl-Z
+ * reach it and not the shell. This wait has to see stops, which pidfds
+ * don't report, so it uses waitpid.
+ */
+int wait_foreground_job(job& j) {
+    bool tty = j.pgid > 0 && isatty(STDIN_FILENO);
+    if (tty)
+        set_terminal_pgrp(j.pgid);
+
+    if (j.state == job_state::stopped)
+        signal_job(j, SIGCONT);
+    j.state = job_state::running;
+
+    int stop_sig = 0;
+    for (job_process& proc: j.procs) {
+        if (proc.done)
+            continue;
+
+        int status = 0;
+        pid_t ret;
+        while ((ret = waitpid(proc.pid, &status, WUNTRACED)) < 0 && errno == EINTR);
+
+        if (ret > 0 && WIFSTOPPED(status)) {
+            stop_sig = WSTOPSIG(status);
+            j.state = job_state::stopped;
+            break;
+        }
+        finish_process(j, proc, status);
+    }
+
+    if (tty)
+        set_terminal_pgrp(getpgrp());
+
+    if (j.state == job_state::stopped) {
+        cout << '\n';
+        print_job(j, true, false);
+        return 128 + stop_sig;
+    }
+    return job_status(j);
+}
+
+/**
+ * @brief Forgets a job
+ */
+void remove_job(int id) {
+    for (size_t k = 0; k < job_table.size(); ++k) {
+        if (job_table[k].id == id) {
+            job_table.erase(job_table.begin() + k);
+            return;
+        }
+    }
+}
+
+/*
+    Variables
+*/
+
+/**
+ * @brief FNV-1a hash of a variable name
+ */
+uint32_t var_hash(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h;
+}
+
+/**
+ * @brief Length of the variable name at the start of a string
+ * @param s The string
+ * @param len Length of the string
+ * @return Length of the longest [A-Za-z_][A-Za-z0-9_]* prefix, 0 if none
+ */
+size_t var_name_len(const char* s, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char) s[0]) || s[0] == '_'))
+        return 0;
+    size_t n = 1;
+    while (n < len && (isalnum((unsigned char) s[n]) || s[n] == '_'))
+        ++n;
+    return n;
+}
+
+/**
+ * @brief Checks if a string is a valid variable name
+ */
+bool is_var_name(const char* s, size_t len) {
+    return len > 0 && var_name_len(s, len) == len;
+}
+
+/**
+ * @brief Finds the slot of a variable name
+ * @return The slot holding the name, or the empty slot it would go in
+ */
+shell_var* probe_var(const char* name, size_t len, uint32_t hash) {
+    size_t mask = var_table.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        shell_var& v = var_table[i];
+        if (!v.name || (v.hash == hash && v.name_len == len && memcmp(v.name, name, len) == 0))
+            return &v;
+    }
+}
+
+/**
+ * @brief Finds a variable, set or not
+ * @return The variable, nullptr if the name was never used
+ */
+shell_var* find_var(const char* name, size_t len) {
+    if (var_table.empty())
+        return nullptr;
+    shell_var* v = probe_var(name, len, var_hash(name, len));
+    return v->name ? v : nullptr;
+}
+
+/**
+ * @brief Finds a variable, adding it unset if the name is new
+ * @remark The table doubles when it is half full. The entries move then,
+ * so the envp has to be rebuilt.
+ */
+shell_var& var_slot(const char* name, size_t len) {
+    uint32_t hash = var_hash(name, len);
+
+    if ((n_var_slots + 1) * 2 > var_table.size()) {
+        vector<shell_var> old = move(var_table);
+        var_table.clear();
+        var_table.resize(max<size_t>(64, old.size() * 2));
+        for (shell_var& v: old)
+            if (v.name)
+                *probe_var(v.name, v.name_len, v.hash) = move(v);
+        env_dirty = true;
+        var_generation++;
+    }
+
+    shell_var* v = probe_var(name, len, hash);
+    if (!v->name) {
+        char* interned = (char*) var_names.alloc(len + 1, 1);
+        memcpy(interned, name, len);
+        interned[len] = '\0';
+        *v = { interned, (uint32_t) len, hash, string(), false, false, false, 0 };
+        n_var_slots++;
+    }
+    return *v;
+}
+
+/**
+ * @brief Looks up the value of a variable
+ * @param name Name of the variable
+ * @return The value, nullptr if the variable isn't set
+ */
+const char* get_var(const char* name) {
+    const shell_var* v = find_var(name, strlen(name));
+    return v && v->set ? v->entry.c_str() + v->name_len + 1 : nullptr;
+}
+
+/**
+ * @brief Sets a variable
+ * @param name Name of the variable, not NUL-terminated
+ * @param len Length of the name
+ * @param value The value, not NUL-terminated
+ * @param value_len Length of the value
+ * @param exported Also exports the variable, an exported variable stays exported
+ * @remark Setting an exported variable to the value it already has doesn't
+ * invalidate the envp.
+ */
+void set_var(const char* name, size_t len, const char* value, size_t value_len, bool exported = false) {
+    shell_var& v = var_slot(name, len);
+
+    bool same = v.set && v.entry.size() == len + 1 + value_len
+                && memcmp(v.entry.data() + len + 1, value, value_len) == 0;
+    if (!same) {
+        // assign keeps the capacity, a variable updated in a loop doesn't allocate
+        v.entry.assign(name, len);
+        v.entry += '=';
+        v.entry.append(value, value_len);
+        v.set = true;
+        v.int_valid = false;
+    }
+
+    if ((!same && v.exported) || (exported && !v.exported))
+        env_dirty = true;
+    v.exported |= exported;
+}
+
+/**
+ * @brief Sets a variable from NUL-terminated strings
+ */
+void set_var(const char* name, const char* value, bool exported = false) {
+    set_var(name, strlen(name), value, strlen(value), exported);
+}
+
+/**
+ * @brief Sets a variable to an integer, from arithmetic
+ * @remark The integer is kept along with the text, reading it back with
+ * var_int() doesn't parse anything.
+ */
+void set_var_int(shell_var& v, int64_t value) {
+    char digits[24];
+    size_t n = to_chars(digits, digits + sizeof(digits), value).ptr - digits;
+    v.int_valid = true;
+    v.int_value = value;
+
+    if (v.set && v.entry.size() == v.name_len + 1 + n && memcmp(v.entry.data() + v.name_len + 1, digits, n) == 0)
+        return;
+    // assign keeps the capacity, a counter doesn't allocate
+    v.entry.assign(v.name, v.name_len);
+    v.entry += '=';
+    v.entry.append(digits, n);
+    v.set = true;
+    if (v.exported)
+        env_dirty = true;
+}
+
+/**
+ * @brief Value of a variable as an integer, for arithmetic
+ * @param v The variable
+ * @param error Receives the message if the value isn't a valid expression
+ * @return The value, 0 if the variable isn't set or is empty
+ * @remark An integer is parsed once after the variable changed and kept.
+ * Any other value is evaluated as an expression, like in bash.
+ */
+int64_t var_int(shell_var& v, const char*& error) {
+    if (!v.set)
+        return 0;
+    if (v.int_valid)
+        return v.int_value;
+
+    const char* value = v.entry.c_str() + v.name_len + 1;
+    int64_t n;
+    if (parse_arith_int(value, n)) {
+        v.int_valid = true;
+        v.int_value = n;
+        return n;
+    }
+    return arith_eval_text(value, error);
+}
+
+/**
+ * @brief Removes the value and the export of a variable
+ */
+void unset_var(const char* name, size_t len) {
+    shell_var* v = find_var(name, len);
+    if (!v)
+        return;
+    if (v->set && v->exported)
+        env_dirty = true;
+    v->set = false;
+    v->exported = false;
+}
+
+/**
+ * @brief Environment of the launched commands
+ * @return NULL-terminated NAME=value array of the exported variables
+ * @remark Rebuilt only when an exported variable changed since the last
+ * call, a launch otherwise costs nothing however large the environment is.
+ */
+char** shell_envp() {
+    if (env_dirty) {
+        env_cache.clear();
+        for (shell_var& v: var_table)
+            if (v.name && v.set && v.exported)
+                env_cache.push_back(&v.entry[0]);
+        env_cache.push_back(nullptr);
+        env_dirty = false;
+    }
+    return env_cache.data();
+}
+
+/**
+ * @brief Replaces the variables with the process environment, all exported
+ */
+void import_environ() {
+    var_table.clear();
+    n_var_slots = 0;
+    env_dirty = true;
+    var_generation++;
+
+    for (char** env = environ; *env; ++env) {
+        const char* eq = strchr(*env, '=');
+        if (eq && eq != *env)
+            set_var(*env, eq - *env, eq + 1, strlen(eq + 1), true);
+    }
+}
+
+/**
+ * @brief Sets up the variables of the shell at startup
+ */
+void init_vars() {
+    shell_pid = getpid();
+    import_environ();
+}
+
+/**
+ * @brief Checks if a word of a command is a NAME=value assignment
+ * @remark The name has to be written as it is, without quotes.
+ */
+bool is_assignment(const ast& tree, const ast_node& word) {
+    const char* text = tree.text + word.first;
+    size_t name_len = var_name_len(text, word.len);
+    return name_len > 0 && name_len < word.len && text[name_len] == '=';
+}
+
+/**
+ * @brief Counts the assignment words a command starts with
+ */
+size_t count_assignments(const ast& tree, const ast_node& cmd) {
+    size_t n = 0;
+    for (uint32_t i = cmd.first; i != 0; i = tree.nodes[i].next) {
+        const ast_node& word = tree.nodes[i];
+        if (word.kind != AST_WORD)
+            continue;
+        if (!is_assignment(tree, word))
+            break;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Performs an assignment word
+ * @param tree Tree the word belongs to
+ * @param word AST_WORD node, see is_assignment()
+ * @param exported Exports the variable, for the assignments before a command
+ */
+void assign_word(const ast& tree, const ast_node& word, bool exported) {
+    // the name has no quotes, so the first '=' of the expansion ends it
+    size_t errors = expansion_errors;
+    char* text = expand_word(tree, word);
+    // a failed expansion leaves the variable as it was
+    if (expansion_errors != errors)
+        return;
+    char* eq = strchr(text, '=');
+    set_var(text, eq - text, eq + 1, strlen(eq + 1), exported);
+}
+
+/**
+ * @brief Saves the variables assigned before a command and exports the
+ * assignments for its duration
+ * @param tree Tree the command belongs to
+ * @param cmd AST_CMD node
+ * @param n_assigns Number of assignment words at the start of the command
+ * @return What restore_assignments() needs, allocated from the line arena
+ */
+saved_var* save_assignments(const ast& tree, const ast_node& cmd, size_t n_assigns) {
+    saved_var* saved = (saved_var*) line_arena.alloc(sizeof(saved_var) * n_assigns, alignof(saved_var));
+    size_t n = 0;
+
+    for (uint32_t i = cmd.first; i != 0 && n < n_assigns; i = tree.nodes[i].next) {
+        const ast_node& word = tree.nodes[i];
+        if (word.kind != AST_WORD)
+            continue;
+
+        saved_var& s = saved[n++];
+        s.name = tree.text + word.first;
+        s.len = var_name_len(s.name, word.len);
+        const shell_var* v = find_var(s.name, s.len);
+        s.was_set = v && v->set;
+        s.was_exported = v && v->exported;
+        s.value = nullptr;
+        if (s.was_set) {
+            const char* value = v->entry.c_str() + v->name_len + 1;
+            s.value = (char*) line_arena.alloc(strlen(value) + 1, 1);
+            strcpy(s.value, value);
+        }
+        assign_word(tree, word, true);
+    }
+    return saved;
+}
+
+/**
+ * @brief Puts back the variables saved by save_assignments()
+ */
+void restore_assignments(const saved_var* saved, size_t n_assigns) {
+    // in reverse, a name assigned twice ends up with its first saved state
+    for (size_t i = n_assigns; i-- > 0;) {
+        const saved_var& s = saved[i];
+        unset_var(s.name, s.len);
+        if (s.was_set)
+            set_var(s.name, s.len, s.value, strlen(s.value), s.was_exported);
+        else if (s.was_exported)
+            var_slot(s.name, s.len).exported = true;
+    }
+}
+
+/*
+    Command lookup
+*/
+
+/**
+ * @brief Searches the $PATH directories for an executable
+ * @param name Name of the command
+ * @return Full path of the command, empty if not found
+ */
+string search_path(const char* name) {
+    const char* path_env = get_var("PATH");
+    // same default search path as execvp
+    string dirs = path_env ? path_env : "/bin:/usr/bin";
+    struct stat st;
+
+    size_t start = 0;
+    while (start <= dirs.size()) {
+        size_t end = dirs.find(':', start);
+        if (end == string::npos)
+            end = dirs.size();
+
+        // an empty entry in PATH stands for the current directory
+        string dir = end == start ? "." : dirs.substr(start, end - start);
+        string candidate = dir + "/" + name;
+
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+            && access(candidate.c_str(), X_OK) == 0)
+            return candidate;
+
+        start = end + 1;
+    }
+    return "";
+}
+
+/**
+ * @brief Resolves the location of an external command
+ * @param name Name of the command
+ * @return Path to launch, nullptr if the command doesn't exist
+ * @remark Names with a '/' are used as they are, the rest are looked
+ * up in the command hash first and only searched in PATH on a miss.
+ */
+const char* find_cmd(const char* name) {
+    if (strchr(name, '/'))
+        return name;
+
+    check_path_changes();
+
+    auto it = cmd_hash_table.find(name);
+    if (it == cmd_hash_table.end()) {
+        string path = search_path(name);
+        if (path.empty())
+            return nullptr;
+        it = cmd_hash_table.emplace(name, hashed_cmd{path, 0}).first;
+    }
+
+    it->second.hits++;
+    return it->second.path.c_str();
+}
+
+/**
+ * @brief Forgets all the remembered command locations
+ */
+void clear_cmd_hash() {
+    cmd_hash_table.clear();
+}
+
+/**
+ * @brief Invalidates the command hash if PATH or its directories changed
+ * @remark A changed PATH value means every entry can be wrong. When the
+ * directories are being watched, a binary added or removed in any of them
+ * also clears the table, otherwise a new binary earlier in PATH would be
+ * shadowed by the remembered one.
+ */
+void check_path_changes() {
+    const char* path_env = get_var("PATH");
+
+    if (hashed_path_env != (path_env ? path_env : "")) {
+        hashed_path_env = path_env ? path_env : "";
+        clear_cmd_hash();
+        watch_path_dirs();
+        return;
+    }
+
+    if (path_watch_fd < 0)
+        return;
+
+    // the fd is non-blocking, any pending event means some PATH directory changed
+    alignas(inotify_event) char events[4096];
+    bool changed = false;
+    while (read(path_watch_fd, events, sizeof(events)) > 0)
+        changed = true;
+
+    if (changed)
+        clear_cmd_hash();
+}
+
+/**
+ * @brief Starts watching the PATH directories for added or removed binaries
+ * @remark Disabled with SHELL_LITE_HASH_WATCH=0, the table then only resets
+ * on PATH changes and `hash -r`.
+ */
+void watch_path_dirs() {
+    if (path_watch_fd >= 0) {
+        close(path_watch_fd);
+        path_watch_fd = -1;
+    }
+
+    const char* watch = get_var("SHELL_LITE_HASH_WATCH");
+    if (watch && strcmp(watch, "0") == 0)
+        return;
+
+    path_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (path_watch_fd < 0)
+        return;
+
+    const uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB;
+    stringstream dirs(hashed_path_env);
+    string dir;
+
+    while (getline(dirs, dir, ':')) {
+        // directories that don't exist can't be watched, they simply
+        // won't invalidate the table
+        inotify_add_watch(path_watch_fd, dir.empty() ? "." : dir.c_str(), mask);
+    }
+}
+
+/*
+    Built-in commands
+    @brief These are native commands of the shell program. These
+    are mostly used for shell related operations.
+*/
+/*
+ * @brief Change the current working directory
+ * @param args: The path to change the directory to
+ * @remark The reason 'cd' is a built-in instead of using an
+ * external command is because the commands are launched as child process,
+ * so an external cd command will only change the dir for the child process
+ * instead of the parent process.
+ */
+int cmd_cd(char** args) {
+    // nullptr is the last element of args, if there
+    // is no path provided, return an error
+    if (args[1] == nullptr) {
+        cerr << "No path provided. Usage: cd <path>" << '\n';
+        return 0;
+    }
+
+    if (chdir(args[1]) != 0) {
+        perror("[shell] Error changing directory.");
+        return 0;
+    }
+
+    // kept up to date for pwd and the launched commands
+    char cwd[PATH_MAX];
+    if (const char* old = get_var("PWD")) {
+        // old points into the variable table, which creating OLDPWD can grow
+        string old_pwd = old;
+        set_var("OLDPWD", old_pwd.c_str());
+    }
+    if (getcwd(cwd, sizeof(cwd)))
+        set_var("PWD", cwd);
+
+    return 1;
+}
+
+/**
+ * @brief Built-in command to display help information
+ * @param args Command arguments (unused)
+ * @return Always returns 1
+ */
+int cmd_help(char** args) {
+    cout << "Shell help" << '\n';
+    cout << "Following built-in commands are supported" << '\n';
+
+    for (const builtin_desc& cmd: builtin_table) {
+        cout << cmd.name << ": " << cmd.description << '\n';
+    }
+    for (const extra_builtin& cmd: extra_builtins) {
+        cout << cmd.desc.name << ": " << cmd.desc.description << '\n';
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Built-in command to exit the shell
+ * @param args Command arguments, args[1] is the exit status if given
+ * @remark Without a status the shell exits with the one of the last command,
+ * a status is taken modulo 256 like in other shells
+ * @return Only returns on a bad argument, otherwise calls exit()
+ */
+int cmd_exit(char** args) {
+    int status = last_status;
+    if (args[1]) {
+        char* end;
+        errno = 0;
+        long value = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0' || errno == ERANGE) {
+            cerr << "[shell] exit: " << args[1] << ": numeric argument required" << '\n';
+            builtin_status = 2;
+            return 0;
+        }
+        status = value & 0xff;
+    }
+
+    if (interactive)
+        cout << "Exiting shell" << '\n';
+    exit(status);
+    return 1;
+}
+
+/*
+    Core built-ins
+    echo, printf, test, pwd, true and false, run by scripts all the time.
+    In the shell they cost a function call instead of a process launch and
+    their output joins the buffered output of the shell.
+*/
+
+/**
+ * @brief Writes the character a backslash escape stands for
+ * @param out Stream to write to
+ * @param s The escape, just past the backslash
+ * @param zero_octal true for echo -e and %b, where octal escapes are \0nnn
+ * and \c ends the output, false for printf formats, where they are \nnn
+ * @param stop Set by \c, nothing more should be written
+ * @return Number of characters of the escape after the backslash
+ */
+size_t print_escape(ostream& out, const char* s, bool zero_octal, bool& stop) {
+    if (*s >= '0' && *s <= '7' && (!zero_octal || *s == '0')) {
+        const char* p = zero_octal ? s + 1 : s;
+        int value = 0;
+        for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; ++i, ++p)
+            value = value * 8 + (*p - '0');
+        out.put((char) value);
+        return p - s;
+    }
+    if (*s == 'x' && isxdigit((unsigned char) s[1])) {
+        const char* p = s + 1;
+        int value = 0;
+        for (int i = 0; i < 2 && isxdigit((unsigned char) *p); ++i, ++p)
+            value = value * 16 + (isdigit((unsigned char) *p) ? *p - '0' : tolower((unsigned char) *p) - 'a' + 10);
+        out.put((char) value);
+        return p - s;
+    }
+    if (*s == 'c' && zero_octal) {
+        stop = true;
+        return 1;
+    }
+
+    char c;
+    switch (*s) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'e': c = '\033'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+        case '\\': c = '\\'; break;
+        default:
+            // not an escape, written as it is
+            out.put('\\');
+            if (!*s)
+                return 0;
+            c = *s;
+    }
+    out.put(c);
+    return 1;
+}
+
+/**
+ * @brief Writes a string, interpreting its backslash escapes
+ * @param out Stream to write to
+ * @param s The string
+ * @param stop Set by \c, nothing more should be written
+ * @remark The echo -e and %b flavour of escapes, see print_escape.
+ */
+void print_escapes(ostream& out, const char* s, bool& stop) {
+    while (!stop) {
+        const char* backslash = strchr(s, '\\');
+        if (!backslash) {
+            out << s;
+            return;
+        }
+        out.write(s, backslash - s);
+        s = backslash + 1;
+        s += print_escape(out, s, true, stop);
+    }
+}
+
+/**
+ * @brief Built-in command to write its arguments
+ * @param args echo [-neE] [arg ...]
+ * @return Always returns 1
+ * @remark Like bash, -n leaves out the newline and -e interprets backslash
+ * escapes. A word made of anything else than these letters is written.
+ */
+int cmd_echo(char** args) {
+    bool newline = true;
+    bool escapes = false;
+    int i = 1;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1]; ++i) {
+        const char* opt = args[i] + 1;
+        if (opt[strspn(opt, "neE")] != '\0')
+            break;
+        for (; *opt; ++opt) {
+            if (*opt == 'n')
+                newline = false;
+            else
+                escapes = *opt == 'e';
+        }
+    }
+
+    bool stop = false;
+    for (int first = i; args[i] && !stop; ++i) {
+        if (i > first)
+            cout.put(' ');
+        if (escapes)
+            print_escapes(cout, args[i], stop);
+        else
+            cout << args[i];
+    }
+    if (newline && !stop)
+        cout.put('\n');
+    return 1;
+}
+
+/**
+ * @brief Converts an argument of printf to an integer
+ * @param arg The argument, nullptr or empty is 0
+ * @param value The integer
+ * @return false if the argument isn't a number, value is what could be read
+ * @remark 'c and "c give the code of the character c, like in other shells.
+ */
+bool printf_number(const char* arg, intmax_t& value) {
+    value = 0;
+    if (!arg || !*arg)
+        return true;
+    if (arg[0] == '\'' || arg[0] == '"') {
+        value = (unsigned char) arg[1];
+        return true;
+    }
+
+    char* end;
+    errno = 0;
+    value = strtoimax(arg, &end, 0);
+    if (end == arg || *end || errno) {
+        cerr << "[shell] printf: " << arg << ": invalid number" << '\n';
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Converts an argument of printf to a floating point number
+ * @param arg The argument, nullptr or empty is 0
+ * @param value The number
+ * @return false if the argument isn't a number, value is what could be read
+ */
+bool printf_number(const char* arg, long double& value) {
+    value = 0;
+    if (!arg || !*arg)
+        return true;
+    if (arg[0] == '\'' || arg[0] == '"') {
+        value = (unsigned char) arg[1];
+        return true;
+    }
+
+    char* end;
+    errno = 0;
+    value = strtold(arg, &end);
+    if (end == arg || *end || errno) {
+        cerr << "[shell] printf: " << arg << ": invalid number" << '\n';
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes a value with a C printf conversion
+ * @param spec The conversion, for a single value
+ * @param value The value
+ * @remark Output that doesn't fit the stack buffer is formatted in the line arena.
+ */
+template <typename T>
+void print_formatted(const char* spec, T value) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), spec, value);
+    if (len < 0)
+        return;
+    if ((size_t) len < sizeof(buf)) {
+        cout.write(buf, len);
+        return;
+    }
+
+    char* big = (char*) line_arena.alloc(len + 1, 1);
+    snprintf(big, len + 1, spec, value);
+    cout.write(big, len);
+}
+
+/**
+ * @brief Writes a string padded to a width and cut to a precision, like %s
+ * @param s The string
+ * @param len Length of the string
+ * @param width Minimum width, padded with spaces
+ * @param precision Maximum number of characters written, -1 for all
+ * @param left true to pad on the right
+ */
+void print_padded(const char* s, size_t len, int width, int precision, bool left) {
+    if (precision >= 0 && (size_t) precision < len)
+        len = precision;
+    size_t pad = width > 0 && (size_t) width > len ? width - len : 0;
+
+    if (!left)
+        for (size_t i = 0; i < pad; ++i)
+            cout.put(' ');
+    cout.write(s, len);
+    if (left)
+        for (size_t i = 0; i < pad; ++i)
+            cout.put(' ');
+}
+
+/**
+ * @brief Built-in command to write formatted output
+ * @param args printf format [arg ...]
+ * @return 1 on success, 0 if an argument wasn't a number or the format is invalid
+ * @remark POSIX printf: the conversions of C printf plus %b, the format is
+ * reused as long as there are arguments left and a missing argument is an
+ * empty string or 0. Widths and precisions can be given as *.
+ */
+int cmd_printf(char** args) {
+    if (!args[1]) {
+        cerr << "[shell] printf: usage: printf format [arg ...]" << '\n';
+        return 0;
+    }
+
+    const char* format = args[1];
+    char** arg = args + 2;
+    bool ok = true;
+    bool stop = false;
+
+    do {
+        char** pass = arg;
+        for (const char* f = format; *f && !stop;) {
+            if (*f == '\\') {
+                f += 1 + print_escape(cout, f + 1, false, stop);
+                continue;
+            }
+            if (*f != '%') {
+                size_t len = strcspn(f, "\\%");
+                cout.write(f, len);
+                f += len;
+                continue;
+            }
+            if (f[1] == '%') {
+                cout.put('%');
+                f += 2;
+                continue;
+            }
+
+            // %[flags][width][.precision]conversion, rebuilt as the C
+            // conversion of a single value
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = *f++;
+            bool left = false;
+            for (; *f && strchr("-+ #0", *f) && n < 8; ++f) {
+                left |= *f == '-';
+                spec[n++] = *f;
+            }
+
+            int width = 0;
+            int precision = -1;
+            intmax_t star;
+            if (*f == '*') {
+                ok &= printf_number(*arg ? *arg++ : nullptr, star);
+                width = (int) star;
+                ++f;
+            }
+            else {
+                for (; isdigit((unsigned char) *f); ++f)
+                    width = width * 10 + (*f - '0');
+            }
+            if (*f == '.') {
+                precision = 0;
+                if (*++f == '*') {
+                    ok &= printf_number(*arg ? *arg++ : nullptr, star);
+                    precision = (int) star;
+                    ++f;
+                }
+                else {
+                    for (; isdigit((unsigned char) *f); ++f)
+                        precision = precision * 10 + (*f - '0');
+                }
+            }
+            if (width < 0) {
+                left = true;
+                spec[n++] = '-';
+                width = -width;
+            }
+            n += snprintf(spec + n, sizeof(spec) - n, "%d", width);
+            if (precision >= 0)
+                n += snprintf(spec + n, sizeof(spec) - n, ".%d", precision);
+
+            char conv = *f;
+            const char* value = *arg ? *arg++ : nullptr;
+            if (conv)
+                ++f;
+
+            switch (conv) {
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': {
+                    intmax_t number;
+                    ok &= printf_number(value, number);
+                    spec[n++] = 'j';
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    print_formatted(spec, number);
+                    break;
+                }
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+                    long double number;
+                    ok &= printf_number(value, number);
+                    spec[n++] = 'L';
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    print_formatted(spec, number);
+                    break;
+                }
+                case 's':
+                    value = value ? value : "";
+                    print_padded(value, strlen(value), width, precision, left);
+                    break;
+                case 'c':
+                    value = value ? value : "";
+                    print_padded(value, *value ? 1 : 0, width, -1, left);
+                    break;
+                case 'b': {
+                    value = value ? value : "";
+                    if (width == 0 && precision < 0) {
+                        print_escapes(cout, value, stop);
+                        break;
+                    }
+                    ostringstream expanded;
+                    print_escapes(expanded, value, stop);
+                    string s = expanded.str();
+                    print_padded(s.data(), s.size(), width, precision, left);
+                    break;
+                }
+                default:
+                    cerr << "[shell] printf: %" << conv << ": invalid conversion" << '\n';
+                    return 0;
+            }
+        }
+        // the format is reused for the arguments that are left, as long as
+        // it takes any
+        if (arg == pass)
+            break;
+    } while (*arg && !stop);
+
+    return ok;
+}
+
+/**
+ * @brief Checks if an argument of test is a unary operator
+ */
+bool is_test_unary(const char* s) {
+    return s[0] == '-' && s[1] && !s[2] && strchr("bcdefghkLnprsStuwxzGO", s[1]);
+}
+
+/**
+ * @brief Evaluates a unary operator of test
+ * @param op The letter of the operator
+ * @param arg Its operand
+ * @return The result of the test
+ */
+bool test_unary(char op, const char* arg) {
+    struct stat st;
+    switch (op) {
+        case 'n': return *arg;
+        case 'z': return !*arg;
+        case 't': return isatty(atoi(arg));
+        case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+        case 'w': return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+        case 'x': return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    }
+
+    if (stat(arg, &st) != 0)
+        return false;
+    switch (op) {
+        case 'e': return true;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return st.st_mode & S_ISGID;
+        case 'u': return st.st_mode & S_ISUID;
+        case 'k': return st.st_mode & S_ISVTX;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+    }
+    return false;
+}
+
+// binary operators of test, the string comparisons and then the numeric ones
+const char* const TEST_BINARY_OPS[] = {
+    "=", "==", "!=", "<", ">",
+    "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+    "-nt", "-ot", "-ef"
+};
+
+/**
+ * @brief Checks if an argument of test is a binary operator
+ */
+bool is_test_binary(const char* s) {
+    for (const char* op: TEST_BINARY_OPS)
+        if (strcmp(s, op) == 0)
+            return true;
+    return false;
+}
+
+/**
+ * @brief Reads an integer operand of test, surrounding blanks are allowed
+ * @return false if it isn't an integer
+ */
+bool test_integer(const char* s, long long& value) {
+    char* end;
+    errno = 0;
+    value = strtoll(s, &end, 10);
+    while (isblank((unsigned char) *end))
+        ++end;
+    if (end == s || *end || errno) {
+        cerr << "[shell] test: " << s << ": integer expression expected" << '\n';
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Evaluates a binary operator of test
+ * @param a Left operand
+ * @param op The operator, one of TEST_BINARY_OPS
+ * @param b Right operand
+ * @param error Set if an operand is invalid
+ * @return The result of the test
+ */
+bool test_binary(const char* a, const char* op, const char* b, bool& error) {
+    if (op[0] != '-') {
+        int cmp = strcmp(a, b);
+        switch (op[0]) {
+            case '=': return cmp == 0;
+            case '!': return cmp != 0;
+            case '<': return cmp < 0;
+            default: return cmp > 0;
+        }
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        bool has_a = stat(a, &sa) == 0;
+        bool has_b = stat(b, &sb) == 0;
+        if (op[1] == 'e')
+            return has_a && has_b && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        // a file that exists is newer than one that doesn't
+        if (!has_a || !has_b)
+            return op[1] == 'n' ? has_a : has_b;
+        bool newer = sa.st_mtim.tv_sec != sb.st_mtim.tv_sec ? sa.st_mtim.tv_sec > sb.st_mtim.tv_sec
+                                                            : sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec;
+        bool older = sa.st_mtim.tv_sec != sb.st_mtim.tv_sec ? sa.st_mtim.tv_sec < sb.st_mtim.tv_sec
+                                                            : sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec;
+        return op[1] == 'n' ? newer : older;
+    }
+
+    long long x, y;
+    if (!test_integer(a, x) || !test_integer(b, y)) {
+        error = true;
+        return false;
+    }
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+/**
+ * @brief Argument of test at the parse position, nullptr past the end
+ */
+const char* test_peek(const test_parser& p, int ahead = 0) {
+    return p.pos + ahead < p.n ? p.args[p.pos + ahead] : nullptr;
+}
+
+/**
+ * @brief Parses and evaluates a primary of test: ( expr ), a unary or
+ * binary operator with its operands or a single string
+ */
+bool test_primary(test_parser& p) {
+    const char* a = test_peek(p);
+    if (!a) {
+        cerr << "[shell] test: argument expected" << '\n';
+        p.error = true;
+        return false;
+    }
+
+    // a binary operator between two operands goes first, so that
+    // [ "(" = "(" ] and [ -n = -n ] compare strings
+    const char* op = test_peek(p, 1);
+    if (op && test_peek(p, 2) && is_test_binary(op)) {
+        p.pos += 3;
+        return test_binary(a, op, p.args[p.pos - 1], p.error);
+    }
+
+    if (strcmp(a, "(") == 0) {
+        ++p.pos;
+        bool value = test_or(p);
+        const char* close = test_peek(p);
+        if (!close || strcmp(close, ")") != 0) {
+            if (!p.error)
+                cerr << "[shell] test: ')' expected" << '\n';
+            p.error = true;
+            return false;
+        }
+        ++p.pos;
+        return value;
+    }
+
+    if (op && is_test_unary(a)) {
+        p.pos += 2;
+        return test_unary(a[1], op);
+    }
+
+    ++p.pos;
+    return *a;
+}
+
+/**
+ * @brief Parses and evaluates ! primary
+ */
+bool test_not(test_parser& p) {
+    const char* a = test_peek(p);
+    // like in test_primary, [ ! = x ] compares "!" with x
+    const char* op = test_peek(p, 1);
+    bool operand = op && test_peek(p, 2) && is_test_binary(op);
+    if (a && strcmp(a, "!") == 0 && !operand) {
+        ++p.pos;
+        return !test_not(p);
+    }
+    return test_primary(p);
+}
+
+/**
+ * @brief Parses and evaluates expressions joined by -a
+ */
+bool test_and(test_parser& p) {
+    bool value = test_not(p);
+    while (test_peek(p) && strcmp(test_peek(p), "-a") == 0) {
+        ++p.pos;
+        bool rhs = test_not(p);
+        value = value && rhs;
+    }
+    return value;
+}
+
+/**
+ * @brief Parses and evaluates expressions joined by -o, -a binding tighter
+ */
+bool test_or(test_parser& p) {
+    bool value = test_and(p);
+    while (test_peek(p) && strcmp(test_peek(p), "-o") == 0) {
+        ++p.pos;
+        bool rhs = test_and(p);
+        value = value || rhs;
+    }
+    return value;
+}
+
+/**
+ * @brief Built-in command to evaluate conditions, also known as [
+ * @param args test expr, or [ expr ]
+ * @return 1 if the expression is true, 0 if it is false. Its exit status
+ * is 2 for an invalid expression
+ * @remark POSIX test: a single argument is true if it is not empty, with
+ * more of them binary operators are tried first, then ( ), unary
+ * operators and strings, joined by !, -a and -o.
+ */
+int cmd_test(char** args) {
+    int n = 0;
+    while (args[n + 1])
+        ++n;
+
+    if (strcmp(args[0], "[") == 0) {
+        if (n == 0 || strcmp(args[n], "]") != 0) {
+            cerr << "[shell] [: missing ']'" << '\n';
+            builtin_status = 2;
+            return 0;
+        }
+        --n;
+    }
+
+    test_parser p = { args + 1, n, 0, false };
+    bool value = false;
+    if (n == 1) {
+        value = args[1][0] != '\0';
+    }
+    else if (n > 1) {
+        value = test_or(p);
+        if (!p.error && p.pos < n) {
+            cerr << "[shell] test: " << args[p.pos + 1] << ": unexpected argument" << '\n';
+            p.error = true;
+        }
+    }
+
+    if (p.error) {
+        builtin_status = 2;
+        return 0;
+    }
+    return value;
+}
+
+/**
+ * @brief Built-in command to print the current directory
+ * @param args pwd [-L | -P]
+ * @return 1 on success, 0 on failure
+ * @remark With -L, the default, $PWD is printed if it leads to the current
+ * directory, so that the path the directory was entered by is kept.
+ */
+int cmd_pwd(char** args) {
+    bool physical = false;
+    for (int i = 1; args[i]; ++i) {
+        if (strcmp(args[i], "-P") == 0) {
+            physical = true;
+        }
+        else if (strcmp(args[i], "-L") == 0) {
+            physical = false;
+        }
+        else {
+            cerr << "[shell] pwd: usage: pwd [-L | -P]" << '\n';
+            return 0;
+        }
+    }
+
+    const char* pwd = get_var("PWD");
+    struct stat pwd_st, cwd_st;
+    if (!physical && pwd && pwd[0] == '/' && stat(pwd, &pwd_st) == 0 && stat(".", &cwd_st) == 0
+        && pwd_st.st_dev == cwd_st.st_dev && pwd_st.st_ino == cwd_st.st_ino) {
+        cout << pwd << '\n';
+        return 1;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("[shell] Error getting the current directory.");
+        return 0;
+    }
+    cout << cwd << '\n';
+    return 1;
+}
+
+/**
+ * @brief Built-in command that does nothing, successfully
+ * @return Always returns 1
+ */
+int cmd_true(char** args) {
+    return 1;
+}
+
+/**
+ * @brief Built-in command that does nothing, unsuccessfully
+ * @return Always returns 0
+ */
+int cmd_false(char** args) {
+    return 0;
+}
+
+/**
+ * @brief Writes a variable as a command that sets it again
+ */
+void print_var(const char* prefix, const shell_var& v) {
+    cout << prefix << v.name;
+    if (v.set) {
+        cout << "=\"";
+        for (const char* p = v.entry.c_str() + v.name_len + 1; *p; ++p) {
+            if (strchr("\"\\$`", *p))
+                cout.put('\\');
+            cout.put(*p);
+        }
+        cout.put('"');
+    }
+    cout << '\n';
+}
+
+/**
+ * @brief Built-in command to export variables to the launched commands
+ * @param args export [-p] [name[=value] ...]
+ * @return 1 on success, 0 if a name is invalid
+ * @remark Without names, or with -p, the exported variables are listed.
+ */
+int cmd_export(char** args) {
+    int i = 1;
+    if (args[i] && strcmp(args[i], "-p") == 0)
+        ++i;
+
+    if (!args[i]) {
+        for (const shell_var& v: var_table)
+            if (v.name && v.exported)
+                print_var("export ", v);
+        return 1;
+    }
+
+    int ret = 1;
+    for (; args[i]; ++i) {
+        const char* eq = strchr(args[i], '=');
+        size_t len = eq ? eq - args[i] : strlen(args[i]);
+        if (!is_var_name(args[i], len)) {
+            cerr << "[shell] export: `" << args[i] << "': not a valid identifier" << '\n';
+            ret = 0;
+        }
+        else if (eq) {
+            set_var(args[i], len, eq + 1, strlen(eq + 1), true);
+        }
+        else {
+            // exported from now on, even if it only gets a value later
+            shell_var& v = var_slot(args[i], len);
+            if (!v.exported && v.set)
+                env_dirty = true;
+            v.exported = true;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Built-in command to remove variables
+ * @param args unset [-v] name ...
+ * @return 1 on success, 0 if a name is invalid
+ */
+int cmd_unset(char** args) {
+    int i = 1;
+    if (args[i] && strcmp(args[i], "-v") == 0)
+        ++i;
+
+    int ret = 1;
+    for (; args[i]; ++i) {
+        if (!is_var_name(args[i], strlen(args[i]))) {
+            cerr << "[shell] unset: `" << args[i] << "': not a valid identifier" << '\n';
+            ret = 0;
+            continue;
+        }
+        unset_var(args[i], strlen(args[i]));
+    }
+    return ret;
+}
+
+/**
+ * @brief Built-in command to inspect and reset the command hash
+ * @param args -r forgets all locations, -l lists them in a reusable form,
+ * -p path name remembers path as the location of name, other names are
+ * looked up and remembered. Without arguments the table is printed.
+ * @return 1 on success, 0 if a name couldn't be found
+ */
+int cmd_hash(char** args) {
+    bool list = false;
+    int ret = 1;
+
+    check_path_changes();
+
+    for (int i = 1; args[i]; ++i) {
+        if (strcmp(args[i], "-r") == 0) {
+            clear_cmd_hash();
+        }
+        else if (strcmp(args[i], "-l") == 0) {
+            list = true;
+        }
+        else if (strcmp(args[i], "-p") == 0) {
+            if (!args[i + 1] || !args[i + 2]) {
+                cerr << "[shell] hash: -p: usage: hash -p path name" << '\n';
+                builtin_status = 2;
+                return 0;
+            }
+            cmd_hash_table[args[i + 2]] = { args[i + 1], 0 };
+            i += 2;
+        }
+        else if (!find_cmd(args[i])) {
+            cerr << "[shell] hash: " << args[i] << ": not found" << '\n';
+            ret = 0;
+        }
+    }
+
+    if (list) {
+        for (auto& [name, cmd]: cmd_hash_table)
+            cout << "hash -p " << cmd.path << " " << name << '\n';
+    }
+    else if (args[1] == nullptr) {
+        if (cmd_hash_table.empty()) {
+            cout << "hash: hash table empty" << '\n';
+            return 1;
+        }
+        cout << "hits\tcommand" << '\n';
+        for (auto& [name, cmd]: cmd_hash_table)
+            cout << "   " << cmd.hits << "\t" << cmd.path << '\n';
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Built-in command to show the allocation counters
+ * @param args Command arguments (unused)
+ * @return Always returns 1
+ * @remark Running it before and after some commands shows how many heap
+ * allocations they needed, in steady state the count doesn't move.
+ */
+int cmd_allocs(char** args) {
+    cout << "heap allocations: " << heap_allocs << '\n';
+    cout << "heap frees: " << heap_frees << '\n';
+    cout << "line arena: " << line_arena.used() << " of " << line_arena.capacity()
+         << " bytes used, " << line_arena.chunks() << " chunk(s)" << '\n';
+    return 1;
+}
+
+/**
+ * @brief Built-in command to list the background jobs
+ * @param args -l also shows the pids
+ * @return Always returns 1
+ * @remark Finished jobs are listed once more and then forgotten.
+ */
+int cmd_jobs(char** args) {
+    bool pids = args[1] && strcmp(args[1], "-l") == 0;
+    update_job_states();
+
+    const job* current = current_job();
+    for (const job& j: job_table)
+        print_job(j, &j == current, pids);
+
+    forget_done_jobs();
+    return 1;
+}
+
+/**
+ * @brief Looks up the job named by the argument of fg and bg
+ * @return The job, nullptr if there is none (reported)
+ */
+job* builtin_job(const char* name, const char* spec) {
+    update_job_states();
+    job* j = find_job(spec);
+
+    if (!j || j->state == job_state::done) {
+        cerr << "[shell] " << name << ": " << (spec ? spec : "current") << ": no such job" << '\n';
+        return nullptr;
+    }
+    return j;
+}
+
+/**
+ * @brief Built-in command to move a job to the foreground
+ * @param args Job to resume, the current job by default
+ * @return 1 if the job exited with status 0, 0 otherwise
+ */
+int cmd_fg(char** args) {
+    job* j = builtin_job("fg", args[1]);
+    if (!j)
+        return 0;
+
+    cout << j->cmd << '\n';
+    builtin_status = wait_foreground_job(*j);
+
+    if (j->state == job_state::done)
+        remove_job(j->id);
+    return builtin_status == 0;
+}
+
+/**
+ * @brief Built-in command to resume a stopped job in the background
+ * @param args Job to resume, the current job by default
+ * @return 1 on success, 0 if there is no such job
+ */
+int cmd_bg(char** args) {
+    job* j = builtin_job("bg", args[1]);
+    if (!j)
+        return 0;
+
+    signal_job(*j, SIGCONT);
+    j->state = job_state::running;
+    cout << "[" << j->id << "]+ " << j->cmd << " &" << '\n';
+    return 1;
+}
+
+/**
+ * @brief Built-in command to wait for background jobs
+ * @param args Jobs (%n) or pids to wait for, every job if there are none
+ * @return 1 if the last job waited for exited with status 0, 0 otherwise
+ * @remark The shell sleeps in epoll_wait until one of the processes exits.
+ */
+int cmd_wait(char** args) {
+    builtin_status = 0;
+
+    if (!args[1]) {
+        for (size_t k = 0; k < job_table.size(); ++k)
+            while (job_table[k].state == job_state::running)
+                reap_jobs(-1);
+        forget_done_jobs();
+        return 1;
+    }
+
+    for (int i = 1; args[i]; ++i) {
+        job* j = find_job(args[i]);
+        if (!j) {
+            cerr << "[shell] wait: " << args[i] << ": no such job" << '\n';
+            builtin_status = 127;
+            continue;
+        }
+
+        // reaping only updates the entries, it doesn't move them
+        while (j->state == job_state::running)
+            reap_jobs(-1);
+
+        builtin_status = j->state == job_state::done ? job_status(*j) : 128 + SIGTSTP;
+        if (j->state == job_state::done)
+            remove_job(j->id);
+    }
+    return builtin_status == 0;
+}
+
+/**
+ * @brief Prints a duration in the m/s format of other shells' time
+ */
+void print_duration(const char* name, double seconds) {
+    int minutes = (int) (seconds / 60);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s\t%dm%.3fs\n", name, minutes, seconds - minutes * 60);
+    cerr << buf;
+}
+
+/**
+ * @brief Prints a duration of the shell's own work with a fitting unit
+ */
+string format_ns(uint64_t ns) {
+    char buf[32];
+    if (ns < 1000)
+        snprintf(buf, sizeof(buf), "%luns", (unsigned long) ns);
+    else if (ns < 1000000)
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, sizeof(buf), "%.2fms", ns / 1e6);
+    else
+        snprintf(buf, sizeof(buf), "%.3fs", ns / 1e9);
+    return buf;
+}
+
+inline double tv_seconds(const timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * @brief Built-in command to time a command
+ * @param args The command to run and its arguments
+ * @return 1 if the command succeeded, 0 otherwise, the exit status is the one of the command
+ * @remark Besides the real, user and system time, it reports the max RSS,
+ * page faults and context switches of the command (wait4 rusage, getrusage
+ * of the shell for built-ins) and the time the shell itself spent on the
+ * line: tokenizing, parsing, the PATH lookup, the spawn and the wait.
+ * The report goes to stderr.
+ */
+int cmd_time(char** args) {
+    if (!args[1]) {
+        cerr << "Usage: time command [arg ...]" << '\n';
+        builtin_status = 2;
+        return 0;
+    }
+
+    size_t n_args = 0;
+    while (args[n_args + 1])
+        n_args++;
+
+    // the parse times are the ones of the line, the rest is the command's
+    uint64_t tokenize_ns = timing.tokenize_ns, parse_ns = timing.parse_ns;
+    timing.lookup_ns = timing.spawn_ns = timing.wait_ns = 0;
+    timing.have_usage = false;
+
+    struct rusage self_before, self_after;
+    getrusage(RUSAGE_SELF, &self_before);
+    uint64_t start = now_ns();
+
+    execute_cmd(args + 1, n_args);
+
+    uint64_t real_ns = now_ns() - start;
+    getrusage(RUSAGE_SELF, &self_after);
+    cout.flush();
+
+    // built-ins run in the shell, their usage is the difference of the shell's
+    struct rusage usage = timing.usage;
+    if (!timing.have_usage) {
+        usage = self_after;
+        timersub(&self_after.ru_utime, &self_before.ru_utime, &usage.ru_utime);
+        timersub(&self_after.ru_stime, &self_before.ru_stime, &usage.ru_stime);
+        usage.ru_minflt -= self_before.ru_minflt;
+        usage.ru_majflt -= self_before.ru_majflt;
+        usage.ru_nvcsw -= self_before.ru_nvcsw;
+        usage.ru_nivcsw -= self_before.ru_nivcsw;
+    }
+
+    cerr << '\n';
+    print_duration("real", real_ns / 1e9);
+    print_duration("user", tv_seconds(usage.ru_utime));
+    print_duration("sys", tv_seconds(usage.ru_stime));
+    cerr << "max rss\t" << usage.ru_maxrss << " KB" << '\n';
+    cerr << "page faults\t" << usage.ru_minflt << " minor, " << usage.ru_majflt << " major" << '\n';
+    cerr << "context switches\t" << usage.ru_nvcsw << " voluntary, " << usage.ru_nivcsw << " involuntary" << '\n';
+    cerr << "shell\ttokenize " << format_ns(tokenize_ns) << ", parse " << format_ns(parse_ns);
+    if (timing.have_usage)
+        cerr << ", lookup " << format_ns(timing.lookup_ns) << ", spawn " << format_ns(timing.spawn_ns)
+             << ", wait " << format_ns(timing.wait_ns);
+    cerr << '\n';
+
+    builtin_status = last_status;
+    return last_status == 0;
+}
+
+/*
+    Benchmarking
+*/
+
+struct bench_stats {
+    double mean, stddev, min, max, median, p90, p95, p99;
+};
+
+/**
+ * @brief Percentile of sorted samples, interpolating between the closest two
+ */
+double percentile(const vector<double>& sorted, double p) {
+    double rank = p / 100 * (sorted.size() - 1);
+    size_t lo = (size_t) rank;
+    size_t hi = min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+}
+
+bench_stats compute_stats(vector<double> samples) {
+    bench_stats st = {};
+    double sum = 0;
+    for (double x: samples)
+        sum += x;
+    st.mean = sum / samples.size();
+
+    double sq = 0;
+    for (double x: samples)
+        sq += (x - st.mean) * (x - st.mean);
+    // sample standard deviation, like hyperfine
+    st.stddev = samples.size() > 1 ? sqrt(sq / (samples.size() - 1)) : 0;
+
+    sort(samples.begin(), samples.end());
+    st.min = samples.front();
+    st.max = samples.back();
+    st.median = percentile(samples, 50);
+    st.p90 = percentile(samples, 90);
+    st.p95 = percentile(samples, 95);
+    st.p99 = percentile(samples, 99);
+    return st;
+}
+
+/**
+ * @brief Escapes a string for a JSON document
+ */
+string json_escape(const string& str) {
+    string out;
+    for (char c: str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief Writes the results of bench in the layout of hyperfine's --export-json
+ * @return true on success
+ */
+bool export_bench_json(const char* path, const string& cmd, const bench_stats& st, double user, double sys,
+                       const vector<double>& times, const vector<int>& statuses) {
+    FILE* out = fopen(path, "we");
+    if (!out)
+        return false;
+
+    fprintf(out, "{\n  \"results\": [\n    {\n");
+    fprintf(out, "      \"command\": \"%s\",\n", json_escape(cmd).c_str());
+    fprintf(out, "      \"mean\": %.9f,\n      \"stddev\": %.9f,\n      \"median\": %.9f,\n", st.mean, st.stddev, st.median);
+    fprintf(out, "      \"user\": %.9f,\n      \"system\": %.9f,\n", user, sys);
+    fprintf(out, "      \"min\": %.9f,\n      \"max\": %.9f,\n", st.min, st.max);
+    fprintf(out, "      \"p90\": %.9f,\n      \"p95\": %.9f,\n      \"p99\": %.9f,\n", st.p90, st.p95, st.p99);
+
+    fprintf(out, "      \"times\": [");
+    for (size_t i = 0; i < times.size(); ++i)
+        fprintf(out, "%s%.9f", i ? ", " : "", times[i]);
+    fprintf(out, "],\n      \"exit_codes\": [");
+    for (size_t i = 0; i < statuses.size(); ++i)
+        fprintf(out, "%s%d", i ? ", " : "", statuses[i]);
+    fprintf(out, "]\n    }\n  ]\n}\n");
+
+    return fclose(out) == 0;
+}
+
+/**
+ * @brief Built-in command to benchmark a command
+ * @param args -n runs (default 10), -w warmup runs (default 1), -p a command
+ * line run before every run, -i to keep going when the command fails,
+ * -o to show the output of the command instead of discarding it,
+ * -j file to export the results as JSON, followed by the command
+ * @return 1 on success, 0 if the command failed or the options are wrong
+ * @remark The command is expanded and looked up once, every run goes straight
+ * to the launch, so the numbers don't include the shell parsing the line
+ * again. The prepare line is parsed once as well.
+ */
+int cmd_bench(char** args) {
+    long runs = 10, warmup = 1;
+    const char* prepare = nullptr;
+    const char* json_path = nullptr;
+    bool ignore_failure = false;
+    bool show_output = false;
+
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; ++i) {
+        if (strcmp(args[i], "-i") == 0)
+            ignore_failure = true;
+        else if (strcmp(args[i], "-o") == 0)
+            show_output = true;
+        else if (strcmp(args[i], "-n") == 0 && args[i + 1])
+            runs = atol(args[++i]);
+        else if (strcmp(args[i], "-w") == 0 && args[i + 1])
+            warmup = atol(args[++i]);
+        else if (strcmp(args[i], "-p") == 0 && args[i + 1])
+            prepare = args[++i];
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1])
+            json_path = args[++i];
+        else
+            break;
+    }
+
+    if (!args[i] || runs < 1 || warmup < 0) {
+        cerr << "Usage: bench [-n runs] [-w warmup] [-p prepare] [-i] [-o] [-j file] command [arg ...]" << '\n';
+        builtin_status = 2;
+        return 0;
+    }
+
+    char** cmd = args + i;
+    size_t n_args = 0;
+    string cmd_text;
+    for (; cmd[n_args]; ++n_args)
+        cmd_text += (n_args ? " " : "") + string(cmd[n_args]);
+
+    // the prepare line lives in its own arena, the runs use the line arena
+    arena prepare_arena;
+    ast prepare_tree;
+    if (prepare && !parse_source(prepare, strlen(prepare), prepare_arena, prepare_tree)) {
+        builtin_status = 2;
+        return 0;
+    }
+
+    // like hyperfine, the output is discarded so that the terminal isn't measured
+    int null_fd = show_output ? -1 : open("/dev/null", O_WRONLY | O_CLOEXEC);
+    fd_remap discard = { null_fd, STDOUT_FILENO };
+    launch_opts opts = { &discard, null_fd >= 0 ? 1u : 0u };
+
+    vector<double> times;
+    vector<int> statuses;
+    times.reserve(runs);
+    statuses.reserve(runs);
+    double user = 0, sys = 0;
+
+    for (long run = 0; run < warmup + runs; ++run) {
+        // whatever a run allocates is released before the next one
+        arena::position mark = line_arena.mark();
+        if (prepare)
+            execute_node(prepare_tree, 0);
+
+        timing.have_usage = false;
+        cout.flush();
+        uint64_t start = now_ns();
+        execute_cmd(cmd, n_args, opts);
+        double elapsed = (now_ns() - start) / 1e9;
+        line_arena.release(mark);
+
+        if (last_status != 0 && !ignore_failure) {
+            cerr << "[shell] bench: command failed with status " << last_status
+                 << ", use -i to ignore failures" << '\n';
+            builtin_status = last_status;
+            if (null_fd >= 0)
+                close(null_fd);
+            return 0;
+        }
+        if (run < warmup)
+            continue;
+
+        times.push_back(elapsed);
+        statuses.push_back(last_status);
+        if (timing.have_usage) {
+            user += tv_seconds(timing.usage.ru_utime);
+            sys += tv_seconds(timing.usage.ru_stime);
+        }
+    }
+
+    if (null_fd >= 0)
+        close(null_fd);
+
+    bench_stats st = compute_stats(times);
+    user /= runs;
+    sys /= runs;
+
+    auto ns = [](double seconds) { return format_ns((uint64_t) (seconds * 1e9)); };
+    cout << "Benchmark: " << cmd_text << "\n"
+         << "  Time (mean ± σ):     " << ns(st.mean) << " ± " << ns(st.stddev)
+         << "    [User: " << ns(user) << ", System: " << ns(sys) << "]\n"
+         << "  Range (min … max):   " << ns(st.min) << " … " << ns(st.max) << "    " << runs << " runs\n"
+         << "  Percentiles:         p50 " << ns(st.median) << ", p90 " << ns(st.p90)
+         << ", p95 " << ns(st.p95) << ", p99 " << ns(st.p99) << '\n';
+
+    if (json_path && !export_bench_json(json_path, cmd_text, st, user, sys, times, statuses)) {
+        cerr << "[shell] bench: " << json_path << ": " << strerror(errno) << '\n';
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Built-in command to load built-ins from shared objects
+ * @param args enable -f lib.so name ... loads the named built-ins of a
+ * plugin, enable -d name ... removes loaded built-ins, enable alone lists
+ * the built-ins
+ * @return 1 if every name could be loaded or removed, 0 otherwise
+ * @remark Loaded built-ins run inside the shell, a command used in a hot
+ * loop no longer costs a process launch.
+ */
+int cmd_enable(char** args) {
+    const char* path = nullptr;
+    bool remove = false;
+    int i = 1;
+
+    for (; args[i] && args[i][0] == '-'; ++i) {
+        if (strcmp(args[i], "-f") == 0 && args[i + 1]) {
+            path = args[++i];
+        }
+        else if (strcmp(args[i], "-d") == 0) {
+            remove = true;
+        }
+        else {
+            cerr << "[shell] enable: usage: enable [-f lib.so | -d] [name ...]" << '\n';
+            return 0;
+        }
+    }
+
+    if (!args[i]) {
+        if (path || remove) {
+            cerr << "[shell] enable: no built-in named" << '\n';
+            return 0;
+        }
+        for (const builtin_desc& cmd: builtin_table)
+            cout << "enable " << cmd.name << '\n';
+        for (const extra_builtin& cmd: extra_builtins)
+            cout << "enable " << cmd.desc.name << '\n';
+        return 1;
+    }
+
+    int ret = 1;
+    for (; args[i]; ++i) {
+        bool ok;
+        if (remove)
+            ok = unload_builtin(args[i]);
+        else if (path)
+            ok = load_builtin(path, args[i]);
+        // without -f, the names only have to be built-ins already
+        else if (!(ok = find_builtin(args[i]) != nullptr))
+            cerr << "[shell] enable: " << args[i] << ": not a shell built-in" << '\n';
+
+        if (!ok)
+            ret = 0;
+    }
+    return ret;
+}
+
+/*
+    Data forwarding
+    Used by the cat and tee built-ins. Between pipes and files the data is
+    moved with splice/tee/sendfile, so it never gets copied into the shell.
+*/
+
+/**
+ * @brief Writes a whole buffer
+ * @return true on success
+ */
+bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Copies through a user space buffer, for fds the kernel can't forward
+ * @param limit Number of bytes to copy, SIZE_MAX to copy till EOF
+ * @return true on success
+ */
+bool copy_fd(int in_fd, int out_fd, size_t limit = SIZE_MAX) {
+    static char buf[1 << 16];
+
+    while (limit > 0) {
+        ssize_t n = read(in_fd, buf, min(sizeof(buf), limit));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+            break;
+        if (!write_all(out_fd, buf, n))
+            return false;
+        if (limit != SIZE_MAX)
+            limit -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Moves exactly len bytes from a pipe to an fd
+ * @return true on success
+ */
+bool splice_exact(int pipe_fd, int out_fd, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(pipe_fd, nullptr, out_fd, nullptr, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // e.g. an O_APPEND file on older kernels, the data is still in the pipe
+        if (n < 0 && errno == EINVAL)
+            return copy_fd(pipe_fd, out_fd, len);
+        if (n <= 0)
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Copies everything from in_fd to out_fd
+ * @return true on success
+ * @remark splice when either side is a pipe, sendfile from regular files,
+ * a user space copy for anything else (e.g. terminal to terminal).
+ */
+bool forward_fd(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0)
+        return false;
+
+    ssize_t n = -1;
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        while ((n = splice(in_fd, nullptr, out_fd, nullptr, FORWARD_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 || (n < 0 && errno == EINTR));
+    }
+    else if (S_ISREG(in_st.st_mode)) {
+        while ((n = sendfile(out_fd, in_fd, nullptr, FORWARD_CHUNK)) > 0 || (n < 0 && errno == EINTR));
+    }
+    else {
+        return copy_fd(in_fd, out_fd);
+    }
+
+    if (n == 0)
+        return true;
+    // EINVAL/ENOSYS: the kernel can't forward between these two fds
+    if (n < 0 && errno != EINVAL && errno != ENOSYS)
+        return false;
+    return copy_fd(in_fd, out_fd);
+}
+
+/**
+ * @brief Built-in cat
+ * @param args Files to concatenate, stdin if there are none or for "-"
+ * @return 1 on success, 0 if a file couldn't be read
+ * @remark Options are left to the external cat.
+ */
+int cmd_cat(char** args) {
+    for (int i = 1; args[i]; ++i) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            launch_cmd(args);
+            builtin_status = last_status;
+            return last_status == 0;
+        }
+    }
+
+    // output written by earlier built-ins goes first
+    cout.flush();
+
+    int ret = 1;
+    for (int i = 1; i == 1 || args[i]; ++i) {
+        const char* file = args[i] ? args[i] : "-";
+        int fd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0 || !forward_fd(fd, STDOUT_FILENO)) {
+            cerr << "cat: " << file << ": " << strerror(errno) << '\n';
+            ret = 0;
+        }
+
+        if (fd > STDIN_FILENO)
+            close(fd);
+        if (!args[i])
+            break;
+    }
+    return ret;
+}
+
+/**
+ * @brief Copies stdin to stdout and the files through a user space buffer
+ * @param files Files to write, already open
+ * @param n_files Number of files
+ * @return true on success
+ */
+bool tee_copy(const int* files, size_t n_files) {
+    static char buf[1 << 16];
+    bool ok = true;
+    ssize_t n;
+
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n < 0)
+            continue;
+        ok = write_all(STDOUT_FILENO, buf, n) && ok;
+        for (size_t f = 0; f < n_files; ++f)
+            ok = write_all(files[f], buf, n) && ok;
+    }
+    return ok && n == 0;
+}
+
+/**
+ * @brief Copies stdin to stdout and the files with tee(2)
+ * @param files Files to write, already open
+ * @param n_files Number of files, at least 1
+ * @return true on success
+ * @remark tee duplicates the data at the head of the stdin pipe into the
+ * stdout pipe without consuming it. The same data is duplicated into a
+ * scratch pipe and spliced into every file but the last, the last file
+ * consumes it from stdin.
+ */
+bool tee_pipes(const int* files, size_t n_files) {
+    int scratch[2] = {-1, -1};
+    if (n_files > 1) {
+        if (pipe2(scratch, O_CLOEXEC) != 0)
+            return false;
+        // it has to hold everything that can be in stdin, so that every
+        // tee into it copies all the data that was teed to stdout
+        int in_size = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+        if (in_size < 0 || fcntl(scratch[1], F_SETPIPE_SZ, in_size) < in_size) {
+            close(scratch[0]);
+            close(scratch[1]);
+            return tee_copy(files, n_files);
+        }
+    }
+
+    bool ok = true;
+    while (ok) {
+        ssize_t n = tee(STDIN_FILENO, STDOUT_FILENO, FORWARD_CHUNK, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+
+        for (size_t f = 0; ok && f + 1 < n_files; ++f) {
+            ssize_t copied;
+            while ((copied = tee(STDIN_FILENO, scratch[1], n, 0)) < 0 && errno == EINTR);
+            ok = copied == n && splice_exact(scratch[0], files[f], n);
+        }
+
+        if (ok)
+            ok = splice_exact(STDIN_FILENO, files[n_files - 1], n);
+    }
+
+    if (scratch[0] >= 0) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    return ok;
+}
+
+/**
+ * @brief Built-in tee
+ * @param args -a to append, then the files to write
+ * @return 1 on success, 0 if a file couldn't be written
+ * @remark Between pipes the data is moved with tee/splice, otherwise it is
+ * copied through a buffer. Other options are left to the external tee.
+ */
+int cmd_tee(char** args) {
+    int first = 1;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+    for (; args[first] && args[first][0] == '-' && args[first][1] != '\0'; ++first) {
+        if (strcmp(args[first], "-a") != 0) {
+            launch_cmd(args);
+            builtin_status = last_status;
+            return last_status == 0;
+        }
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    }
+
+    cout.flush();
+
+    int ret = 1;
+    vector<int> files;
+    for (int i = first; args[i]; ++i) {
+        int fd = open(args[i], flags, 0666);
+        if (fd < 0) {
+            cerr << "tee: " << args[i] << ": " << strerror(errno) << '\n';
+            ret = 0;
+            continue;
+        }
+        files.push_back(fd);
+    }
+
+    struct stat in_st, out_st;
+    bool pipes = fstat(STDIN_FILENO, &in_st) == 0 && fstat(STDOUT_FILENO, &out_st) == 0
+        && S_ISFIFO(in_st.st_mode) && S_ISFIFO(out_st.st_mode);
+
+    bool ok = files.empty() ? forward_fd(STDIN_FILENO, STDOUT_FILENO)
+            : pipes         ? tee_pipes(files.data(), files.size())
+                            : tee_copy(files.data(), files.size());
+    if (!ok)
+        ret = 0;
+
+    for (int fd: files)
+        close(fd);
+    return ret;
+}
+
+/*
+    Parallel
+    The parallel built-in runs a command template for every input line on a
+    pool of child processes. The output of every job goes to its own memfd
+    and is copied out with sendfile once the job is done, so the output of
+    concurrent jobs never interleaves.
+*/
+struct parallel_job {
+    pid_t pid;
+    // -1 without pidfd support, the job is waited for with waitpid then
+    int pidfd;
+    // memfd holding the output, -1 if it couldn't be created
+    int out_fd;
+    // position of the input line, for the ordered output mode
+    size_t seq;
+};
+
+struct parallel_run {
+    vector<parallel_job> running;
+    // outputs of finished jobs waiting for earlier jobs, ordered mode only
+    unordered_map<size_t, int> finished;
+    size_t next_out;
+    size_t failed;
+    int epoll_fd;
+    bool keep_order;
+};
+
+/**
+ * @brief Builds the arguments of a job from the command template
+ * @param tmpl NULL-terminated command template, every {} is replaced by the input
+ * @param input Input line
+ * @return NULL-terminated arguments, allocated from the line arena
+ * @remark Without a {} the input is appended as the last argument.
+ */
+char** parallel_args(char** tmpl, const char* input) {
+    size_t n = 0;
+    bool placeholder = false;
+    for (; tmpl[n]; ++n)
+        placeholder |= strstr(tmpl[n], "{}") != nullptr;
+
+    char** args = (char**) line_arena.alloc(sizeof(char*) * (n + 2), alignof(char*));
+    size_t input_len = strlen(input);
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t uses = 0;
+        for (const char* p = strstr(tmpl[i], "{}"); p; p = strstr(p + 2, "{}"))
+            uses++;
+        if (uses == 0) {
+            args[i] = tmpl[i];
+            continue;
+        }
+
+        char* out = (char*) line_arena.alloc(strlen(tmpl[i]) + uses * input_len - uses * 2 + 1, 1);
+        char* dst = out;
+        const char* src = tmpl[i];
+        for (const char* p; (p = strstr(src, "{}")); src = p + 2) {
+            memcpy(dst, src, p - src);
+            dst += p - src;
+            memcpy(dst, input, input_len);
+            dst += input_len;
+        }
+        strcpy(dst, src);
+        args[i] = out;
+    }
+
+    if (!placeholder)
+        args[n++] = (char*) input;
+    args[n] = nullptr;
+    return args;
+}
+
+/**
+ * @brief Writes the captured output of a job to stdout and closes it
+ */
+void parallel_emit(int out_fd) {
+    if (out_fd < 0)
+        return;
+    lseek(out_fd, 0, SEEK_SET);
+    forward_fd(out_fd, STDOUT_FILENO);
+    close(out_fd);
+}
+
+/**
+ * @brief Hands the output of a finished job over to stdout
+ * @remark In the ordered mode it is held back till the outputs of all the
+ * earlier jobs have been written.
+ */
+void parallel_output(parallel_run& run, size_t seq, int out_fd) {
+    if (!run.keep_order) {
+        parallel_emit(out_fd);
+        return;
+    }
+
+    run.finished[seq] = out_fd;
+    for (auto it = run.finished.find(run.next_out); it != run.finished.end(); it = run.finished.find(run.next_out)) {
+        parallel_emit(it->second);
+        run.finished.erase(it);
+        run.next_out++;
+    }
+}
+
+/**
+ * @brief Starts the job for one input line
+ */
+void parallel_start(parallel_run& run, char** tmpl, const char* input, size_t seq) {
+    // the arguments are copied by the time the child is started
+    arena::position mark = line_arena.mark();
+    char** args = parallel_args(tmpl, input);
+
+    int out_fd = memfd_create("parallel", MFD_CLOEXEC);
+    fd_remap remap = { out_fd, STDOUT_FILENO };
+    pid_t pid = start_cmd(args, { &remap, out_fd >= 0 ? 1u : 0u });
+    line_arena.release(mark);
+
+    if (pid < 0) {
+        run.failed++;
+        parallel_output(run, seq, out_fd);
+        return;
+    }
+
+    int pidfd = run.epoll_fd >= 0 ? open_pidfd(pid) : -1;
+    if (pidfd >= 0) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t) pid;
+        if (epoll_ctl(run.epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) != 0) {
+            close(pidfd);
+            pidfd = -1;
+        }
+    }
+    run.running.push_back({ pid, pidfd, out_fd, seq });
+}
+
+/**
+ * @brief Waits for at least one running job to finish and collects it
+ */
+void parallel_reap(parallel_run& run) {
+    // a job without a pidfd can only be waited for on its own
+    pid_t target = -1;
+    for (const parallel_job& job: run.running) {
+        if (job.pidfd < 0) {
+            target = job.pid;
+            break;
+        }
+    }
+
+    epoll_event events[64];
+    int n_ready = 0;
+    if (target < 0) {
+        while ((n_ready = epoll_wait(run.epoll_fd, events, 64, -1)) < 0 && errno == EINTR);
+    }
+
+    for (size_t k = 0; k < run.running.size();) {
+        parallel_job& job = run.running[k];
+        bool ready = job.pid == target;
+        for (int e = 0; e < n_ready && !ready; ++e)
+            ready = (pid_t) events[e].data.u64 == job.pid;
+
+        int status = 0;
+        if (!ready || (waitpid(job.pid, &status, 0) < 0 && errno != ECHILD)) {
+            ++k;
+            continue;
+        }
+
+        if (exit_status(status) != 0)
+            run.failed++;
+        if (job.pidfd >= 0) {
+            // forked built-ins inherit the pidfd, so closing it alone
+            // doesn't take it out of the epoll set
+            epoll_ctl(run.epoll_fd, EPOLL_CTL_DEL, job.pidfd, nullptr);
+            close(job.pidfd);
+        }
+        parallel_output(run, job.seq, job.out_fd);
+
+        run.running[k] = run.running.back();
+        run.running.pop_back();
+    }
+}
+
+/**
+ * @brief Built-in command to run a command for every input line in parallel
+ * @param args -j N runs up to N jobs at a time (default: online CPUs),
+ * -k writes the outputs in input order instead of as the jobs finish,
+ * -a file reads the lines from file instead of stdin, followed by the command
+ * @return 1 if every job succeeded, 0 otherwise
+ * @remark Like GNU parallel, the exit status is the number of failed jobs,
+ * 101 for more than 100. Jobs are launched the same way as other commands.
+ */
+int cmd_parallel(char** args) {
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* input_file = nullptr;
+    parallel_run run = { {}, {}, 0, 0, -1, false };
+
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; ++i) {
+        if (strcmp(args[i], "-k") == 0) {
+            run.keep_order = true;
+        }
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1]) {
+            workers = atol(args[++i]);
+        }
+        else if (strcmp(args[i], "-a") == 0 && args[i + 1]) {
+            input_file = args[++i];
+        }
+        else {
+            cerr << "[shell] parallel: " << args[i] << ": invalid option" << '\n';
+            builtin_status = 2;
+            return 0;
+        }
+    }
+
+    if (!args[i]) {
+        cerr << "Usage: parallel [-j N] [-k] [-a file] command [arg ...]" << '\n';
+        builtin_status = 2;
+        return 0;
+    }
+    if (workers < 1)
+        workers = 1;
+
+    FILE* in = input_file ? fopen(input_file, "re") : stdin;
+    if (!in) {
+        cerr << "[shell] parallel: " << input_file << ": " << strerror(errno) << '\n';
+        return 0;
+    }
+
+    run.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    run.running.reserve(workers);
+    // the jobs write straight to stdout, anything buffered goes first
+    cout.flush();
+
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    size_t seq = 0;
+
+    while ((len = getline(&line, &cap, in)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        while (run.running.size() >= (size_t) workers)
+            parallel_reap(run);
+        parallel_start(run, args + i, line, seq++);
+    }
+
+    while (!run.running.empty())
+        parallel_reap(run);
+
+    free(line);
+    if (in == stdin)
+        clearerr(stdin);
+    else
+        fclose(in);
+    if (run.epoll_fd >= 0)
+        close(run.epoll_fd);
+
+    builtin_status = (int) min<size_t>(run.failed, 101);
+    return run.failed == 0;
+}
+
+/*
+    Shell operations
+*/
+
+void print_prompt() {
+    // output is buffered, everything written so far goes out with the prompt
+    cout << PROMPT << flush;
+}
+
+/**
+ * @brief Reads a line of input from standard input
+ * @return String containing user input, allocated from the line arena
+ */
+char* read_line() {
+    size_t buff_size = 256;
+    size_t len = 0;
+    char* line = (char*) line_arena.alloc(buff_size, 1);
+
+    // the output of the previous line shouldn't wait for the next one
+    cout.flush();
+
+    while (fgets(line + len, buff_size - len, stdin)) {
+        len += strlen(line + len);
+
+        // a full line or the last line of the input without a newline. A
+        // line starting with a NUL byte reads as empty.
+        if (len == 0 || line[len - 1] == '\n' || len + 1 < buff_size)
+            return line;
+
+        // the buffer is full, the line continues
+        line = (char*) line_arena.extend(line, buff_size, buff_size * 2);
+        buff_size *= 2;
+    }
+
+    if (len > 0)
+        return line;
+
+    if(feof(stdin)) {
+        if (!interactive)
+            exit(last_status);
+        cerr << "EOF reached, exiting" << '\n';
+        exit(EXIT_SUCCESS);
+    }
+
+    perror("[shell] Error reading input.");
+    exit(EXIT_FAILURE);
+}
+
+/*
+    Lexer
+*/
+
+struct lexer {
+    const char* text;
+    size_t len;
+    token* tokens;
+    size_t n_tokens;
+    size_t capacity;
+    // a word is open and started at word_start
+    bool in_word;
+    uint32_t word_start;
+    uint8_t word_flags;
+};
+
+void lex_push(lexer& lex, token_type type, size_t start, size_t len, int fd = -1) {
+    lex.tokens[lex.n_tokens++] = { type, 0, (int16_t) fd, (uint32_t) start, (uint32_t) len };
+}
+
+void lex_begin_word(lexer& lex, size_t at) {
+    if (!lex.in_word) {
+        lex.in_word = true;
+        lex.word_start = at;
+        lex.word_flags = 0;
+    }
+}
+
+void lex_end_word(lexer& lex, size_t at) {
+    if (lex.in_word) {
+        lex_push(lex, TOK_WORD, lex.word_start, at - lex.word_start);
+        lex.tokens[lex.n_tokens - 1].flags = lex.word_flags;
+        lex.in_word = false;
+    }
+}
+
+/**
+ * @brief Splits a run of plain characters and delimiters into words
+ * @param lex Lexer state
+ * @param base Offset of the run in the text
+ * @param delims Delimiter mask of the run, bit 0 is text[base]
+ * @param n Length of the run, at most 64
+ */
+void lex_plain(lexer& lex, size_t base, uint64_t delims, size_t n) {
+    if (n == 0)
+        return;
+
+    uint64_t in_run = n == 64 ? ~0ull : (1ull << n) - 1;
+    uint64_t word_bytes = ~delims & in_run;
+    // bit i tells if the byte before i belongs to a word
+    uint64_t preceding = word_bytes << 1 | (lex.in_word ? 1 : 0);
+    uint64_t starts = word_bytes & ~preceding;
+    uint64_t ends = ~word_bytes & preceding & in_run;
+
+    // a word carried over from the previous window ends at the first end
+    if (lex.in_word && ends) {
+        lex_end_word(lex, base + __builtin_ctzll(ends));
+        ends &= ends - 1;
+    }
+
+    // the remaining starts and ends pair up, except a last start whose
+    // word goes on past the run
+    for (; starts; starts &= starts - 1) {
+        size_t start = base + __builtin_ctzll(starts);
+        if (!ends) {
+            lex.in_word = false;
+            lex_begin_word(lex, start);
+            return;
+        }
+
+        size_t end = base + __builtin_ctzll(ends);
+        ends &= ends - 1;
+        lex.tokens[lex.n_tokens++] = { TOK_WORD, 0, -1, (uint32_t) start, (uint32_t) (end - start) };
+    }
+
+    lex.in_word = word_bytes >> (n - 1) & 1;
+}
+
+/**
+ * @brief Finds the ')' closing a command substitution
+ * @param text Source text
+ * @param len Length of the text
+ * @param at Position right after the "$("
+ * @return Position of the ')', len if there is none
+ * @remark Parentheses inside quotes, escaped ones and those of nested
+ * substitutions don't count.
+ */
+size_t find_subst_end(const char* text, size_t len, size_t at) {
+    int depth = 0;
+    bool in_dquote = false;
+
+    for (size_t i = at; i < len; ++i) {
+        char c = text[i];
+        if (c == '\\') {
+            ++i;
+        }
+        else if (in_dquote) {
+            if (c == '"')
+                in_dquote = false;
+            else if (c == '$' && i + 1 < len && text[i + 1] == '(')
+                i = find_subst_end(text, len, i + 2);
+        }
+        else if (c == '\'') {
+            const char* close = (const char*) memchr(text + i + 1, '\'', len - i - 1);
+            if (!close)
+                return len;
+            i = close - text;
+        }
+        else if (c == '"') {
+            in_dquote = true;
+        }
+        else if (c == '(') {
+            depth++;
+        }
+        else if (c == ')' && depth-- == 0) {
+            return i;
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief Handles the special character at text[at]
+ * @return Offset right after what was consumed, -1 on a syntax error
+ */
+long lex_special(lexer& lex, size_t at) {
+    const char* text = lex.text;
+    size_t len = lex.len;
+    char c = text[at];
+    char next = at + 1 < len ? text[at + 1] : '\0';
+
+    switch (c) {
+    case '\'': {
+        // everything up to the closing quote is literal
+        const char* close = (const char*) memchr(text + at + 1, '\'', len - at - 1);
+        if (!close) {
+            cerr << "[shell] unexpected EOF while looking for matching `''" << '\n';
+            return -1;
+        }
+        lex_begin_word(lex, at);
+        lex.word_flags |= WORD_QUOTED;
+        return close - text + 1;
+    }
+    case '"': {
+        size_t i = at + 1;
+        bool expand = false;
+        while (i < len && text[i] != '"') {
+            expand |= text[i] == '$';
+            // a command substitution can have quotes of its own
+            if (text[i] == '$' && i + 1 < len && text[i + 1] == '(')
+                i = find_subst_end(text, len, i + 2) + 1;
+            else
+                i += text[i] == '\\' ? 2 : 1;
+        }
+        if (i >= len) {
+            cerr << "[shell] unexpected EOF while looking for matching `\"'" << '\n';
+            return -1;
+        }
+        lex_begin_word(lex, at);
+        lex.word_flags |= WORD_QUOTED | (expand ? WORD_EXPAND : 0);
+        return i + 1;
+    }
+    case '$': {
+        lex_begin_word(lex, at);
+        lex.word_flags |= WORD_EXPAND;
+        if (next == '(') {
+            // $(...) is one piece, up to the matching parenthesis
+            size_t close = find_subst_end(text, len, at + 2);
+            if (close >= len) {
+                cerr << "[shell] unexpected EOF while looking for matching `)'" << '\n';
+                return -1;
+            }
+            return close + 1;
+        }
+        if (next != '{')
+            return at + 1;
+        // ${NAME} is one piece, whatever is inside
+        const char* close = (const char*) memchr(text + at, '}', len - at);
+        if (!close) {
+            cerr << "[shell] unexpected EOF while looking for matching `}'" << '\n';
+            return -1;
+        }
+        return close - text + 1;
+    }
+    case '\\':
+        // a backslash-newline between words just continues the line
+        if (!lex.in_word && next == '\n')
+            return at + 2;
+        lex_begin_word(lex, at);
+        lex.word_flags |= WORD_QUOTED;
+        return min(at + 2, len);
+    case '*':
+    case '?':
+    case '[':
+        // a pattern, matched against the file names when expanded
+        lex_begin_word(lex, at);
+        lex.word_flags |= WORD_GLOB;
+        return at + 1;
+    case '{':
+        // a brace expansion if a matching } and a , or .. follow, that is
+        // only checked when the word is expanded
+        lex_begin_word(lex, at);
+        lex.word_flags |= WORD_BRACE;
+        return at + 1;
+    case '(': {
+        // ((expression)) at the start of a word is an arithmetic command
+        if (lex.in_word || next != '(')
+            break;
+        size_t close = find_subst_end(text, len, at + 1);
+        if (close >= len) {
+            cerr << "[shell] unexpected EOF while looking for matching `))'" << '\n';
+            return -1;
+        }
+        if (find_subst_end(text, len, at + 2) + 1 != close)
+            break;
+        lex_begin_word(lex, at);
+        lex.word_flags = WORD_ARITH;
+        lex_end_word(lex, close + 1);
+        return close + 1;
+    }
+    case '#': {
+        // only starts a comment at the beginning of a word
+        if (lex.in_word)
+            return at + 1;
+        const char* eol = (const char*) memchr(text + at, '\n', len - at);
+        return eol ? eol - text : len;
+    }
+    case '<':
+    case '>': {
+        int fd = -1;
+        // a word made only of digits right before the operator is the fd
+        // being redirected, e.g. 2>
+        if (lex.in_word && lex.word_flags == 0 && at - lex.word_start <= 4) {
+            fd = 0;
+            for (size_t i = lex.word_start; i < at && fd >= 0; ++i)
+                fd = isdigit((unsigned char) text[i]) ? fd * 10 + text[i] - '0' : -1;
+        }
+        if (fd >= 0)
+            lex.in_word = false;
+        else
+            lex_end_word(lex, at);
+
+        token_type type = c == '<' ? TOK_LESS : TOK_GREAT;
+        size_t op_len = 1;
+        if (c == '<' && next == '<')
+            type = TOK_DLESS, op_len = 2;
+        else if (c == '>' && next == '>')
+            type = TOK_DGREAT, op_len = 2;
+        else if (next == '&')
+            type = c == '<' ? TOK_LESSAND : TOK_GREATAND, op_len = 2;
+
+        lex_push(lex, type, at, op_len, fd);
+        return at + op_len;
+    }
+    default:
+        break;
+    }
+
+    // operators end the current word
+    lex_end_word(lex, at);
+
+    token_type type;
+    size_t op_len = 1;
+    switch (c) {
+    case '\n': type = TOK_NEWLINE; break;
+    case ';':  type = TOK_SEMI; break;
+    case '(':  type = TOK_LPAREN; break;
+    case ')':  type = TOK_RPAREN; break;
+    case '&':
+        type = next == '&' ? TOK_AND_IF : TOK_AMP;
+        op_len = next == '&' ? 2 : 1;
+        break;
+    default:
+        type = next == '|' ? TOK_OR_IF : TOK_PIPE;
+        op_len = next == '|' ? 2 : 1;
+        break;
+    }
+
+    lex_push(lex, type, at, op_len);
+    return at + op_len;
+}
+
+/**
+ * @brief Splits the source text into words and operators
+ * @param text Source text, a line or a whole script
+ * @param len Length of the text
+ * @return Pair of {token array, token count}, the array is allocated from
+ * the line arena and ends with TOK_END. {nullptr, 0} on a syntax error.
+ * @remark Words respect quotes and backslashes, but are kept exactly as
+ * written, quote removal happens when they are expanded. The text is
+ * classified 64 bytes at a time by the active scanner, so long runs of
+ * plain words are split without looking at every byte.
+ */
+pair<token*, size_t> tokenize_line(const char* text, size_t len) {
+    lexer lex = { text, len, nullptr, 0, 128, false, 0, 0 };
+    lex.tokens = (token*) line_arena.alloc(sizeof(token) * lex.capacity, alignof(token));
+
+    size_t pos = 0;
+    while (pos < len) {
+        // a window can produce at most 64 tokens
+        if (lex.n_tokens + 66 > lex.capacity) {
+            // the token array is the latest allocation, so this
+            // usually grows in place
+            lex.tokens = (token*) line_arena.extend(lex.tokens, lex.capacity * sizeof(token),
+                                                    lex.capacity * 2 * sizeof(token));
+            lex.capacity *= 2;
+        }
+
+        size_t avail = min<size_t>(64, len - pos);
+        char_masks masks;
+
+        if (avail == 64) {
+            masks = active_scanner->classify(text + pos);
+        }
+        else {
+            // the last partial window is padded with delimiters
+            char tail[64];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, text + pos, avail);
+            masks = active_scanner->classify(tail);
+        }
+
+        // everything before the first special character is plain
+        size_t n_plain = masks.specials ? __builtin_ctzll(masks.specials) : avail;
+        lex_plain(lex, pos, masks.delims, n_plain);
+        pos += n_plain;
+
+        if (n_plain < avail) {
+            long next = lex_special(lex, pos);
+            if (next < 0)
+                return { nullptr, 0 };
+            pos = next;
+        }
+    }
+
+    lex_end_word(lex, len);
+    lex_push(lex, TOK_END, len, 0);
+
+    return { lex.tokens, lex.n_tokens };
+}
+
+/*
+    Parser
+    Recursive descent over the tokens:
+        list     := and_or ((';' | '&' | NEWLINE) and_or)*
+        and_or   := pipeline (('&&' | '||') pipeline)*
+        pipeline := command ('|' command)*
+        command  := for_loop | '((' expression '))' | (WORD | redirection)+
+        for_loop := 'for' NAME 'in' WORD* (';' | NEWLINE) NEWLINE* 'do' list 'done' redirection*
+        redirection := [fd] ('<' | '>' | '>>' | '<&' | '>&') WORD
+    The reserved words of for_loop are only recognized unquoted and where a
+    command starts.
+*/
+
+struct parser {
+    const char* text;
+    const token* tokens;
+    size_t pos;
+    ast_node* nodes;
+    uint32_t n_nodes;
+    bool failed;
+};
+
+uint32_t parse_add_node(parser& ps, ast_kind kind, uint8_t flags = 0) {
+    ps.nodes[ps.n_nodes] = { kind, flags, -1, 0, 0, 0 };
+    return ps.n_nodes++;
+}
+
+/**
+ * @brief Appends child to the children of parent
+ * @param last Last child of the parent so far, 0 if there is none
+ */
+void parse_add_child(parser& ps, uint32_t parent, uint32_t& last, uint32_t child) {
+    if (last == 0)
+        ps.nodes[parent].first = child;
+    else
+        ps.nodes[last].next = child;
+    last = child;
+}
+
+const token& parse_peek(parser& ps) {
+    return ps.tokens[ps.pos];
+}
+
+void parse_skip_newlines(parser& ps) {
+    while (parse_peek(ps).type == TOK_NEWLINE)
+        ps.pos++;
+}
+
+uint32_t parse_error(parser& ps) {
+    if (!ps.failed) {
+        const token& tok = parse_peek(ps);
+        cerr << "[shell] syntax error near unexpected token `";
+        if (tok.type == TOK_END)
+            cerr << "end of file";
+        else if (tok.type == TOK_NEWLINE)
+            cerr << "newline";
+        else
+            cerr.write(ps.text + tok.start, tok.len);
+        cerr << "'" << '\n';
+    }
+    ps.failed = true;
+    return 0;
+}
+
+/**
+ * @brief Checks if the next token is the reserved word
+ */
+bool parse_is_reserved(parser& ps, const char* word) {
+    const token& tok = parse_peek(ps);
+    return tok.type == TOK_WORD && tok.flags == 0 && tok.len == strlen(word)
+           && memcmp(ps.text + tok.start, word, tok.len) == 0;
+}
+
+/**
+ * @brief Adds the next token as a WORD node
+ */
+uint32_t parse_add_word(parser& ps) {
+    const token& tok = parse_peek(ps);
+    uint32_t word = parse_add_node(ps, AST_WORD, tok.flags);
+    ps.nodes[word].first = tok.start;
+    ps.nodes[word].len = tok.len;
+    ps.pos++;
+    return word;
+}
+
+/**
+ * @brief Parses the redirection starting at the next token
+ * @return The REDIR node, 0 on a syntax error
+ */
+uint32_t parse_redirection(parser& ps) {
+    const token& tok = parse_peek(ps);
+    uint32_t redir = parse_add_node(ps, AST_REDIR, tok.type);
+    ps.nodes[redir].fd = tok.fd;
+    ps.pos++;
+
+    if (parse_peek(ps).type != TOK_WORD)
+        return parse_error(ps);
+    ps.nodes[redir].first = parse_add_word(ps);
+    ps.nodes[redir].len = 1;
+    return redir;
+}
+
+uint32_t parse_list(parser& ps, bool in_loop = false);
+
+uint32_t parse_for(parser& ps) {
+    uint32_t loop = parse_add_node(ps, AST_FOR);
+    uint32_t last = 0;
+    ps.pos++;
+
+    const token& name = parse_peek(ps);
+    if (name.type != TOK_WORD || name.flags != 0 || !is_var_name(ps.text + name.start, name.len))
+        return parse_error(ps);
+    parse_add_child(ps, loop, last, parse_add_word(ps));
+
+    if (!parse_is_reserved(ps, "in"))
+        return parse_error(ps);
+    ps.pos++;
+    while (parse_peek(ps).type == TOK_WORD && !(parse_peek(ps).flags & WORD_ARITH)) {
+        parse_add_child(ps, loop, last, parse_add_word(ps));
+        ps.nodes[loop].len++;
+    }
+
+    if (parse_peek(ps).type != TOK_SEMI && parse_peek(ps).type != TOK_NEWLINE)
+        return parse_error(ps);
+    ps.pos++;
+    parse_skip_newlines(ps);
+    if (!parse_is_reserved(ps, "do"))
+        return parse_error(ps);
+    ps.pos++;
+
+    uint32_t body = parse_list(ps, true);
+    if (ps.failed)
+        return 0;
+    if (ps.nodes[body].len == 0 || !parse_is_reserved(ps, "done"))
+        return parse_error(ps);
+    ps.pos++;
+    parse_add_child(ps, loop, last, body);
+
+    while (!ps.failed && parse_peek(ps).type >= TOK_LESS && parse_peek(ps).type <= TOK_GREATAND)
+        parse_add_child(ps, loop, last, parse_redirection(ps));
+    return ps.failed ? 0 : loop;
+}
+
+uint32_t parse_command(parser& ps) {
+    if (parse_is_reserved(ps, "for"))
+        return parse_for(ps);
+
+    uint32_t cmd = parse_add_node(ps, AST_CMD);
+    uint32_t last = 0;
+    bool arith = false;
+
+    while (!ps.failed) {
+        const token& tok = parse_peek(ps);
+
+        if (tok.type == TOK_WORD) {
+            // ((expression)) is a command on its own
+            if (arith || (last != 0 && (tok.flags & WORD_ARITH)))
+                return parse_error(ps);
+            arith = tok.flags & WORD_ARITH;
+            parse_add_child(ps, cmd, last, parse_add_word(ps));
+            ps.nodes[cmd].len++;
+        }
+        else if (tok.type >= TOK_LESS && tok.type <= TOK_GREATAND) {
+            if (arith)
+                return parse_error(ps);
+            parse_add_child(ps, cmd, last, parse_redirection(ps));
+        }
+        else {
+            break;
+        }
+    }
+
+    // a command needs at least a word or a redirection
+    if (last == 0)
+        return parse_error(ps);
+    return cmd;
+}
+
+uint32_t parse_pipeline(parser& ps) {
+    uint32_t cmd = parse_command(ps);
+    if (ps.failed || parse_peek(ps).type != TOK_PIPE)
+        return cmd;
+
+    uint32_t pipeline = parse_add_node(ps, AST_PIPELINE);
+    uint32_t last = 0;
+    parse_add_child(ps, pipeline, last, cmd);
+    ps.nodes[pipeline].len = 1;
+
+    while (!ps.failed && parse_peek(ps).type == TOK_PIPE) {
+        ps.pos++;
+        parse_skip_newlines(ps);
+        parse_add_child(ps, pipeline, last, parse_command(ps));
+        ps.nodes[pipeline].len++;
+    }
+    return pipeline;
+}
+
+uint32_t parse_and_or(parser& ps) {
+    uint32_t left = parse_pipeline(ps);
+
+    while (!ps.failed && (parse_peek(ps).type == TOK_AND_IF || parse_peek(ps).type == TOK_OR_IF)) {
+        ast_kind kind = parse_peek(ps).type == TOK_AND_IF ? AST_AND : AST_OR;
+        ps.pos++;
+        parse_skip_newlines(ps);
+
+        uint32_t right = parse_pipeline(ps);
+        uint32_t node = parse_add_node(ps, kind);
+        ps.nodes[node].first = left;
+        ps.nodes[node].len = 2;
+        ps.nodes[left].next = right;
+        left = node;
+    }
+    return left;
+}
+
+/**
+ * @brief Parses a list
+ * @param in_loop The list is the body of a loop and ends before `done`
+ */
+uint32_t parse_list(parser& ps, bool in_loop) {
+    uint32_t list = parse_add_node(ps, AST_LIST);
+    uint32_t last = 0;
+
+    while (!ps.failed) {
+        parse_skip_newlines(ps);
+        if (parse_peek(ps).type == TOK_END || (in_loop && parse_is_reserved(ps, "done")))
+            break;
+
+        uint32_t item = parse_and_or(ps);
+        if (ps.failed)
+            break;
+        parse_add_child(ps, list, last, item);
+        ps.nodes[list].len++;
+
+        token_type sep = parse_peek(ps).type;
+        if (sep == TOK_AMP)
+            ps.nodes[item].flags |= NODE_BACKGROUND;
+        else if (sep == TOK_END)
+            break;
+        else if (sep != TOK_SEMI && sep != TOK_NEWLINE)
+            return parse_error(ps);
+        ps.pos++;
+    }
+    return list;
+}
+
+/**
+ * @brief Parses a line or a whole script
+ * @param text Source text, must outlive the tree
+ * @param len Length of the text
+ * @param mem Arena the nodes are allocated from
+ * @param tree Receives the parsed tree, the root list is node 0
+ * @return true on success, false on a syntax error (already reported)
+ */
+bool parse_source(const char* text, size_t len, arena& mem, ast& tree) {
+    uint64_t start = now_ns();
+    auto [tokens, n_tokens] = tokenize_line(text, len);
+    uint64_t tokenized = now_ns();
+    timing.tokenize_ns = tokenized - start;
+    timing.parse_ns = 0;
+    if (!tokens)
+        return false;
+
+    // every token creates at most one node of its own plus the command,
+    // pipeline and and/or nodes around it, so the array never has to grow
+    size_t max_nodes = 4 * n_tokens + 4;
+    parser ps = { text, tokens, 0, nullptr, 0, false };
+    ps.nodes = (ast_node*) mem.alloc(sizeof(ast_node) * max_nodes, alignof(ast_node));
+
+    parse_list(ps);
+    timing.parse_ns = now_ns() - tokenized;
+    if (ps.failed)
+        return false;
+
+    tree = { text, ps.nodes, ps.n_nodes };
+    return true;
+}
+
+/*
+    Arithmetic
+    $((...)) and ((...)) are compiled into a tree of arith_nodes, with the
+    constant parts folded, and cached by the position of their text in the
+    source, so the arithmetic of a loop is compiled once. The trees are
+    evaluated on int64_t, wrapping around on overflow like bash. Variables
+    keep the integer they were last assigned or read as, a counter is
+    never parsed back from its text.
+*/
+enum arith_op : uint8_t {
+    ARITH_NUM,
+    ARITH_VAR,
+    ARITH_STATUS,   // $?
+    ARITH_PID,      // $$
+    ARITH_NEG,
+    ARITH_NOT,
+    ARITH_BITNOT,
+    ARITH_PRE_INC,
+    ARITH_PRE_DEC,
+    ARITH_POST_INC,
+    ARITH_POST_DEC,
+    ARITH_POW,
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_SHL,
+    ARITH_SHR,
+    ARITH_LT,
+    ARITH_LE,
+    ARITH_GT,
+    ARITH_GE,
+    ARITH_EQ,
+    ARITH_NE,
+    ARITH_BITAND,
+    ARITH_BITXOR,
+    ARITH_BITOR,
+    ARITH_AND,
+    ARITH_OR,
+    ARITH_COND,
+    ARITH_ASSIGN,
+    ARITH_COMMA
+};
+
+struct arith_node {
+    arith_op op;
+    // ASSIGN: the operator of a compound assignment like +=, ASSIGN for =
+    arith_op assign_op;
+    // operands, ASSIGN and the increments have the VAR node as a
+    uint32_t a, b, c;
+    // NUM: the value
+    int64_t value;
+    // VAR: the name, in the text of the expression
+    uint32_t name_start;
+    uint32_t name_len;
+    uint32_t hash;
+    // VAR: the variable, valid while generation is var_generation
+    shell_var* var;
+    uint32_t generation;
+};
+
+struct arith_expr {
+    // copy of the source text, the names of the VAR nodes point into it
+    string text;
+    vector<arith_node> nodes;
+    uint32_t root;
+    bool compiled = false;
+    // syntax error, reported every time the expression is evaluated
+    const char* error = nullptr;
+};
+
+struct arith_compiler {
+    arith_expr& ex;
+    const char* s;
+    size_t pos;
+    const char* error;
+};
+
+// a binary operator, it doesn't match if followed by one of not_next,
+// e.g. & followed by & or =
+struct arith_binop {
+    const char* text;
+    const char* not_next;
+    arith_op op;
+};
+
+// the binary operators from the lowest to the highest precedence, all
+// left associative
+const arith_binop ARITH_LEVELS[][4] = {
+    { {"||", "", ARITH_OR} },
+    { {"&&", "", ARITH_AND} },
+    { {"|", "|=", ARITH_BITOR} },
+    { {"^", "=", ARITH_BITXOR} },
+    { {"&", "&=", ARITH_BITAND} },
+    { {"==", "", ARITH_EQ}, {"!=", "", ARITH_NE} },
+    { {"<=", "", ARITH_LE}, {">=", "", ARITH_GE}, {"<", "<", ARITH_LT}, {">", ">", ARITH_GT} },
+    { {"<<", "=", ARITH_SHL}, {">>", "=", ARITH_SHR} },
+    { {"+", "+=", ARITH_ADD}, {"-", "-=", ARITH_SUB} },
+    { {"*", "*=", ARITH_MUL}, {"/", "=", ARITH_DIV}, {"%", "=", ARITH_MOD} }
+};
+const size_t N_ARITH_LEVELS = sizeof(ARITH_LEVELS) / sizeof(ARITH_LEVELS[0]);
+
+const arith_binop ARITH_ASSIGN_OPS[] = {
+    {"=", "=", ARITH_ASSIGN}, {"+=", "", ARITH_ADD}, {"-=", "", ARITH_SUB}, {"*=", "", ARITH_MUL},
+    {"/=", "", ARITH_DIV}, {"%=", "", ARITH_MOD}, {"<<=", "", ARITH_SHL}, {">>=", "", ARITH_SHR},
+    {"&=", "", ARITH_BITAND}, {"^=", "", ARITH_BITXOR}, {"|=", "", ARITH_BITOR}
+};
+
+// compiled expressions by the address of their text
+unordered_map<const char*, arith_expr> arith_cache;
+
+// the cache is dropped when it has this many entries, e.g. after many
+// different interactive lines
+const size_t ARITH_CACHE_MAX = 4096;
+
+// variables whose values are expressions can refer to each other
+const int ARITH_MAX_DEPTH = 64;
+int arith_depth = 0;
+
+/**
+ * @brief Parses an integer constant: decimal, 0x hex, 0 octal or base#digits
+ * @param s The text, at the constant
+ * @param value Receives the value
+ * @return Length of the constant, 0 if it isn't valid
+ */
+size_t parse_arith_number(const char* s, int64_t& value) {
+    size_t i = 0;
+    int base = 10;
+
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        i = 2;
+    }
+    else if (s[0] == '0') {
+        base = 8;
+    }
+    else {
+        // base#digits, bases 2 to 36
+        size_t d = 0;
+        while (isdigit((unsigned char) s[d]))
+            d++;
+        if (s[d] == '#' && d > 0) {
+            base = atoi(s);
+            if (base < 2 || base > 36)
+                return 0;
+            i = d + 1;
+        }
+    }
+
+    uint64_t n = 0;
+    size_t start = i;
+    for (;; ++i) {
+        int c = tolower((unsigned char) s[i]);
+        int digit = isdigit(c) ? c - '0' : isalpha(c) ? c - 'a' + 10 : 99;
+        if (digit >= base)
+            break;
+        n = n * base + digit;
+    }
+    // a name right after the digits isn't a number, e.g. 08 or 1a
+    if (i == start || isalnum((unsigned char) s[i]) || s[i] == '_')
+        return 0;
+    value = (int64_t) n;
+    return i;
+}
+
+/**
+ * @brief Checks if a variable value is an integer, optionally signed and
+ * surrounded by blanks
+ */
+bool parse_arith_int(const char* s, int64_t& value) {
+    while (isspace((unsigned char) *s))
+        ++s;
+    bool negative = *s == '-';
+    if (*s == '-' || *s == '+')
+        ++s;
+    if (!*s)
+        return false;
+
+    size_t n = parse_arith_number(s, value);
+    if (n == 0)
+        return false;
+    for (s += n; isspace((unsigned char) *s);)
+        ++s;
+    if (*s)
+        return false;
+    if (negative)
+        value = (int64_t) (0 - (uint64_t) value);
+    return true;
+}
+
+/**
+ * @brief Applies an operator to evaluated operands
+ * @param error Receives the message on a division by 0 or a negative exponent
+ * @remark Shared by the evaluation and the constant folding. Overflows wrap.
+ */
+int64_t arith_apply(arith_op op, int64_t x, int64_t y, const char*& error) {
+    uint64_t ux = x, uy = y;
+
+    switch (op) {
+    case ARITH_NEG:    return (int64_t) (0 - ux);
+    case ARITH_NOT:    return !x;
+    case ARITH_BITNOT: return ~x;
+    case ARITH_MUL:    return (int64_t) (ux * uy);
+    case ARITH_ADD:    return (int64_t) (ux + uy);
+    case ARITH_SUB:    return (int64_t) (ux - uy);
+    case ARITH_SHL:    return (int64_t) (ux << (y & 63));
+    case ARITH_SHR:    return x >> (y & 63);
+    case ARITH_LT:     return x < y;
+    case ARITH_LE:     return x <= y;
+    case ARITH_GT:     return x > y;
+    case ARITH_GE:     return x >= y;
+    case ARITH_EQ:     return x == y;
+    case ARITH_NE:     return x != y;
+    case ARITH_BITAND: return x & y;
+    case ARITH_BITXOR: return x ^ y;
+    case ARITH_BITOR:  return x | y;
+    case ARITH_AND:    return x && y;
+    case ARITH_OR:     return x || y;
+    case ARITH_DIV:
+    case ARITH_MOD:
+        if (y == 0) {
+            error = "division by 0";
+            return 0;
+        }
+        // INT64_MIN / -1 overflows
+        if (y == -1)
+            return op == ARITH_DIV ? (int64_t) (0 - ux) : 0;
+        return op == ARITH_DIV ? x / y : x % y;
+    case ARITH_POW: {
+        if (y < 0) {
+            error = "exponent less than 0";
+            return 0;
+        }
+        uint64_t result = 1;
+        for (; uy; uy >>= 1, ux *= ux)
+            if (uy & 1)
+                result *= ux;
+        return (int64_t) result;
+    }
+    default:
+        return 0;
+    }
+}
+
+uint32_t arith_add_node(arith_compiler& ac, arith_op op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+    arith_node node = {};
+    node.op = op;
+    node.a = a;
+    node.b = b;
+    node.c = c;
+    ac.ex.nodes.push_back(node);
+    return (uint32_t) ac.ex.nodes.size() - 1;
+}
+
+/**
+ * @brief Adds an operator node, or the constant it folds into
+ */
+uint32_t arith_add_op(arith_compiler& ac, arith_op op, uint32_t a, uint32_t b = 0) {
+    // the operands of a failed parse may not exist
+    if (ac.error)
+        return 0;
+    vector<arith_node>& nodes = ac.ex.nodes;
+    bool unary = op == ARITH_NEG || op == ARITH_NOT || op == ARITH_BITNOT;
+
+    if (nodes[a].op == ARITH_NUM && (unary || nodes[b].op == ARITH_NUM)) {
+        const char* error = nullptr;
+        int64_t value = arith_apply(op, nodes[a].value, unary ? 0 : nodes[b].value, error);
+        // a division by a constant 0 is reported when it is evaluated
+        if (!error) {
+            nodes[a].value = value;
+            return a;
+        }
+    }
+    return arith_add_node(ac, op, a, b);
+}
+
+void arith_skip_space(arith_compiler& ac) {
+    while (isspace((unsigned char) ac.s[ac.pos]))
+        ac.pos++;
+}
+
+/**
+ * @brief Consumes an operator if it is next
+ */
+bool arith_accept(arith_compiler& ac, const char* op, const char* not_next = "") {
+    arith_skip_space(ac);
+    size_t n = strlen(op);
+    if (strncmp(ac.s + ac.pos, op, n) != 0)
+        return false;
+    char next = ac.s[ac.pos + n];
+    if (next && strchr(not_next, next))
+        return false;
+    ac.pos += n;
+    return true;
+}
+
+uint32_t arith_fail(arith_compiler& ac, const char* error) {
+    if (!ac.error)
+        ac.error = error;
+    return 0;
+}
+
+uint32_t arith_comma(arith_compiler& ac);
+uint32_t arith_assign(arith_compiler& ac);
+
+uint32_t arith_primary(arith_compiler& ac) {
+    arith_skip_space(ac);
+    const char* s = ac.s + ac.pos;
+
+    if (*s == '(') {
+        ac.pos++;
+        uint32_t inner = arith_comma(ac);
+        if (!arith_accept(ac, ")"))
+            return arith_fail(ac, "missing `)'");
+        return inner;
+    }
+    if (isdigit((unsigned char) *s)) {
+        int64_t value;
+        size_t n = parse_arith_number(s, value);
+        if (n == 0)
+            return arith_fail(ac, "invalid number");
+        ac.pos += n;
+        uint32_t node = arith_add_node(ac, ARITH_NUM);
+        ac.ex.nodes[node].value = value;
+        return node;
+    }
+
+    // $? and $$, $name and ${name} are the same as name
+    if (*s == '$' && (s[1] == '?' || s[1] == '$')) {
+        ac.pos += 2;
+        return arith_add_node(ac, s[1] == '?' ? ARITH_STATUS : ARITH_PID);
+    }
+    bool braces = s[0] == '$' && s[1] == '{';
+    size_t start = ac.pos + (braces ? 2 : *s == '$' ? 1 : 0);
+    size_t name_len = var_name_len(ac.s + start, strlen(ac.s + start));
+    if (name_len == 0 || (braces && ac.s[start + name_len] != '}'))
+        return arith_fail(ac, *s ? "syntax error: operand expected" : "syntax error: missing operand");
+    ac.pos = start + name_len + (braces ? 1 : 0);
+
+    uint32_t node = arith_add_node(ac, ARITH_VAR);
+    arith_node& var = ac.ex.nodes[node];
+    var.name_start = (uint32_t) start;
+    var.name_len = (uint32_t) name_len;
+    var.hash = var_hash(ac.s + start, name_len);
+    return node;
+}
+
+uint32_t arith_unary(arith_compiler& ac) {
+    if (ac.error)
+        return 0;
+
+    for (arith_op op: { ARITH_PRE_INC, ARITH_PRE_DEC }) {
+        if (arith_accept(ac, op == ARITH_PRE_INC ? "++" : "--")) {
+            uint32_t operand = arith_unary(ac);
+            if (ac.error)
+                return 0;
+            if (ac.ex.nodes[operand].op != ARITH_VAR)
+                return arith_fail(ac, "assignment to a non-variable");
+            return arith_add_node(ac, op, operand);
+        }
+    }
+    if (arith_accept(ac, "-"))
+        return arith_add_op(ac, ARITH_NEG, arith_unary(ac));
+    if (arith_accept(ac, "+"))
+        return arith_unary(ac);
+    if (arith_accept(ac, "!", "="))
+        return arith_add_op(ac, ARITH_NOT, arith_unary(ac));
+    if (arith_accept(ac, "~"))
+        return arith_add_op(ac, ARITH_BITNOT, arith_unary(ac));
+
+    uint32_t operand = arith_primary(ac);
+    if (!ac.error && ac.ex.nodes[operand].op == ARITH_VAR) {
+        if (arith_accept(ac, "++"))
+            return arith_add_node(ac, ARITH_POST_INC, operand);
+        if (arith_accept(ac, "--"))
+            return arith_add_node(ac, ARITH_POST_DEC, operand);
+    }
+    return operand;
+}
+
+uint32_t arith_power(arith_compiler& ac) {
+    uint32_t base = arith_unary(ac);
+    // right associative, 2**3**2 is 2**9
+    if (!ac.error && arith_accept(ac, "**", "="))
+        return arith_add_op(ac, ARITH_POW, base, arith_power(ac));
+    return base;
+}
+
+/**
+ * @brief Parses the binary operators of ARITH_LEVELS from the given level up
+ */
+uint32_t arith_binary(arith_compiler& ac, size_t level) {
+    if (level == N_ARITH_LEVELS)
+        return arith_power(ac);
+
+    uint32_t left = arith_binary(ac, level + 1);
+    while (!ac.error) {
+        const arith_binop* match = nullptr;
+        for (const arith_binop& op: ARITH_LEVELS[level]) {
+            if (op.text && arith_accept(ac, op.text, op.not_next)) {
+                match = &op;
+                break;
+            }
+        }
+        if (!match)
+            break;
+        left = arith_add_op(ac, match->op, left, arith_binary(ac, level + 1));
+    }
+    return left;
+}
+
+uint32_t arith_conditional(arith_compiler& ac) {
+    uint32_t cond = arith_binary(ac, 0);
+    if (ac.error || !arith_accept(ac, "?"))
+        return cond;
+
+    uint32_t if_true = arith_comma(ac);
+    if (!arith_accept(ac, ":"))
+        return arith_fail(ac, "`:' expected for conditional expression");
+    uint32_t if_false = arith_conditional(ac);
+
+    const arith_node& c = ac.ex.nodes[cond];
+    if (c.op == ARITH_NUM)
+        return c.value ? if_true : if_false;
+    return arith_add_node(ac, ARITH_COND, cond, if_true, if_false);
+}
+
+uint32_t arith_assign(arith_compiler& ac) {
+    uint32_t target = arith_conditional(ac);
+    if (ac.error || ac.ex.nodes[target].op != ARITH_VAR)
+        return target;
+
+    for (const arith_binop& op: ARITH_ASSIGN_OPS) {
+        if (arith_accept(ac, op.text, op.not_next)) {
+            // right associative, a = b = 1
+            uint32_t value = arith_assign(ac);
+            uint32_t node = arith_add_node(ac, ARITH_ASSIGN, target, value);
+            ac.ex.nodes[node].assign_op = op.op;
+            return node;
+        }
+    }
+    return target;
+}
+
+uint32_t arith_comma(arith_compiler& ac) {
+    uint32_t left = arith_assign(ac);
+    while (!ac.error && arith_accept(ac, ","))
+        left = arith_add_node(ac, ARITH_COMMA, left, arith_assign(ac));
+    return left;
+}
+
+/**
+ * @brief Compiles the text of an expression
+ * @param ex The expression, its text is set
+ */
+void arith_compile(arith_expr& ex) {
+    ex.nodes.clear();
+    ex.compiled = true;
+    ex.error = nullptr;
+
+    arith_compiler ac = { ex, ex.text.c_str(), 0, nullptr };
+    arith_skip_space(ac);
+    // an empty expression is 0
+    if (!ac.s[ac.pos]) {
+        ex.root = arith_add_node(ac, ARITH_NUM);
+        return;
+    }
+
+    ex.root = arith_comma(ac);
+    arith_skip_space(ac);
+    if (!ac.error && ac.s[ac.pos])
+        arith_fail(ac, "syntax error in expression");
+    ex.error = ac.error;
+}
+
+/**
+ * @brief Finds the variable of a VAR node
+ * @param create Adds the variable if it doesn't exist, for assignments
+ * @return The variable, nullptr if it doesn't exist
+ */
+shell_var* arith_var(arith_expr& ex, arith_node& node, bool create) {
+    if (node.var && node.generation == var_generation)
+        return node.var;
+
+    const char* name = ex.text.c_str() + node.name_start;
+    shell_var* v = create ? &var_slot(name, node.name_len)
+                 : var_table.empty() ? nullptr : probe_var(name, node.name_len, node.hash);
+    if (v && !v->name)
+        return nullptr;
+    node.var = v;
+    node.generation = var_generation;
+    return v;
+}
+
+/**
+ * @brief Evaluates a node of a compiled expression
+ * @param error Receives the message of an error, the value is 0 then
+ */
+int64_t arith_eval(arith_expr& ex, uint32_t index, const char*& error) {
+    if (error)
+        return 0;
+    arith_node& node = ex.nodes[index];
+
+    switch (node.op) {
+    case ARITH_NUM:
+        return node.value;
+    case ARITH_VAR: {
+        shell_var* v = arith_var(ex, node, false);
+        return v ? var_int(*v, error) : 0;
+    }
+    case ARITH_STATUS:
+        return last_status;
+    case ARITH_PID:
+        return shell_pid;
+    case ARITH_NEG:
+    case ARITH_NOT:
+    case ARITH_BITNOT:
+        return arith_apply(node.op, arith_eval(ex, node.a, error), 0, error);
+    case ARITH_AND:
+        return arith_eval(ex, node.a, error) && arith_eval(ex, node.b, error);
+    case ARITH_OR:
+        return arith_eval(ex, node.a, error) || arith_eval(ex, node.b, error);
+    case ARITH_COND:
+        return arith_eval(ex, node.a, error) ? arith_eval(ex, node.b, error) : arith_eval(ex, node.c, error);
+    case ARITH_COMMA:
+        arith_eval(ex, node.a, error);
+        return arith_eval(ex, node.b, error);
+    case ARITH_PRE_INC:
+    case ARITH_PRE_DEC:
+    case ARITH_POST_INC:
+    case ARITH_POST_DEC: {
+        int64_t old = var_int(*arith_var(ex, ex.nodes[node.a], true), error);
+        if (error)
+            return 0;
+        bool inc = node.op == ARITH_PRE_INC || node.op == ARITH_POST_INC;
+        int64_t updated = (int64_t) ((uint64_t) old + (inc ? 1 : -1));
+        // looked up again, evaluating the old value can add variables
+        set_var_int(*arith_var(ex, ex.nodes[node.a], true), updated);
+        return node.op == ARITH_PRE_INC || node.op == ARITH_PRE_DEC ? updated : old;
+    }
+    case ARITH_ASSIGN: {
+        int64_t value = arith_eval(ex, node.b, error);
+        if (node.assign_op != ARITH_ASSIGN)
+            value = arith_apply(node.assign_op, var_int(*arith_var(ex, ex.nodes[node.a], true), error), value, error);
+        if (!error)
+            set_var_int(*arith_var(ex, ex.nodes[node.a], true), value);
+        return value;
+    }
+    default:
+        return arith_apply(node.op, arith_eval(ex, node.a, error), arith_eval(ex, node.b, error), error);
+    }
+}
+
+/**
+ * @brief Evaluates an expression that isn't cached, the value of a variable
+ */
+int64_t arith_eval_text(const char* text, const char*& error) {
+    if (arith_depth >= ARITH_MAX_DEPTH) {
+        error = "expression recursion level exceeded";
+        return 0;
+    }
+
+    arith_expr ex;
+    ex.text = text;
+    arith_compile(ex);
+    if (ex.error) {
+        error = ex.error;
+        return 0;
+    }
+
+    arith_depth++;
+    int64_t value = arith_eval(ex, ex.root, error);
+    arith_depth--;
+    return value;
+}
+
+/**
+ * @brief Evaluates the expression in the source text at src
+ * @param src The expression, not NUL-terminated
+ * @param len Its length
+ * @param value Receives the value
+ * @return false on an error, which is reported
+ * @remark The compiled expression is cached by src, the text is compared
+ * to tell if the same place now holds another expression, e.g. the next
+ * interactive line.
+ */
+bool arith_evaluate(const char* src, size_t len, int64_t& value) {
+    if (arith_cache.size() >= ARITH_CACHE_MAX && arith_cache.find(src) == arith_cache.end())
+        arith_cache.clear();
+
+    arith_expr& ex = arith_cache[src];
+    if (!ex.compiled || ex.text.size() != len || memcmp(ex.text.data(), src, len) != 0) {
+        ex.text.assign(src, len);
+        arith_compile(ex);
+    }
+
+    const char* error = ex.error;
+    value = error ? 0 : arith_eval(ex, ex.root, error);
+    if (error) {
+        cerr << "[shell] " << ex.text << ": " << error << '\n';
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Evaluates an arithmetic expression, the (( built-in
+ * @remark ((expression)) runs it with the expression as its argument.
+ * The status is 0 if the value isn't 0, 1 if it is or on an error.
+ */
+int cmd_arith(char** args) {
+    int64_t value = 0;
+    bool ok = !args[1] || arith_evaluate(args[1], strlen(args[1]), value);
+    return ok && value != 0;
+}
+
+/*
+    Pathname expansion
+    A pattern is split at '/' and every segment compiled once into a list of
+    ops, then matched against the names of each directory it applies to.
+    Directories are read with getdents64 into a large buffer, d_type tells
+    the directories apart so that stat is only needed when the file system
+    doesn't fill it in or for symlinks. A ** segment is walked by a pool of
+    threads sharing a queue of directories.
+*/
+
+// getdents64 record, not declared by glibc
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// an element of a compiled pattern segment
+struct glob_op {
+    enum op_kind : uint8_t { LITERAL, ANY, STAR, SET };
+    op_kind kind;
+    string literal;
+    // SET: the bytes the bracket expression matches
+    bitset<256> set;
+};
+
+struct glob_segment {
+    vector<glob_op> ops;
+    // the whole segment unescaped, when it has no meta characters
+    string literal;
+    // literal after the last *, the names have to end with it
+    string suffix;
+    bool has_meta = false;
+    // the segment is **, any number of directories
+    bool globstar = false;
+    // names starting with a dot can match
+    bool match_dot = false;
+};
+
+// size of the getdents64 buffers
+const size_t GLOB_DIR_BUF = 1 << 20;
+
+// threads walking the directories of a **
+const unsigned GLOB_MAX_THREADS = 8;
+
+// getdents64 buffer of the shell thread, allocated on first use
+vector<char> glob_buf;
+
+/**
+ * @brief Compiles a bracket expression, [abc], [!a-z], [[:digit:]_]
+ * @param s The pattern, at the '['
+ * @param op Receives the character set
+ * @return Position right after the closing ']', nullptr if there is none
+ * and the '[' is literal
+ */
+const char* compile_bracket(const char* s, glob_op& op) {
+    static const pair<const char*, int (*)(int)> CLASSES[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper},
+        {"lower", islower}, {"space", isspace}, {"blank", isblank}, {"punct", ispunct},
+        {"xdigit", isxdigit}, {"cntrl", iscntrl}, {"print", isprint}, {"graph", isgraph}
+    };
+
+    op.kind = glob_op::SET;
+    op.set.reset();
+    const char* p = s + 1;
+    bool negate = *p == '!' || *p == '^';
+    if (negate)
+        ++p;
+
+    // a ']' right after the '[' is part of the set
+    for (bool first = true; *p && (first || *p != ']'); first = false) {
+        if (p[0] == '[' && p[1] == ':') {
+            const char* end = strstr(p + 2, ":]");
+            if (end) {
+                for (auto& [name, in_class]: CLASSES)
+                    if (strlen(name) == (size_t) (end - p - 2) && memcmp(name, p + 2, end - p - 2) == 0)
+                        for (int c = 1; c < 256; ++c)
+                            if (in_class(c))
+                                op.set.set(c);
+                p = end + 2;
+                continue;
+            }
+        }
+
+        unsigned char lo = *p == '\\' && p[1] ? *++p : *p;
+        ++p;
+        unsigned char hi = lo;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            hi = p[1] == '\\' && p[2] ? p[2] : p[1];
+            p += p[1] == '\\' && p[2] ? 3 : 2;
+        }
+        for (int c = lo; c <= hi; ++c)
+            op.set.set(c);
+    }
+
+    if (*p != ']')
+        return nullptr;
+    if (negate)
+        op.set.flip();
+    op.set.reset('/');
+    return p + 1;
+}
+
+/**
+ * @brief Checks if a string has unescaped glob characters
+ * @remark A '[' only counts if it starts a bracket expression.
+ */
+bool has_glob_chars(const char* s) {
+    glob_op probe;
+    for (; *s; ++s) {
+        if (*s == '\\' && s[1])
+            ++s;
+        else if (*s == '*' || *s == '?' || (*s == '[' && compile_bracket(s, probe)))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Removes the escaping backslashes of a pattern, in place
+ */
+void glob_unescape(char* s) {
+    char* out = s;
+    for (; *s; ++s) {
+        if (*s == '\\' && s[1])
+            ++s;
+        *out++ = *s;
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Compiles one segment of a pattern
+ * @param s The segment, without '/'
+ * @param len Its length
+ * @return The compiled segment
+ */
+glob_segment compile_segment(const char* s, size_t len) {
+    glob_segment seg;
+    string text(s, len);
+    seg.globstar = text == "**";
+
+    for (const char* p = text.c_str(); *p;) {
+        glob_op op;
+        if (*p == '*') {
+            op.kind = glob_op::STAR;
+            while (*p == '*')
+                ++p;
+            seg.has_meta = true;
+        }
+        else if (*p == '?') {
+            op.kind = glob_op::ANY;
+            ++p;
+            seg.has_meta = true;
+        }
+        else if (const char* end = *p == '[' ? compile_bracket(p, op) : nullptr) {
+            p = end;
+            seg.has_meta = true;
+        }
+        else {
+            // a run of literal characters, up to the next op
+            op.kind = glob_op::LITERAL;
+            while (*p && *p != '*' && *p != '?') {
+                glob_op probe;
+                if (*p == '[' && !op.literal.empty() && compile_bracket(p, probe))
+                    break;
+                if (*p == '\\' && p[1])
+                    ++p;
+                op.literal += *p++;
+            }
+            seg.literal += op.literal;
+        }
+        seg.ops.push_back(move(op));
+    }
+
+    // dot files are only matched by a pattern that starts with a literal dot
+    seg.match_dot = !seg.ops.empty() && seg.ops[0].kind == glob_op::LITERAL && seg.ops[0].literal[0] == '.';
+    // the literal the names have to end with, checked before the full match
+    if (seg.ops.size() >= 2 && seg.ops.back().kind == glob_op::LITERAL && seg.ops[seg.ops.size() - 2].kind == glob_op::STAR)
+        seg.suffix = seg.ops.back().literal;
+    return seg;
+}
+
+/**
+ * @brief Matches a name against a compiled segment
+ * @remark Iterative, a mismatch after a * resumes one character further
+ * from the most recent *, so there is no exponential backtracking.
+ */
+bool glob_match(const glob_segment& seg, const char* name, size_t len) {
+    if (name[0] == '.' && !seg.match_dot)
+        return false;
+    if (seg.suffix.size() > len || memcmp(name + len - seg.suffix.size(), seg.suffix.data(), seg.suffix.size()) != 0)
+        return false;
+
+    const glob_op* ops = seg.ops.data();
+    size_t n_ops = seg.ops.size();
+    size_t p = 0;
+    size_t i = 0;
+    size_t star_op = SIZE_MAX;
+    size_t star_i = 0;
+
+    while (i < len || p < n_ops) {
+        if (p < n_ops) {
+            const glob_op& op = ops[p];
+            if (op.kind == glob_op::STAR) {
+                // a trailing * matches whatever is left
+                if (++p == n_ops)
+                    return true;
+                star_op = p;
+                star_i = i;
+                continue;
+            }
+            if (i < len) {
+                if (op.kind == glob_op::ANY || (op.kind == glob_op::SET && op.set.test((unsigned char) name[i]))) {
+                    ++p, ++i;
+                    continue;
+                }
+                if (op.kind == glob_op::LITERAL && len - i >= op.literal.size()
+                    && memcmp(name + i, op.literal.data(), op.literal.size()) == 0) {
+                    ++p;
+                    i += op.literal.size();
+                    continue;
+                }
+            }
+        }
+        if (star_op == SIZE_MAX || star_i >= len)
+            return false;
+        p = star_op;
+        i = ++star_i;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the entries of a directory with getdents64
+ * @param path The directory, "" for the current one
+ * @param buf Buffer for the entries
+ * @param buf_size Its size, large so that big directories take few calls
+ * @param fn Called with the directory fd, the name, its length and d_type
+ * of every entry but . and ..
+ * @return false if the directory couldn't be opened
+ */
+template <typename F>
+bool read_dir(const string& path, char* buf, size_t buf_size, F fn) {
+    int fd = open(path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, buf_size)) > 0) {
+        for (long off = 0; off < n;) {
+            const linux_dirent64* d = (const linux_dirent64*) (buf + off);
+            off += d->d_reclen;
+            const char* name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            fn(fd, name, strlen(name), d->d_type);
+        }
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * @brief Checks if a directory entry is a directory
+ * @param follow Symlinks to directories count, not for the ** walk
+ * @remark Only stats when d_type doesn't tell.
+ */
+bool entry_is_dir(int dir_fd, const char* name, unsigned char type, bool follow) {
+    if (type == DT_DIR)
+        return true;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow))
+        return false;
+    struct stat st;
+    return fstatat(dir_fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Walks a directory tree for **, on a pool of threads
+ * @param base Directory the walk starts from, "" or ending with '/'
+ * @param files true to collect every entry, false for the directories only
+ * @param out Receives the base and the paths found below it. Without
+ * files, the directories found end with '/'
+ * @remark Hidden directories are not entered and symlinks not followed,
+ * like bash's globstar.
+ */
+void glob_walk(const string& base, bool files, vector<string>& out) {
+    vector<string> queue = { base };
+    size_t busy = 0;
+    mutex lock;
+    condition_variable changed;
+
+    out.push_back(base);
+
+    auto worker = [&]() {
+        vector<char> buf(GLOB_DIR_BUF);
+        vector<string> subdirs;
+        vector<string> found;
+
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            changed.wait(guard, [&] { return !queue.empty() || busy == 0; });
+            if (queue.empty())
+                break;
+            string dir = move(queue.back());
+            queue.pop_back();
+            busy++;
+            guard.unlock();
+
+            read_dir(dir, buf.data(), buf.size(), [&](int fd, const char* name, size_t len, unsigned char type) {
+                if (name[0] == '.')
+                    return;
+                bool is_dir = entry_is_dir(fd, name, type, false);
+                string path = dir;
+                path.append(name, len);
+                if (is_dir)
+                    subdirs.push_back(path + '/');
+                if (files)
+                    found.push_back(move(path));
+                else if (is_dir)
+                    found.push_back(subdirs.back());
+            });
+
+            guard.lock();
+            busy--;
+            for (string& d: subdirs)
+                queue.push_back(move(d));
+            for (string& f: found)
+                out.push_back(move(f));
+            subdirs.clear();
+            found.clear();
+            changed.notify_all();
+        }
+    };
+
+    // the calling thread is one of the workers
+    unsigned n_threads = min(max(thread::hardware_concurrency(), 1u), GLOB_MAX_THREADS);
+    vector<thread> threads;
+    for (unsigned i = 1; i < n_threads; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (thread& t: threads)
+        t.join();
+}
+
+/**
+ * @brief Expands a pattern into the matching paths
+ * @param pattern The pattern, backslashes escape the next character
+ * @param matches Receives the sorted matches
+ * @remark The directories the pattern names literally are not read, e.g.
+ * only src is read for src/\*.c.
+ */
+void glob_expand(const char* pattern, vector<string>& matches) {
+    // the directories the segments matched so far, "" or ending with '/'
+    vector<string> paths = { *pattern == '/' ? "/" : "" };
+    bool dirs_only = false;
+
+    for (const char* p = pattern; *p;) {
+        while (*p == '/')
+            ++p;
+        const char* end = p;
+        while (*end && *end != '/')
+            end += *end == '\\' && end[1] ? 2 : 1;
+        if (end == p)
+            break;
+
+        glob_segment seg = compile_segment(p, end - p);
+        bool last = true;
+        for (const char* q = end; *q; ++q)
+            if (*q != '/')
+                last = false;
+        dirs_only = last && *end == '/';
+        p = end;
+
+        vector<string> next;
+        if (seg.globstar) {
+            for (const string& dir: paths)
+                glob_walk(dir, last && !dirs_only, next);
+            // a final ** doesn't list the current directory
+            if (last)
+                next.erase(remove(next.begin(), next.end(), string()), next.end());
+        }
+        else if (!seg.has_meta) {
+            for (const string& dir: paths) {
+                string path = dir + seg.literal;
+                struct stat st;
+                // an intermediate directory is checked when it is read
+                if (last && lstat(path.c_str(), &st) != 0)
+                    continue;
+                if (!last)
+                    path += '/';
+                next.push_back(move(path));
+            }
+        }
+        else {
+            if (glob_buf.empty())
+                glob_buf.resize(GLOB_DIR_BUF);
+            for (const string& dir: paths) {
+                read_dir(dir, glob_buf.data(), glob_buf.size(), [&](int fd, const char* name, size_t len, unsigned char type) {
+                    if (!glob_match(seg, name, len))
+                        return;
+                    if ((!last || dirs_only) && !entry_is_dir(fd, name, type, true))
+                        return;
+                    string path = dir;
+                    path.append(name, len);
+                    if (!last)
+                        path += '/';
+                    next.push_back(move(path));
+                });
+            }
+        }
+
+        paths = move(next);
+        if (paths.empty())
+            return;
+    }
+
+    for (string& path: paths) {
+        // the directories matched by a pattern ending with '/' keep it
+        if (dirs_only && (path.empty() || path.back() != '/'))
+            path += '/';
+        matches.push_back(move(path));
+    }
+    sort(matches.begin(), matches.end());
+}
+
+/*
+    Brace expansion
+    a{b,c}d becomes abd acd, {1..5}, {a..e} and {01..10..3} become
+    sequences, before any other expansion of the word. The braces are
+    compiled into a tree of brace_nodes that knows how many values there
+    are and how long they are altogether, and the k-th value is rendered
+    by reading k as a mixed radix number, one digit per brace. Nothing is
+    generated ahead: a for loop takes one value at a time and the arguments
+    of a command are written into one allocation of the exact size.
+
+    TEXT     text [first, first + len) of the word
+    CONCAT   the values of the children one after the other
+    LIST     {a,b,c}, children: a CONCAT per alternative
+    RANGE    {from..to..step}
+*/
+enum brace_kind : uint8_t {
+    BRACE_TEXT,
+    BRACE_CONCAT,
+    BRACE_LIST,
+    BRACE_RANGE
+};
+
+struct brace_node {
+    brace_kind kind;
+    // RANGE: the values are letters instead of numbers
+    bool letters;
+    // RANGE: width the numbers are zero padded to, including the sign
+    uint8_t width;
+    // TEXT: offset of the text in the word, others: index of the first child
+    uint32_t first;
+    // TEXT: length of the text, others: number of children
+    uint32_t len;
+    // index of the next sibling, 0 for the last one. The root is node 0.
+    uint32_t next;
+    // length of the longest value, at most
+    uint32_t max_len;
+    // number of values and their total length, BRACE_TOO_LARGE if they
+    // don't fit in 64 bits
+    uint64_t count;
+    uint64_t bytes;
+    // child of a CONCAT: number of values of the siblings after it, the
+    // weight of its digit
+    uint64_t stride;
+    // RANGE: first value and the step towards the last one
+    int64_t from;
+    int64_t step;
+};
+
+// the braces of one word, in the line arena
+struct brace_expr {
+    const char* text;
+    size_t len;
+    brace_node* nodes;
+    uint32_t n_nodes;
+};
+
+// counts and lengths saturate at this
+const uint64_t BRACE_TOO_LARGE = UINT64_MAX;
+// most bytes the values of one word may add to the arguments of a command
+const uint64_t BRACE_MAX_ARGS_BYTES = 1ull << 30;
+// sequence ends are limited so that no difference of values overflows
+const int64_t BRACE_MAX_END = 1000000000000000000;
+
+uint64_t brace_add(uint64_t a, uint64_t b) {
+    uint64_t sum;
+    return __builtin_add_overflow(a, b, &sum) ? BRACE_TOO_LARGE : sum;
+}
+
+uint64_t brace_mul(uint64_t a, uint64_t b) {
+    uint64_t product;
+    return __builtin_mul_overflow(a, b, &product) ? BRACE_TOO_LARGE : product;
+}
+
+/**
+ * @brief Skips a quoted or escaped piece or a $ expansion, braces and
+ * commas in them don't count
+ * @return Position after it, at + 1 for any other character
+ */
+size_t brace_skip(const char* text, size_t len, size_t at) {
+    char c = text[at];
+    char next = at + 1 < len ? text[at + 1] : '\0';
+
+    if (c == '\\')
+        return min(at + 2, len);
+    if (c == '\'') {
+        const char* close = (const char*) memchr(text + at + 1, '\'', len - at - 1);
+        return close ? close - text + 1 : len;
+    }
+    if (c == '"') {
+        size_t i = at + 1;
+        while (i < len && text[i] != '"') {
+            if (text[i] == '$' && i + 1 < len && text[i + 1] == '(')
+                i = find_subst_end(text, len, i + 2) + 1;
+            else
+                i += text[i] == '\\' ? 2 : 1;
+        }
+        return min(i + 1, len);
+    }
+    if (c == '$' && next == '(')
+        return min(find_subst_end(text, len, at + 2) + 1, len);
+    if (c == '$' && next == '{') {
+        const char* close = (const char*) memchr(text + at, '}', len - at);
+        return close ? close - text + 1 : len;
+    }
+    return at + 1;
+}
+
+uint32_t brace_add_node(brace_expr& b, brace_kind kind) {
+    b.nodes[b.n_nodes] = { kind, false, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0 };
+    return b.n_nodes++;
+}
+
+void brace_add_child(brace_expr& b, uint32_t parent, uint32_t& last, uint32_t child) {
+    if (last == 0)
+        b.nodes[parent].first = child;
+    else
+        b.nodes[last].next = child;
+    b.nodes[parent].len++;
+    last = child;
+}
+
+/**
+ * @brief Parses an end or the step of a sequence
+ */
+bool parse_brace_number(const char* s, size_t len, int64_t& value) {
+    auto [end, ec] = from_chars(s, s + len, value);
+    return len > 0 && ec == errc() && end == s + len && value >= -BRACE_MAX_END && value <= BRACE_MAX_END;
+}
+
+/**
+ * @brief Number of values of the sequence in [lo, hi]
+ */
+uint64_t brace_range_between(const brace_node& node, int64_t lo, int64_t hi) {
+    // the values as an ascending progression
+    int64_t step = node.step < 0 ? -node.step : node.step;
+    int64_t last = node.from + node.step * (int64_t) (node.count - 1);
+    int64_t low = min(node.from, last);
+    lo = max(lo, low);
+    hi = min(hi, max(node.from, last));
+    if (lo > hi)
+        return 0;
+
+    uint64_t first_k = (lo - low + step - 1) / step;
+    uint64_t last_k = (hi - low) / step;
+    return first_k <= last_k ? last_k - first_k + 1 : 0;
+}
+
+/**
+ * @brief Parses the inside of {from..to} or {from..to..step}
+ * @param s, len Text between the braces
+ * @param node Receives the RANGE node
+ * @return false if it isn't a sequence
+ * @remark Like in bash the step's sign doesn't matter, the values go from
+ * the first end towards the other. A leading zero on either end pads all
+ * the numbers to the width of the longer one.
+ */
+bool parse_brace_range(const char* s, size_t len, brace_node& node) {
+    const char* dots = (const char*) memmem(s, len, "..", 2);
+    if (!dots)
+        return false;
+    const char* to_text = dots + 2;
+    const char* step_dots = (const char*) memmem(to_text, s + len - to_text, "..", 2);
+    size_t from_len = dots - s;
+    size_t to_len = (step_dots ? step_dots : s + len) - to_text;
+
+    int64_t step = 1;
+    if (step_dots && !parse_brace_number(step_dots + 2, s + len - step_dots - 2, step))
+        return false;
+    step = step < 0 ? -step : max<int64_t>(step, 1);
+
+    int64_t from, to;
+    bool letters = from_len == 1 && to_len == 1 && isalpha((unsigned char) *s) && isalpha((unsigned char) *to_text);
+    if (letters) {
+        from = *s;
+        to = *to_text;
+    }
+    else if (!parse_brace_number(s, from_len, from) || !parse_brace_number(to_text, to_len, to)) {
+        return false;
+    }
+
+    auto zero_padded = [](const char* n, size_t n_len) {
+        size_t sign = *n == '-';
+        return n_len > sign + 1 && n[sign] == '0';
+    };
+    uint8_t width = !letters && (zero_padded(s, from_len) || zero_padded(to_text, to_len)) ? max(from_len, to_len) : 0;
+
+    node = { BRACE_RANGE, letters, width, 0, 0, 0, 0, 0, 0, 1, from, from <= to ? step : -step };
+    node.count = (uint64_t) (from <= to ? to - from : from - to) / step + 1;
+
+    if (letters) {
+        node.max_len = 1;
+        node.bytes = node.count;
+        return true;
+    }
+
+    char digits[24];
+    size_t from_digits = to_chars(digits, digits + sizeof(digits), from).ptr - digits;
+    size_t to_digits = to_chars(digits, digits + sizeof(digits), to).ptr - digits;
+    node.max_len = max<size_t>(width, max(from_digits, to_digits));
+
+    // the total length, counted per number of digits
+    int64_t power = 1;
+    for (int n_digits = 1; n_digits <= 19; ++n_digits) {
+        int64_t band_low = n_digits == 1 ? 0 : power;
+        int64_t band_high = n_digits == 19 ? INT64_MAX : power * 10 - 1;
+        uint64_t positive = brace_range_between(node, band_low, band_high);
+        uint64_t negative = brace_range_between(node, -band_high, -max<int64_t>(band_low, 1));
+        node.bytes = brace_add(node.bytes, brace_mul(positive, max<int>(width, n_digits)));
+        node.bytes = brace_add(node.bytes, brace_mul(negative, max<int>(width, n_digits + 1)));
+        if (n_digits < 19)
+            power *= 10;
+    }
+    return true;
+}
+
+/**
+ * @brief Parses text[start, end) of the word into a CONCAT node
+ * @param found Set when a brace expansion is found
+ * @return Index of the node
+ * @remark A { without a matching } or without a , or .. inside is just a
+ * character, the braces inside it can still expand.
+ */
+uint32_t parse_brace_concat(brace_expr& b, size_t start, size_t end, bool& found) {
+    uint32_t concat = brace_add_node(b, BRACE_CONCAT);
+    uint32_t last = 0;
+    size_t text_start = start;
+    size_t i = start;
+
+    while (i < end) {
+        if (b.text[i] != '{') {
+            i = brace_skip(b.text, end, i);
+            continue;
+        }
+
+        // the matching } and whether there is a , outside nested braces
+        size_t close = i + 1;
+        int depth = 0;
+        bool comma = false;
+        while (close < end && (b.text[close] != '}' || depth > 0)) {
+            char c = b.text[close];
+            depth += c == '{' ? 1 : c == '}' ? -1 : 0;
+            comma |= c == ',' && depth == 0;
+            close = brace_skip(b.text, end, close);
+        }
+
+        brace_node range;
+        if (close >= end || (!comma && !parse_brace_range(b.text + i + 1, close - i - 1, range))) {
+            i++;
+            continue;
+        }
+
+        found = true;
+        if (i > text_start) {
+            uint32_t text = brace_add_node(b, BRACE_TEXT);
+            b.nodes[text].first = text_start;
+            b.nodes[text].len = i - text_start;
+            brace_add_child(b, concat, last, text);
+        }
+
+        uint32_t group;
+        if (comma) {
+            group = brace_add_node(b, BRACE_LIST);
+            uint32_t last_alt = 0;
+            size_t alt_start = i + 1;
+            depth = 0;
+            for (size_t j = i + 1; j <= close; j = j < close ? brace_skip(b.text, close, j) : j + 1) {
+                char c = b.text[j];
+                if (j == close || (c == ',' && depth == 0)) {
+                    brace_add_child(b, group, last_alt, parse_brace_concat(b, alt_start, j, found));
+                    alt_start = j + 1;
+                }
+                else {
+                    depth += c == '{' ? 1 : c == '}' ? -1 : 0;
+                }
+            }
+        }
+        else {
+            group = brace_add_node(b, BRACE_RANGE);
+            b.nodes[group] = range;
+        }
+        brace_add_child(b, concat, last, group);
+        i = text_start = close + 1;
+    }
+
+    if (end > text_start) {
+        uint32_t text = brace_add_node(b, BRACE_TEXT);
+        b.nodes[text].first = text_start;
+        b.nodes[text].len = end - text_start;
+        brace_add_child(b, concat, last, text);
+    }
+
+    // the counts and lengths of the children add up to the ones of the CONCAT
+    brace_node& node = b.nodes[concat];
+    for (uint32_t c = node.first; c != 0; c = b.nodes[c].next) {
+        brace_node& child = b.nodes[c];
+        if (child.kind == BRACE_TEXT) {
+            child.max_len = child.bytes = child.len;
+        }
+        else if (child.kind == BRACE_LIST) {
+            child.count = 0;
+            for (uint32_t alt = child.first; alt != 0; alt = b.nodes[alt].next) {
+                child.count = brace_add(child.count, b.nodes[alt].count);
+                child.bytes = brace_add(child.bytes, b.nodes[alt].bytes);
+                child.max_len = max(child.max_len, b.nodes[alt].max_len);
+            }
+        }
+        node.count = brace_mul(node.count, child.count);
+        node.max_len += child.max_len;
+    }
+
+    // every value of a child appears once for every combination of the others
+    uint64_t stride = node.count;
+    for (uint32_t c = node.first; c != 0; c = b.nodes[c].next) {
+        brace_node& child = b.nodes[c];
+        node.bytes = node.count == BRACE_TOO_LARGE ? BRACE_TOO_LARGE
+                   : brace_add(node.bytes, brace_mul(child.bytes, node.count / child.count));
+        stride /= child.count;
+        child.stride = stride;
+    }
+    return concat;
+}
+
+/**
+ * @brief Compiles the braces of a word
+ * @param text Text of the word
+ * @param len Length of the word
+ * @param b Receives the compiled braces, allocated from the line arena
+ * @return false if the word has no brace expansion, it is then expanded
+ * as it is
+ */
+bool brace_compile(const char* text, size_t len, brace_expr& b) {
+    arena::position mark = line_arena.mark();
+    // every node but the CONCATs takes at least one character, and there
+    // is a CONCAT per , or } plus the root
+    size_t max_nodes = 2 * len + 2;
+    b = { text, len, (brace_node*) line_arena.alloc(sizeof(brace_node) * max_nodes, alignof(brace_node)), 0 };
+
+    bool found = false;
+    parse_brace_concat(b, 0, len, found);
+    if (!found)
+        line_arena.release(mark);
+    return found;
+}
+
+/**
+ * @brief Writes the k-th value of a brace node
+ * @param b Compiled braces
+ * @param index Index of the node
+ * @param k Index of the value, less than the count of the node
+ * @param out Where the value is written, room for max_len characters
+ * @return Position right after the value, it isn't NUL-terminated
+ */
+char* brace_render(const brace_expr& b, uint32_t index, uint64_t k, char* out) {
+    const brace_node& node = b.nodes[index];
+
+    switch (node.kind) {
+    case BRACE_TEXT:
+        memcpy(out, b.text + node.first, node.len);
+        return out + node.len;
+    case BRACE_CONCAT:
+        for (uint32_t c = node.first; c != 0; c = b.nodes[c].next)
+            out = brace_render(b, c, k / b.nodes[c].stride % b.nodes[c].count, out);
+        return out;
+    case BRACE_LIST: {
+        uint32_t alt = node.first;
+        while (k >= b.nodes[alt].count) {
+            k -= b.nodes[alt].count;
+            alt = b.nodes[alt].next;
+        }
+        return brace_render(b, alt, k, out);
+    }
+    default: {
+        int64_t value = node.from + node.step * (int64_t) k;
+        if (node.letters) {
+            *out = (char) value;
+            return out + 1;
+        }
+        char digits[24];
+        uint64_t magnitude = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+        size_t n = to_chars(digits, digits + sizeof(digits), magnitude).ptr - digits;
+        if (value < 0)
+            *out++ = '-';
+        for (size_t pad = n + (value < 0); pad < node.width; ++pad)
+            *out++ = '0';
+        memcpy(out, digits, n);
+        return out + n;
+    }
+    }
+}
+
+/*
+    Expansion
+    A word expands into zero or more fields: braces are expanded first, then
+    quotes are removed and $NAME, ${NAME}, $? and $$ replaced by their values. Outside double quotes the
+    values are split into separate fields at the characters of $IFS. A
+    field with unquoted glob characters is then replaced by the paths it
+    matches, if there are any.
+*/
+
+/**
+ * @brief Makes room for n more characters and the NUL in the current field
+ */
+void exp_reserve(expansion& e, size_t n) {
+    if (e.len + n + 1 <= e.capacity)
+        return;
+
+    size_t capacity = max<size_t>(max<size_t>(e.capacity * 2, e.len + n + 1), 32);
+    e.buf = e.buf ? (char*) line_arena.extend(e.buf, e.capacity, capacity)
+                  : (char*) line_arena.alloc(capacity, 1);
+    e.capacity = capacity;
+}
+
+/**
+ * @brief Appends text to the current field, the field exists from then on
+ */
+void exp_put(expansion& e, const char* s, size_t n) {
+    exp_reserve(e, n);
+    memcpy(e.buf + e.len, s, n);
+    e.len += n;
+    e.started = true;
+}
+
+/**
+ * @brief Appends quoted text, literal even if the field is a pattern
+ */
+void exp_put_quoted(expansion& e, const char* s, size_t n) {
+    if (!e.glob) {
+        exp_put(e, s, n);
+        return;
+    }
+    exp_reserve(e, 2 * n);
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+            e.buf[e.len++] = '\\';
+        e.buf[e.len++] = s[i];
+    }
+    e.started = true;
+}
+
+/**
+ * @brief Adds a finished field
+ */
+void exp_push_field(expansion& e, char* field) {
+    // room for the field and the terminating nullptr
+    if (e.n_fields + 2 > e.max_fields) {
+        size_t max_fields = max<size_t>(e.max_fields * 2, 8);
+        e.fields = (char**) line_arena.extend(e.fields, sizeof(char*) * e.max_fields, sizeof(char*) * max_fields);
+        e.max_fields = max_fields;
+    }
+    e.fields[e.n_fields++] = field;
+}
+
+/**
+ * @brief Makes room for exactly n more fields, if there isn't room already
+ */
+void exp_reserve_fields(expansion& e, size_t n) {
+    if (e.n_fields + n + 1 <= e.max_fields)
+        return;
+    size_t max_fields = e.n_fields + n + 1;
+    e.fields = (char**) line_arena.extend(e.fields, sizeof(char*) * e.max_fields, sizeof(char*) * max_fields);
+    e.max_fields = max_fields;
+}
+
+/**
+ * @brief Finishes the current field, if there is one
+ */
+void exp_end_field(expansion& e) {
+    if (!e.started)
+        return;
+
+    exp_reserve(e, 0);
+    e.buf[e.len] = '\0';
+    // reused, so that only the paths themselves allocate
+    static vector<string> matches;
+    matches.clear();
+    if (e.field_globs && has_glob_chars(e.buf))
+        glob_expand(e.buf, matches);
+
+    for (const string& path: matches) {
+        char* field = (char*) line_arena.alloc(path.size() + 1, 1);
+        memcpy(field, path.c_str(), path.size() + 1);
+        exp_push_field(e, field);
+    }
+    // a pattern without matches stays as it is, minus the escapes
+    if (matches.empty()) {
+        if (e.glob)
+            glob_unescape(e.buf);
+        exp_push_field(e, e.buf);
+    }
+    e.buf = nullptr;
+    e.len = e.capacity = 0;
+    e.started = false;
+    e.field_globs = false;
+}
+
+/**
+ * @brief Appends the value of an unquoted expansion, split into fields
+ * @remark Like POSIX field splitting: runs of IFS whitespace separate
+ * fields, every other IFS character ends one, even an empty one.
+ */
+void exp_put_split(expansion& e, const char* s, size_t n) {
+    const char* ifs = get_var("IFS");
+    if (!e.split || (ifs && !*ifs)) {
+        if (n > 0 && !e.glob)
+            exp_put(e, s, n);
+        ifs = "";
+    }
+    else if (!ifs) {
+        ifs = " \t\n";
+    }
+    if (n == 0 || (!*ifs && !e.glob))
+        return;
+
+    // a pattern may grow by the backslashes escaping backslashes
+    exp_reserve(e, e.glob ? 2 * n : n);
+    for (size_t i = 0; i < n; ++i) {
+        char c = s[i];
+        if (c == '\0' || !strchr(ifs, c)) {
+            if (e.glob) {
+                // the glob characters of a value are live, its backslashes are not
+                e.field_globs |= c == '*' || c == '?' || c == '[';
+                if (c == '\\')
+                    e.buf[e.len++] = '\\';
+            }
+            e.buf[e.len++] = c;
+            e.started = true;
+            continue;
+        }
+        if (c != ' ' && c != '\t' && c != '\n')
+            e.started = true;
+        exp_end_field(e);
+        exp_reserve(e, e.glob ? 2 * (n - i) : n - i);
+    }
+}
+
+/**
+ * @brief Expands the parameter, command substitution or arithmetic
+ * starting with the $ at src[at]
+ * @param src Text of the word
+ * @param len Length of the word
+ * @param at Position of the $
+ * @param e Expansion the value is added to
+ * @param quoted The $ is inside double quotes, the value isn't split
+ * @return Position right after the parameter
+ */
+size_t expand_param(const char* src, size_t len, size_t at, expansion& e, bool quoted) {
+    size_t i = at + 1;
+    const char* name = src + i;
+    size_t name_len = 0;
+
+    if (i < len && src[i] == '(') {
+        // $((expression)) if the inner parentheses close right before the outer ones
+        size_t close = find_subst_end(src, len, at + 2);
+        if (src[at + 2] == '(' && find_subst_end(src, len, at + 3) + 1 == close) {
+            int64_t value;
+            if (arith_evaluate(src + at + 3, close - at - 4, value)) {
+                char digits[24];
+                size_t n = to_chars(digits, digits + sizeof(digits), value).ptr - digits;
+                if (quoted)
+                    exp_put_quoted(e, digits, n);
+                else
+                    exp_put_split(e, digits, n);
+            }
+            else {
+                expansion_errors++;
+            }
+            return close + 1;
+        }
+        return expand_subst(src, len, at, e, quoted);
+    }
+    if (i < len && src[i] == '{') {
+        const char* close = (const char*) memchr(src + i, '}', len - i);
+        if (!close) {
+            exp_put(e, "$", 1);
+            return i;
+        }
+        name = src + i + 1;
+        name_len = close - name;
+        i = close - src + 1;
+        if (!is_var_name(name, name_len) && !(name_len == 1 && (*name == '?' || *name == '$'))) {
+            cerr << "[shell] ${" << string(name, name_len) << "}: bad substitution" << '\n';
+            return i;
+        }
+    }
+    else if (i < len && (src[i] == '?' || src[i] == '$')) {
+        name_len = 1;
+        i++;
+    }
+    else {
+        name_len = var_name_len(name, len - i);
+        // a $ that doesn't start a parameter is literal
+        if (name_len == 0) {
+            exp_put(e, "$", 1);
+            return i;
+        }
+        i += name_len;
+    }
+
+    char number[16];
+    const char* value;
+    if (*name == '?' || *name == '$') {
+        snprintf(number, sizeof(number), "%d", *name == '?' ? last_status : (int) shell_pid);
+        value = number;
+    }
+    else {
+        const shell_var* v = find_var(name, name_len);
+        value = v && v->set ? v->entry.c_str() + v->name_len + 1 : "";
+    }
+
+    if (quoted)
+        exp_put_quoted(e, value, strlen(value));
+    else
+        exp_put_split(e, value, strlen(value));
+    return i;
+}
+
+/**
+ * @brief Expands the text of a word into fields
+ * @param src Text of the word
+ * @param len Length of the text
+ * @param e Expansion the fields are added to, the last one is left open
+ * @remark Single quotes keep everything literal, inside double quotes a
+ * backslash only escapes $ ` " \ and newline and parameters aren't split.
+ */
+void expand_word_into(const char* src, size_t len, expansion& e) {
+    // quote removal alone never grows the word
+    exp_reserve(e, len);
+
+    size_t i = 0;
+    while (i < len) {
+        char c = src[i];
+
+        if (c == '\'') {
+            const char* close = (const char*) memchr(src + i + 1, '\'', len - i - 1);
+            exp_put_quoted(e, src + i + 1, close - src - i - 1);
+            i = close - src + 1;
+        }
+        else if (c == '"') {
+            e.started = true;
+            i++;
+            while (src[i] != '"') {
+                if (src[i] == '\\' && strchr("$`\"\\\n", src[i + 1])) {
+                    if (src[i + 1] != '\n')
+                        exp_put_quoted(e, src + i + 1, 1);
+                    i += 2;
+                }
+                else if (src[i] == '$') {
+                    i = expand_param(src, len, i, e, true);
+                }
+                else {
+                    exp_put_quoted(e, src + i, 1);
+                    i++;
+                }
+            }
+            i++;
+        }
+        else if (c == '\\') {
+            // backslash-newline disappears, any other character is literal
+            if (i + 1 < len && src[i + 1] != '\n')
+                exp_put_quoted(e, src + i + 1, 1);
+            i += 2;
+        }
+        else if (c == '$') {
+            i = expand_param(src, len, i, e, false);
+        }
+        else {
+            size_t run = i + 1;
+            while (run < len && !strchr("'\"\\$", src[run]))
+                run++;
+            for (size_t j = i; e.glob && j < run && !e.field_globs; ++j)
+                e.field_globs = src[j] == '*' || src[j] == '?' || src[j] == '[';
+            exp_put(e, src + i, run - i);
+            i = run;
+        }
+    }
+}
+
+/**
+ * @brief Expands a word into a single string, without field splitting
+ * @param tree Tree the word belongs to
+ * @param word AST_WORD node
+ * @return NULL-terminated text, allocated from the line arena
+ * @remark For redirection targets and assignments. A plain word is just copied.
+ */
+char* expand_word(const ast& tree, const ast_node& word) {
+    if (!(word.flags & (WORD_QUOTED | WORD_EXPAND))) {
+        char* out = (char*) line_arena.alloc(word.len + 1, 1);
+        memcpy(out, tree.text + word.first, word.len);
+        out[word.len] = '\0';
+        return out;
+    }
+
+    expansion e = {};
+    expand_word_into(tree.text + word.first, word.len, e);
+    exp_reserve(e, 0);
+    e.buf[e.len] = '\0';
+    return e.buf;
+}
+
+/**
+ * @brief Adds the values of the brace expansion of a word to the fields
+ * @param b Compiled braces of the word
+ * @param flags WORD_* flags of the word
+ * @param e Expansion the fields are added to
+ * @param n_more Number of fields still to come, the field array is sized
+ * for them too
+ * @return false if the values are too large to be arguments (reported)
+ * @remark Values of a word without quotes or expansions are final as they
+ * are rendered, they are written right into one allocation of their total
+ * length. Any other value is expanded further on its own.
+ */
+bool exp_put_braces(const brace_expr& b, uint8_t flags, expansion& e, size_t n_more) {
+    const brace_node& root = b.nodes[0];
+    if (brace_add(root.bytes, root.count) > BRACE_MAX_ARGS_BYTES) {
+        cerr << "[shell] ";
+        cerr.write(b.text, b.len) << ": brace expansion too large" << '\n';
+        return false;
+    }
+    exp_reserve_fields(e, root.count + n_more);
+
+    if (!(flags & (WORD_QUOTED | WORD_EXPAND | WORD_GLOB))) {
+        char* out = (char*) line_arena.alloc(root.bytes + root.count, 1);
+        for (uint64_t k = 0; k < root.count; ++k) {
+            char* end = brace_render(b, 0, k, out);
+            // an empty value is dropped, like an empty unquoted word
+            if (end == out)
+                continue;
+            *end = '\0';
+            exp_push_field(e, out);
+            out = end + 1;
+        }
+        return true;
+    }
+
+    char* value = (char*) line_arena.alloc(root.max_len + 1, 1);
+    e.glob = flags & (WORD_GLOB | WORD_EXPAND);
+    for (uint64_t k = 0; k < root.count; ++k) {
+        expand_word_into(value, brace_render(b, 0, k, value) - value, e);
+        exp_end_field(e);
+    }
+    return true;
+}
+
+/**
+ * @brief Expands a word of a command into fields
+ * @param tree Tree the word belongs to
+ * @param word AST_WORD node
+ * @param e Expansion the fields are added to
+ * @param n_more Number of words still to come
+ */
+void expand_word_fields(const ast& tree, const ast_node& word, expansion& e, size_t n_more) {
+    // ((expression)) runs the (( built-in with the expression as it is
+    if (word.flags & WORD_ARITH) {
+        char* expr = (char*) line_arena.alloc(word.len - 3, 1);
+        memcpy(expr, tree.text + word.first + 2, word.len - 4);
+        expr[word.len - 4] = '\0';
+        exp_push_field(e, (char*) "((");
+        exp_push_field(e, expr);
+        return;
+    }
+    brace_expr b;
+    if ((word.flags & WORD_BRACE) && brace_compile(tree.text + word.first, word.len, b)
+        && exp_put_braces(b, word.flags, e, n_more))
+        return;
+    // plain words are most of them, they are copied as they are
+    if (!(word.flags & (WORD_QUOTED | WORD_EXPAND | WORD_GLOB))) {
+        exp_push_field(e, expand_word(tree, word));
+        return;
+    }
+    // the text of expansions can be a pattern too
+    e.glob = word.flags & (WORD_GLOB | WORD_EXPAND);
+    expand_word_into(tree.text + word.first, word.len, e);
+    exp_end_field(e);
+}
+
+/**
+ * @brief Expands the words of a command into an argument array
+ * @param tree Tree the command belongs to
+ * @param cmd AST_CMD node
+ * @param skip Number of leading words to leave out, the assignments
+ * @param n_args Receives the number of arguments
+ * @return NULL-terminated argument array, allocated from the line arena
+ */
+char** expand_cmd(const ast& tree, const ast_node& cmd, size_t skip, size_t& n_args) {
+    expansion e = {};
+    e.max_fields = cmd.len + 1;
+    e.fields = (char**) line_arena.alloc(sizeof(char*) * e.max_fields, alignof(char*));
+    e.split = true;
+
+    size_t n_words = 0;
+    for (uint32_t i = cmd.first; i != 0; i = tree.nodes[i].next) {
+        const ast_node& word = tree.nodes[i];
+        if (word.kind != AST_WORD || n_words++ < skip)
+            continue;
+        expand_word_fields(tree, word, e, cmd.len - n_words);
+    }
+
+    // excevp requires the last element to be NULL.
+    e.fields[e.n_fields] = nullptr;
+    n_args = e.n_fields;
+    return e.fields;
+}
+
+/*
+    Command substitution
+    $(...) is replaced by the output of its commands, minus the trailing
+    newlines. The commands run in a subshell, nothing they change is seen
+    by the shell, but a copy of the shell is only forked when it has to be:
+    pure built-ins run in-process with cout captured (a virtual subshell),
+    a single command or pipeline is launched like any other with its
+    stdout on a pipe, only anything else runs in a forked copy.
+*/
+
+// output of the substitutions being expanded, released as soon as it has
+// been added to the fields
+arena subst_arena;
+
+// free space kept in the output buffer for each read from the pipe
+const size_t SUBST_READ_CHUNK = 64 * 1024;
+
+/**
+ * @brief Output of a substitution, in subst_arena
+ * @remark Also the stream buffer cout writes to while pure built-ins run.
+ */
+class capture_buf : public streambuf {
+public:
+    char* data = nullptr;
+    size_t len = 0;
+    size_t capacity = 0;
+
+    /**
+     * @brief Makes room for n more bytes
+     */
+    void reserve(size_t n) {
+        if (len + n <= capacity)
+            return;
+        size_t new_capacity = max<size_t>(max<size_t>(capacity * 2, len + n), 256);
+        data = (char*) (data ? subst_arena.extend(data, capacity, new_capacity)
+                             : subst_arena.alloc(new_capacity, 1));
+        capacity = new_capacity;
+    }
+
+protected:
+    streamsize xsputn(const char* s, streamsize n) override {
+        reserve(n);
+        memcpy(data + len, s, n);
+        len += n;
+        return n;
+    }
+
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) {
+            char ch = (char) c;
+            xsputn(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+};
+
+/**
+ * @brief Checks if a substitution can run in-process
+ * @param tree Tree of the substitution
+ * @param index Node to check, 0 for all of it
+ * @remark It can if it only runs pure built-ins, named literally, without
+ * redirections, assignments or background jobs. The only trace they leave
+ * is then their output and the exit status.
+ */
+bool is_pure_subst(const ast& tree, uint32_t index) {
+    const ast_node& node = tree.nodes[index];
+
+    switch (node.kind) {
+    case AST_LIST:
+    case AST_AND:
+    case AST_OR:
+        for (uint32_t i = node.first; i != 0; i = tree.nodes[i].next)
+            if ((node.kind == AST_LIST && (tree.nodes[i].flags & NODE_BACKGROUND)) || !is_pure_subst(tree, i))
+                return false;
+        return true;
+    case AST_CMD: {
+        const ast_node& name = tree.nodes[node.first];
+        char buf[16];
+        if (name.kind != AST_WORD || name.flags != 0 || name.len >= sizeof(buf))
+            return false;
+        for (uint32_t i = node.first; i != 0; i = tree.nodes[i].next)
+            if (tree.nodes[i].kind == AST_REDIR)
+                return false;
+        if (count_assignments(tree, node) > 0)
+            return false;
+
+        memcpy(buf, tree.text + name.first, name.len);
+        buf[name.len] = '\0';
+        const builtin_desc* desc = find_builtin_desc(buf);
+        return desc && desc->pure;
+    }
+    default:
+        // the commands of a pipeline are forked anyway
+        return false;
+    }
+}
+
+/**
+ * @brief Checks if the words of a node have arithmetic expansions
+ * @remark They can assign variables, so a substitution with one runs in a
+ * forked copy: the words of a launched command are expanded by the shell.
+ */
+bool has_arith_expansion(const ast& tree, uint32_t index) {
+    const ast_node& node = tree.nodes[index];
+
+    if (node.kind == AST_WORD)
+        return (node.flags & WORD_EXPAND) && memmem(tree.text + node.first, node.len, "$((", 3);
+    for (uint32_t i = node.first; i != 0; i = tree.nodes[i].next)
+        if (has_arith_expansion(tree, i))
+            return true;
+    return false;
+}
+
+/**
+ * @brief Reads a pipe till EOF
+ */
+void read_subst_output(int fd, capture_buf& out) {
+    while (true) {
+        out.reserve(SUBST_READ_CHUNK);
+        ssize_t n = read(fd, out.data + out.len, out.capacity - out.len);
+        if (n > 0)
+            out.len += n;
+        else if (n == 0 || errno != EINTR)
+            break;
+    }
+}
+
+/**
+ * @brief Runs the commands of a substitution
+ * @param tree Parsed commands
+ * @param out Receives their output
+ * @return Exit status of the last command
+ */
+int run_subst(const ast& tree, capture_buf& out) {
+    bool arith = has_arith_expansion(tree, 0);
+    if (!arith && is_pure_subst(tree, 0)) {
+        streambuf* saved = cout.rdbuf(&out);
+        execute_node(tree, 0);
+        cout.rdbuf(saved);
+        return last_status;
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        perror("[shell] Error creating pipe.");
+        return last_status = 1;
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+    arena::position mark = line_arena.mark();
+    const ast_node& root = tree.nodes[0];
+    const ast_node& item = tree.nodes[root.first];
+    pid_t* pids = (pid_t*) line_arena.alloc(sizeof(pid_t) * max<uint32_t>(item.len, 1), alignof(pid_t));
+    size_t n_pids = 0;
+    int status = 1;
+
+    if (!arith && root.len == 1 && !(item.flags & NODE_BACKGROUND) && (item.kind == AST_CMD || item.kind == AST_PIPELINE)) {
+        // started like a pipeline, with the stdout of the shell on the pipe
+        // meanwhile so that the last command inherits it
+        fd_remap remap = { pipe_fds[1], STDOUT_FILENO };
+        int saved;
+        if (apply_fd_remaps({ &remap, 1 }, &saved)) {
+            if (item.kind == AST_PIPELINE)
+                status = start_pipeline(tree, item.first, item.len, -1, pids, n_pids);
+            else
+                status = start_pipeline(tree, root.first, 1, -1, pids, n_pids);
+            restore_fd_remaps({ &remap, 1 }, &saved);
+        }
+    }
+    else {
+        cout.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            // the jobs of the shell aren't children of this copy
+            job_table.clear();
+            interactive = false;
+            execute_node(tree, 0);
+            cout.flush();
+            _exit(last_status);
+        }
+        else if (pid < 0) {
+            perror("[shell] Error forking child process.");
+        }
+        else {
+            pids[n_pids++] = pid;
+            status = -1;
+        }
+    }
+
+    // the children have the write end, EOF comes when the last one is done
+    close(pipe_fds[1]);
+    read_subst_output(pipe_fds[0], out);
+    close(pipe_fds[0]);
+
+    for (size_t k = 0; k < n_pids; ++k) {
+        int child_status = exit_status(wait_child(pids[k]));
+        if (k == n_pids - 1 && status < 0)
+            status = child_status;
+    }
+
+    line_arena.release(mark);
+    return last_status = status;
+}
+
+/**
+ * @brief Expands the command substitution starting with the $ at src[at]
+ * @param src Text of the word
+ * @param len Length of the word
+ * @param at Position of the $
+ * @param e Expansion the output is added to
+ * @param quoted The substitution is inside double quotes, the output isn't split
+ * @return Position right after the closing ')'
+ * @remark The commands are parsed every time, which costs far less than
+ * running them. $? is their exit status afterwards.
+ */
+size_t expand_subst(const char* src, size_t len, size_t at, expansion& e, bool quoted) {
+    size_t close = find_subst_end(src, len, at + 2);
+    arena::position mark = subst_arena.mark();
+    capture_buf out;
+
+    // the tree only lives as long as the command the word belongs to
+    ast tree;
+    if (parse_source(src + at + 2, close - at - 2, line_arena, tree))
+        run_subst(tree, out);
+    else
+        last_status = 2;
+
+    while (out.len > 0 && out.data[out.len - 1] == '\n')
+        out.len--;
+    if (out.len > 0 && quoted)
+        exp_put_quoted(e, out.data, out.len);
+    else if (out.len > 0)
+        exp_put_split(e, out.data, out.len);
+
+    // releasing to an empty arena would free its chunk, reset keeps it
+    if (mark.chunk)
+        subst_arena.release(mark);
+    else
+        subst_arena.reset();
+    return close + 1;
+}
+
+/*
+    AST execution
+*/
+
+// the values a word of a for loop gives its variable: fields expanded
+// before the loop, or braces generated one value at a time
+struct loop_values {
+    char** fields;
+    brace_expr braces;
+    uint64_t count;
+    // the braces have quotes in them that are still to be removed
+    bool quoted;
+};
+
+/**
+ * @brief Opens the files of the redirections of a command
+ * @param tree Tree the command belongs to
+ * @param cmd AST_CMD node
+ * @param opts Receives the fd remaps, allocated from the line arena
+ * @return true on success, false if a file couldn't be opened (reported)
+ * @remark Files are opened by the shell, so the errors name the file, and
+ * the child only has to dup2 them in place. The opened fds are close-on-exec
+ * and owned by the caller, see close_redirs().
+ */
+bool open_redirs(const ast& tree, const ast_node& cmd, launch_opts& opts) {
+    size_t n_redirs = 0;
+    for (uint32_t i = cmd.first; i != 0; i = tree.nodes[i].next)
+        n_redirs += tree.nodes[i].kind == AST_REDIR;
+
+    fd_remap* remaps = (fd_remap*) line_arena.alloc(sizeof(fd_remap) * n_redirs, alignof(fd_remap));
+    opts.remaps = remaps;
+    opts.n_remaps = 0;
+
+    for (uint32_t i = cmd.first; i != 0; i = tree.nodes[i].next) {
+        const ast_node& redir = tree.nodes[i];
+        if (redir.kind != AST_REDIR)
+            continue;
+
+        token_type op = (token_type) redir.flags;
+        char* target = expand_word(tree, tree.nodes[redir.first]);
+        int dst = redir.fd >= 0 ? redir.fd : (op == TOK_LESS || op == TOK_LESSAND || op == TOK_DLESS) ? 0 : 1;
+        int src;
+
+        if (op == TOK_LESSAND || op == TOK_GREATAND) {
+            // n>&m duplicates m, n>&- closes n
+            char* end;
+            src = strcmp(target, "-") == 0 ? -1 : (int) strtol(target, &end, 10);
+            if (src >= 0 && (*end != '\0' || end == target)) {
+                cerr << "[shell] " << target << ": ambiguous redirect" << '\n';
+                return false;
+            }
+        }
+        else if (op == TOK_DLESS) {
+            cerr << "[shell] here-documents are not supported" << '\n';
+            return false;
+        }
+        else {
+            int flags = op == TOK_LESS ? O_RDONLY
+                      : op == TOK_DGREAT ? O_WRONLY | O_CREAT | O_APPEND
+                      : O_WRONLY | O_CREAT | O_TRUNC;
+            src = open(target, flags | O_CLOEXEC, 0666);
+            if (src < 0) {
+                cerr << "[shell] " << target << ": " << strerror(errno) << '\n';
+                return false;
+            }
+
+            // keep it away from the fds the redirections name, so that
+            // dup2 never has the same source and destination
+            if (src < 10) {
+                int moved = fcntl(src, F_DUPFD_CLOEXEC, 10);
+                close(src);
+                src = moved;
+            }
+        }
+
+        remaps[opts.n_remaps++] = { src, dst };
+    }
+    return true;
+}
+
+/**
+ * @brief Closes the files opened by open_redirs
+ */
+void close_redirs(const ast& tree, const ast_node& cmd, const launch_opts& opts) {
+    size_t r = 0;
+    for (uint32_t i = cmd.first; i != 0 && r < opts.n_remaps; i = tree.nodes[i].next) {
+        const ast_node& redir = tree.nodes[i];
+        if (redir.kind != AST_REDIR)
+            continue;
+
+        token_type op = (token_type) redir.flags;
+        if (op != TOK_LESSAND && op != TOK_GREATAND)
+            close(opts.remaps[r].src);
+        r++;
+    }
+}
+
+/**
+ * @brief Executes a simple command
+ * @param tree Tree the command belongs to
+ * @param cmd AST_CMD node
+ * @return Exit status of the command
+ */
+int execute_simple_cmd(const ast& tree, const ast_node& cmd) {
+    // ((expression)) is evaluated right from the source, so it is compiled
+    // once for every place it appears in
+    const ast_node& first = tree.nodes[cmd.first];
+    if (first.kind == AST_WORD && (first.flags & WORD_ARITH)) {
+        int64_t value;
+        bool ok = arith_evaluate(tree.text + first.first + 2, first.len - 4, value);
+        return last_status = ok && value != 0 ? 0 : 1;
+    }
+
+    // the expanded words are only needed till the command is done
+    arena::position mark = line_arena.mark();
+    size_t errors = expansion_errors;
+
+    launch_opts opts;
+    if (!open_redirs(tree, cmd, opts)) {
+        close_redirs(tree, cmd, opts);
+        line_arena.release(mark);
+        return last_status = 1;
+    }
+
+    // NAME=value words before the command name are assignments
+    size_t n_assigns = count_assignments(tree, cmd);
+    size_t n_args = 0;
+    char** args = cmd.len > n_assigns ? expand_cmd(tree, cmd, n_assigns, n_args) : nullptr;
+
+    if (expansion_errors != errors) {
+        last_status = 1;
+    }
+    else if (n_args == 0) {
+        // without a command the assignments stay, redirections just create the
+        // files. The status is the one of the last command substitution, if any.
+        last_status = 0;
+        size_t n = 0;
+        for (uint32_t i = cmd.first; i != 0 && n < n_assigns; i = tree.nodes[i].next) {
+            if (tree.nodes[i].kind == AST_WORD) {
+                assign_word(tree, tree.nodes[i], false);
+                n++;
+            }
+        }
+        if (expansion_errors != errors)
+            last_status = 1;
+    }
+    else if (n_assigns == 0) {
+        execute_cmd(args, n_args, opts);
+    }
+    else {
+        // the command gets them in its environment, the shell keeps its values
+        saved_var* saved = save_assignments(tree, cmd, n_assigns);
+        if (expansion_errors != errors)
+            last_status = 1;
+        else
+            execute_cmd(args, n_args, opts);
+        restore_assignments(saved, n_assigns);
+    }
+
+    close_redirs(tree, cmd, opts);
+    line_arena.release(mark);
+    return last_status;
+}
+
+/**
+ * @brief Runs a compound command in a forked copy of the shell, for
+ * pipeline stages
+ * @param tree Tree the command belongs to
+ * @param index Index of the command
+ * @param opts fd setup of the child
+ * @return pid of the child process, -1 on failure
+ */
+pid_t fork_node(const ast& tree, uint32_t index, const launch_opts& opts) {
+    cout.flush();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (opts.pgid >= 0)
+            setpgid(0, opts.pgid);
+        for (size_t i = 0; i < opts.n_remaps; ++i)
+            dup2(opts.remaps[i].src, opts.remaps[i].dst);
+        // the jobs of the shell aren't children of this copy
+        job_table.clear();
+        interactive = false;
+        execute_node(tree, index);
+        cout.flush();
+        _exit(last_status);
+    }
+    else if (pid < 0) {
+        perror("[shell] Error forking child process.");
+    }
+    else if (opts.pgid >= 0) {
+        setpgid(pid, opts.pgid == 0 ? pid : opts.pgid);
+    }
+    return pid;
+}
+
+/**
+ * @brief Starts the commands of a pipeline without waiting for them
+ * @param tree Tree the commands belong to
+ * @param first Index of the first AST_CMD node
+ * @param count Number of commands
+ * @param pgid Process group of the commands: -1 keeps the group of the
+ * shell, 0 starts a new group led by the first command
+ * @param pids Receives the pids of the started commands, room for count
+ * @param n_pids Receives the number of started commands
+ * @return -1 if the last command was started, its exit status otherwise
+ * @remark Every command is connected to the next one by a pipe with its
+ * capacity raised to PIPE_SIZE. The redirections of a command are applied
+ * after the pipe, so they win, e.g. `a 2>&1 | b`.
+ */
+int start_pipeline(const ast& tree, uint32_t first, uint32_t count, pid_t pgid, pid_t* pids, size_t& n_pids) {
+    int prev_read = -1;
+    int last_cmd_status = 0;
+    n_pids = 0;
+
+    uint32_t i = first;
+    for (uint32_t k = 0; k < count; ++k, i = tree.nodes[i].next) {
+        const ast_node& cmd = tree.nodes[i];
+        int pipe_fds[2] = {-1, -1};
+        bool last = k + 1 == count;
+
+        if (!last) {
+            if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+                perror("[shell] Error creating pipe.");
+                last_cmd_status = 1;
+                break;
+            }
+            // raising the size can fail for unprivileged users over their
+            // pipe quota, the default size still works
+            fcntl(pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        }
+
+        launch_opts redirs;
+        pid_t pid = -1;
+        last_cmd_status = 1;
+        size_t errors = expansion_errors;
+
+        if (cmd.kind != AST_CMD) {
+            // a loop applies its own redirections in the child
+            fd_remap remaps[2];
+            size_t n_remaps = 0;
+            if (prev_read >= 0)
+                remaps[n_remaps++] = { prev_read, STDIN_FILENO };
+            if (pipe_fds[1] >= 0)
+                remaps[n_remaps++] = { pipe_fds[1], STDOUT_FILENO };
+            pid = fork_node(tree, i, { remaps, n_remaps, pgid });
+        }
+        else if (open_redirs(tree, cmd, redirs)) {
+            fd_remap* remaps = (fd_remap*) line_arena.alloc(sizeof(fd_remap) * (redirs.n_remaps + 2), alignof(fd_remap));
+            size_t n_remaps = 0;
+            if (prev_read >= 0)
+                remaps[n_remaps++] = { prev_read, STDIN_FILENO };
+            if (pipe_fds[1] >= 0)
+                remaps[n_remaps++] = { pipe_fds[1], STDOUT_FILENO };
+            for (size_t r = 0; r < redirs.n_remaps; ++r)
+                remaps[n_remaps++] = redirs.remaps[r];
+
+            size_t n_assigns = count_assignments(tree, cmd);
+            size_t n_args = 0;
+            char** args = cmd.len > n_assigns ? expand_cmd(tree, cmd, n_assigns, n_args) : nullptr;
+
+            // a stage with a failed expansion isn't started, its status stays 1
+            if (expansion_errors == errors && n_args > 0) {
+                saved_var* saved = save_assignments(tree, cmd, n_assigns);
+                if (expansion_errors == errors)
+                    pid = start_cmd(args, { remaps, n_remaps, pgid });
+                restore_assignments(saved, n_assigns);
+                if (pid < 0 && expansion_errors == errors)
+                    last_cmd_status = last_status;
+            }
+            else if (expansion_errors == errors) {
+                last_cmd_status = 0;
+            }
+        }
+        close_redirs(tree, cmd, redirs);
+
+        // the children have their copies, the shell must not keep the
+        // pipes open or the readers never see EOF
+        if (prev_read >= 0)
+            close(prev_read);
+        if (pipe_fds[1] >= 0)
+            close(pipe_fds[1]);
+        prev_read = pipe_fds[0];
+
+        if (pid > 0) {
+            pids[n_pids++] = pid;
+            // the rest of the commands join the group of the first one
+            if (pgid == 0)
+                pgid = pid;
+        }
+        // a stage that didn't start only matters if it is the last one
+        if (pid > 0 && last)
+            last_cmd_status = -1;
+    }
+
+    if (prev_read >= 0)
+        close(prev_read);
+    return last_cmd_status;
+}
+
+/**
+ * @brief Executes a pipeline, all the commands run concurrently
+ * @param tree Tree the pipeline belongs to
+ * @param pipeline AST_PIPELINE node
+ * @return Exit status of the last command
+ */
+int execute_pipeline(const ast& tree, const ast_node& pipeline) {
+    arena::position mark = line_arena.mark();
+    pid_t* pids = (pid_t*) line_arena.alloc(sizeof(pid_t) * pipeline.len, alignof(pid_t));
+    size_t n_pids;
+    int last_cmd_status = start_pipeline(tree, pipeline.first, pipeline.len, -1, pids, n_pids);
+
+    // the status of a pipeline is the status of its last command
+    for (size_t k = 0; k < n_pids; ++k) {
+        int status = exit_status(wait_child(pids[k]));
+        if (k == n_pids - 1 && last_cmd_status < 0)
+            last_cmd_status = status;
+    }
+
+    line_arena.release(mark);
+    return last_status = last_cmd_status;
+}
+
+/**
+ * @brief Finds the source text covered by a node
+ * @param start, end Widened to include the words of the node
+ */
+void node_span(const ast& tree, uint32_t index, uint32_t& start, uint32_t& end) {
+    const ast_node& node = tree.nodes[index];
+
+    if (node.kind == AST_WORD) {
+        start = min(start, node.first);
+        end = max(end, node.first + node.len);
+        return;
+    }
+    // `for` and `done` have no nodes, they are found next to the variable
+    // name and after the body
+    if (node.kind == AST_FOR) {
+        uint32_t at = tree.nodes[node.first].first;
+        while (tree.text[at - 1] == ' ' || tree.text[at - 1] == '\t')
+            at--;
+        start = min(start, at - 3);
+    }
+    for (uint32_t i = node.first; i != 0; i = tree.nodes[i].next) {
+        node_span(tree, i, start, end);
+        if (node.kind == AST_FOR && tree.nodes[i].kind == AST_LIST) {
+            uint32_t at = end;
+            while (memcmp(tree.text + at, "done", 4) != 0)
+                at++;
+            end = at + 4;
+        }
+    }
+}
+
+/**
+ * @brief Starts a list item as a background job
+ * @param tree Parsed tree
+ * @param index Index of the item
+ * @return 0, starting a job always succeeds like in other shells
+ * @remark Commands and pipelines are launched directly, anything else runs
+ * in a forked copy of the shell. In the interactive shell a job gets its own
+ * process group, so it can be moved to the foreground and doesn't get the
+ * signals of the terminal.
+ */
+int execute_background(const ast& tree, uint32_t index) {
+    const ast_node& node = tree.nodes[index];
+    arena::position mark = line_arena.mark();
+    pid_t pgid = interactive ? 0 : -1;
+    pid_t* pids = (pid_t*) line_arena.alloc(sizeof(pid_t) * max<uint32_t>(node.len, 1), alignof(pid_t));
+    size_t n_pids = 0;
+
+    // finished jobs are collected here too, so that a script starting
+    // many jobs doesn't pile up zombies
+    reap_jobs(0);
 
-// Built-ins
-int cmd_cd(char** args);
-int cmd_help(char** args);
-int cmd_exit(char** args);
+    if (node.kind == AST_PIPELINE) {
+        start_pipeline(tree, node.first, node.len, pgid, pids, n_pids);
+    }
+    else if (node.kind == AST_CMD) {
+        start_pipeline(tree, index, 1, pgid, pids, n_pids);
+    }
+    else {
+        cout.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (pgid == 0)
+                setpgid(0, 0);
+            // the jobs of the shell aren't children of this copy
+            job_table.clear();
+            interactive = false;
+            execute_node(tree, index);
+            cout.flush();
+            _exit(last_status);
+        }
+        else if (pid < 0) {
+            perror("[shell] Error forking child process.");
+        }
+        else {
+            if (pgid == 0)
+                setpgid(pid, pid);
+            pids[n_pids++] = pid;
+        }
+    }
 
-// shell operations
-void print_prompt();
-pair<char**, size_t> tokenize_line(char* args);
-char* read_line();
-void repl_loop();
+    if (n_pids > 0) {
+        uint32_t start = UINT32_MAX, end = 0;
+        node_span(tree, index, start, end);
+        add_job(pids, n_pids, pgid == 0 ? pids[0] : -1, string(tree.text + start, end - start));
+    }
 
-/*
-    Constants
-*/
-const string PROMPT = "> ";
+    line_arena.release(mark);
+    return last_status = 0;
+}
 
-// built-in function template
-using func = function<int(char**)>;
+/**
+ * @brief Executes a for loop
+ * @param tree Tree the loop belongs to
+ * @param loop AST_FOR node
+ * @return Exit status of the last command of the body, 0 if it never ran
+ * @remark The words are expanded before the body first runs, except brace
+ * expansions without $ or patterns in them: their values can't depend on
+ * anything the body does, so they are rendered one per iteration and
+ * {1..10000000} takes no more memory than {1..10}.
+ */
+int execute_for(const ast& tree, const ast_node& loop) {
+    arena::position mark = line_arena.mark();
 
-// mapping of built-in commands to their respective functions
-unordered_map<string, func> built_in_cmds = {
-    {"cd", cmd_cd},
-    {"help", cmd_help},
-    {"exit", cmd_exit}
-};
+    launch_opts opts;
+    bool redirected = open_redirs(tree, loop, opts);
+    int* saved = (int*) line_arena.alloc(sizeof(int) * opts.n_remaps, alignof(int));
+    if (!redirected || !apply_fd_remaps(opts, saved)) {
+        close_redirs(tree, loop, opts);
+        line_arena.release(mark);
+        return last_status = 1;
+    }
 
-unordered_map<string, string> built_in_description = {
-    {"cd", "Change the current working directory"},
-    {"help", "Help menu for the shell"},
-    {"exit", "Exit the shell"}
-};
+    size_t errors = expansion_errors;
+    const ast_node& name = tree.nodes[loop.first];
+    loop_values* values = (loop_values*) line_arena.alloc(sizeof(loop_values) * loop.len, alignof(loop_values));
+    uint32_t i = name.next;
+    for (uint32_t w = 0; w < loop.len; ++w, i = tree.nodes[i].next) {
+        const ast_node& word = tree.nodes[i];
+        loop_values& v = values[w];
+        v = {};
 
-////////////////////////// Implementations //////////////////////////
+        if ((word.flags & WORD_BRACE) && !(word.flags & (WORD_EXPAND | WORD_GLOB))
+            && brace_compile(tree.text + word.first, word.len, v.braces)) {
+            v.count = v.braces.nodes[0].count;
+            v.quoted = word.flags & WORD_QUOTED;
+            if (v.count == BRACE_TOO_LARGE) {
+                cerr << "[shell] ";
+                cerr.write(v.braces.text, v.braces.len) << ": brace expansion too large" << '\n';
+                v.count = 0;
+            }
+            continue;
+        }
+        expansion e = {};
+        e.max_fields = 2;
+        e.fields = (char**) line_arena.alloc(sizeof(char*) * e.max_fields, alignof(char*));
+        e.split = true;
+        expand_word_fields(tree, word, e, 0);
+        v.fields = e.fields;
+        v.count = e.n_fields;
+    }
+    uint32_t body = i;
 
-/*
-    Command execution
-*/
+    // the body doesn't run if a word failed to expand
+    bool expanded = expansion_errors == errors;
+    last_status = expanded ? 0 : 1;
+    for (uint32_t w = 0; expanded && w < loop.len; ++w) {
+        const loop_values& v = values[w];
+        char* buf = v.braces.nodes ? (char*) line_arena.alloc(v.braces.nodes[0].max_len + 1, 1) : nullptr;
+        // whatever an iteration allocates is released before the next one
+        arena::position iteration = line_arena.mark();
+
+        for (uint64_t k = 0; k < v.count; ++k) {
+            line_arena.release(iteration);
+            const char* value = v.fields ? v.fields[k] : buf;
+            size_t value_len = v.fields ? strlen(value) : brace_render(v.braces, 0, k, buf) - buf;
+            if (v.quoted) {
+                // only the quotes are left to remove
+                expansion e = {};
+                expand_word_into(buf, value_len, e);
+                if (!e.started)
+                    continue;
+                exp_reserve(e, 0);
+                value = e.buf;
+                value_len = e.len;
+            }
+            // an empty value is dropped, like an empty unquoted word
+            else if (!v.fields && value_len == 0) {
+                continue;
+            }
+            set_var(tree.text + name.first, name.len, value, value_len);
+            execute_node(tree, body);
+        }
+    }
+
+    restore_fd_remaps(opts, saved);
+    close_redirs(tree, loop, opts);
+    line_arena.release(mark);
+    return last_status;
+}
 
 /**
- * @brief Launches an external command in a child process
- * @param args NULL-terminated array of command arguments
- * @return 1 on success, 0 on failure
+ * @brief Executes a node of the tree
+ * @param tree Parsed tree
+ * @param index Index of the node
+ * @return Exit status, also stored in last_status
  */
-int launch_cmd(char** args) {
-    // launch the command in a child process
-    pid_t pid = fork();
-    
-    // child process
-    if (pid == 0) {
-        if(execvp(args[0], args) == -1) {
-            perror("[shell] Error launching command.");
-            return 0;
+int execute_node(const ast& tree, uint32_t index) {
+    const ast_node& node = tree.nodes[index];
+
+    switch (node.kind) {
+    case AST_LIST:
+        for (uint32_t i = node.first; i != 0; i = tree.nodes[i].next) {
+            if (tree.nodes[i].flags & NODE_BACKGROUND)
+                execute_background(tree, i);
+            else
+                execute_node(tree, i);
         }
+        break;
+    case AST_AND:
+        if (execute_node(tree, node.first) == 0)
+            execute_node(tree, tree.nodes[node.first].next);
+        break;
+    case AST_OR:
+        if (execute_node(tree, node.first) != 0)
+            execute_node(tree, tree.nodes[node.first].next);
+        break;
+    case AST_PIPELINE:
+        execute_pipeline(tree, node);
+        break;
+    case AST_CMD:
+        execute_simple_cmd(tree, node);
+        break;
+    case AST_FOR:
+        execute_for(tree, node);
+        break;
+    default:
+        break;
     }
-    // error forking
-    else if(pid < 0) {
-        cerr << "Error forking process: " <<  getpid() << endl;
-        perror("[shell] Error forking child process.");
-        return 0;
-    }
-    // parent process
-    else {
-        int status;
-        do {
-            // wait till the child is not stopped, when
-            // it does, return the status of the child
-            waitpid(pid, &status, WUNTRACED);
-        }
-        // the child process state can change multiple times
-        // during its execution and due to that it can be at "Stopped"
-        // state.
-        // WIFEXITED(status) returns true if the child terminated normally
-        // WIFSIGNALED(status) returns true if the child process was terminated by a signal
-        // So we continue only if the child process didnt exit or wasnt
-        // signalled to stop 
-        while(!WIFEXITED(status) && !WIFSIGNALED(status));
-    }
-    
-    return 1;
+    return last_status;
 }
 
 /**
- * @brief Executes a command based on whether built-in or external command.
- * @param args Array of command arguments (NULL-terminated)
- * @param n_args Number of arguments
- * @return 1 on success, 0 on failure
+ * @brief Main shell loop that reads and executes commands
+ * 
+ * This function implements the shell's read-evaluate-print loop:
+ * 1. Display prompt
+ * 2. Read user input
+ * 3. Parse input into a tree
+ * 4. Execute the tree
+ * 5. Repeat
  */
-int execute_cmd(char** args, size_t n_args) {
-    if (n_args == 0) {
-        cout << "Empty command entered, please enter your input..." << endl;
-        return 1;
-    }
+void repl_loop() {
+    char* line;
 
-    // check if it is one of the built-in commands
-    if(built_in_cmds.count(string(args[0]))) {
-        return built_in_cmds[args[0]](args);
+    // one buffered write, flushed together with the first prompt
+    if (interactive)
+        cout << BANNER;
+    
+    while(true) {
+        // the previous line and its tree are no longer needed
+        line_arena.reset();
+
+        // like other shells, finished jobs are reported before the prompt
+        reap_jobs(0);
+        if (interactive) {
+            report_done_jobs();
+            print_prompt();
+        }
+        line = read_line();
+
+        // parse the line into a tree living in the line arena
+        ast tree;
+        if (!parse_source(line, strlen(line), line_arena, tree)) {
+            last_status = 2;
+            continue;
+        }
+
+        if (tree.nodes[0].len == 0) {
+            cout << "Empty command entered, please enter your input..." << '\n';
+            continue;
+        }
+
+        execute_node(tree, 0);
     }
+}
 
-    // Launch the external command
-    return launch_cmd(args);
+/**
+ * @brief Picks the launch backend, SHELL_LITE_LAUNCH can be used to pin it
+ */
+void init_launch_backend() {
+    const char* mode = getenv("SHELL_LITE_LAUNCH");
+
+    if (!mode)
+        return;
+
+    if (strcmp(mode, "spawn") == 0)
+        launch_backend = launch_mode::spawn;
+    else if (strcmp(mode, "fork") == 0)
+        launch_backend = launch_mode::fork;
+    else if (strcmp(mode, "zygote") == 0 && start_zygote())
+        launch_backend = launch_mode::zygote;
 }
 
 /*
-    Built-in commands
-    @brief These are native commands of the shell program. These
-    are mostly used for shell related operations.
+    Non-interactive execution
 */
-/*
- * @brief Change the current working directory
- * @param args: The path to change the directory to
- * @remark The reason 'cd' is a built-in instead of using an
- * external command is because the commands are launched as child process,
- * so an external cd command will only change the dir for the child process
- * instead of the parent process.
+
+/**
+ * @brief Parses and runs a script
+ * @param text Script text, doesn't need to be NULL-terminated
+ * @param len Length of the text
+ * @return Exit status of the last command, 2 on a syntax error
+ * @remark The whole script is parsed once up front, the tree refers to
+ * the text in place so no line is ever copied.
  */
-int cmd_cd(char** args) {
-    // nullptr is the last element of args, if there
-    // is no path provided, return an error
-    if (args[1] == nullptr) {
-        cerr << "No path provided. Usage: cd <path>" << endl;
-        return 0;
-    }
+int run_source(const char* text, size_t len) {
+    // the tree lives as long as the script runs, unlike the line arena
+    // which is reused for the tokens and the expanded words
+    arena script_arena;
+    ast tree;
 
-    if (chdir(args[1]) != 0) {
-        perror("[shell] Error changing directory.");
-        return 0;
-    }
+    if (!parse_source(text, len, script_arena, tree))
+        return 2;
 
-    return 1;
+    // the tokens are not needed anymore
+    line_arena.reset();
+    return execute_node(tree, 0);
 }
 
 /**
- * @brief Built-in command to display help information
- * @param args Command arguments (unused)
- * @return Always returns 1
+ * @brief Runs a script file
+ * @param path Path of the script
+ * @return Exit status of the last command, 127 if the script can't be read
+ * @remark The parsed tree is looked up in the script cache first, on a hit
+ * the script isn't read or parsed at all. Otherwise the script is memory
+ * mapped read-only, parsed in place and the tree is added to the cache.
  */
-int cmd_help(char** args) {
-    cout << "Shell help" << endl;
-    cout << "Following built-in commands are supported" << endl;
+int run_script(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror("[shell] Error opening script.");
+        return 127;
+    }
+
+    string cache_path = script_cache_path(path);
+    ast tree;
+    size_t map_size;
 
-    for(auto cmd: built_in_cmds) {
-        cout << cmd.first << ": " << built_in_description[cmd.first] << endl;
+    if (!cache_path.empty() && load_script_cache(cache_path, st, tree, map_size)) {
+        int status = execute_node(tree, 0);
+        munmap((void*) tree.nodes, map_size);
+        return status;
     }
 
-    return 1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("[shell] Error opening script.");
+        return 127;
+    }
+
+    // the script could have changed since the stat above, the cache
+    // entry has to describe the text that was actually parsed
+    if (fstat(fd, &st) != 0) {
+        perror("[shell] Error reading script.");
+        close(fd);
+        return 127;
+    }
+
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    char* data = (char*) mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        perror("[shell] Error mapping script.");
+        return 127;
+    }
+    // the script is read front to back by the lexer
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    // the tree lives as long as the script runs
+    arena script_arena;
+    int status = 2;
+
+    if (parse_source(data, size, script_arena, tree)) {
+        if (!cache_path.empty())
+            store_script_cache(cache_path, st, tree, size);
+
+        // the tokens are not needed anymore
+        line_arena.reset();
+        status = execute_node(tree, 0);
+    }
+
+    munmap(data, size);
+    return status;
 }
 
 /**
- * @brief Built-in command to exit the shell
- * @param args Command arguments (unused)
- * @return Never returns; calls exit()
+ * @brief Runs the commands of a -c command string
+ * @param cmds Command string, can contain several lines
+ * @return Exit status of the last command
  */
-int cmd_exit(char** args) {
-    cout << "Exiting shell" << endl;
-    exit(EXIT_SUCCESS);
-    return 1;
+int run_string(const char* cmds) {
+    return run_source(cmds, strlen(cmds));
 }
 
 /*
-    Shell operations
+    Script cache
+    The parsed tree of a script is stored in a cache directory, keyed by
+    the path of the script. An entry holds a header, the node array and
+    the script text the words point into, so loading it is a single mmap
+    and the tree is used straight from the mapping. The entry is only used
+    if the size, mtime and inode of the script and the shell version match.
 */
 
-void print_prompt() {
-    cout << PROMPT;
+const uint32_t SCRIPT_CACHE_FORMAT = 6;
+const char SCRIPT_CACHE_MAGIC[8] = {'S', 'L', 'A', 'S', 'T', '\0', '\0', '\0'};
+
+struct script_cache_header {
+    char magic[8];
+    uint32_t format;
+    // layout of the nodes, in case ast_node changes without a version bump
+    uint32_t node_size;
+    char version[16];
+    // what the script looked like when it was parsed
+    uint64_t script_size;
+    uint64_t script_inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t n_nodes;
+    uint32_t reserved;
+};
+
+/**
+ * @brief Builds the path of the cache entry of a script
+ * @param script Path of the script
+ * @return Path of the entry, empty if caching is disabled
+ * @remark The directory is $SHELL_LITE_CACHE_DIR, $XDG_CACHE_HOME/shell-lite
+ * or ~/.cache/shell-lite. SHELL_LITE_CACHE=0 disables the cache.
+ */
+string script_cache_path(const char* script) {
+    const char* enabled = get_var("SHELL_LITE_CACHE");
+    if (enabled && strcmp(enabled, "0") == 0)
+        return "";
+
+    string dir;
+    if (const char* env = get_var("SHELL_LITE_CACHE_DIR"))
+        dir = env;
+    else if (const char* env = get_var("XDG_CACHE_HOME"))
+        dir = string(env) + "/shell-lite";
+    else if (const char* env = get_var("HOME"))
+        dir = string(env) + "/.cache/shell-lite";
+    else
+        return "";
+
+    // the same script reached through different relative paths should
+    // share the entry
+    char* real = realpath(script, nullptr);
+    if (!real)
+        return "";
+
+    // FNV-1a of the absolute path names the entry
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char* c = real; *c; ++c)
+        hash = (hash ^ (unsigned char) *c) * 0x100000001b3ull;
+    free(real);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.ast", (unsigned long long) hash);
+    return dir + name;
 }
 
 /**
- * @brief Reads a line of input from standard input
- * @return Dynamically allocated string containing user input
+ * @brief Maps the cache entry of a script
+ * @param cache_path Path of the entry
+ * @param st Current stat of the script
+ * @param tree Receives the tree, its nodes point into the mapping
+ * @param map_size Receives the size of the mapping, unmap tree.nodes with it
+ * @return true if the entry exists and matches the script
  */
-char* read_line() {
-    char* line = nullptr;
-    // when buff_size is 0, getline will allocate the buffer memory
-    // suitable for holding the input.
-    size_t buff_size = 0;
+bool load_script_cache(const string& cache_path, const struct stat& st, ast& tree, size_t& map_size) {
+    int fd = open(cache_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) != 0 || (size_t) cache_st.st_size < sizeof(script_cache_header)) {
+        close(fd);
+        return false;
+    }
+
+    map_size = cache_st.st_size;
+    char* data = (char*) mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
 
-    int chars_read = getline(&line, &buff_size, stdin);
+    script_cache_header header;
+    memcpy(&header, data, sizeof(header));
 
-    if (chars_read == -1) {
-        if(feof(stdin)) {
-            cerr << "EOF reached, exiting" << endl;
-            exit(EXIT_SUCCESS);
+    bool valid = memcmp(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.format == SCRIPT_CACHE_FORMAT
+        && header.node_size == sizeof(ast_node)
+        && strncmp(header.version, SHELL_VERSION, sizeof(header.version)) == 0
+        && header.script_size == (uint64_t) st.st_size
+        && header.script_inode == (uint64_t) st.st_ino
+        && header.mtime_sec == st.st_mtim.tv_sec
+        && header.mtime_nsec == st.st_mtim.tv_nsec
+        && map_size == sizeof(header) + header.n_nodes * sizeof(ast_node) + header.script_size;
+
+    if (!valid) {
+        munmap(data, map_size);
+        return false;
+    }
+
+    // the header size keeps the nodes aligned, the mapping itself is page aligned
+    tree.nodes = (const ast_node*) (data + sizeof(header));
+    tree.n_nodes = header.n_nodes;
+    tree.text = data + sizeof(header) + header.n_nodes * sizeof(ast_node);
+    return true;
+}
+
+/**
+ * @brief Writes the cache entry of a script
+ * @param cache_path Path of the entry
+ * @param st Stat of the script the tree was parsed from
+ * @param tree Parsed tree
+ * @param text_len Length of the script text
+ * @remark Failures are ignored, the cache is only an optimization. The entry
+ * is written to a temporary file and renamed, so a concurrent run never
+ * maps a partially written one.
+ */
+void store_script_cache(const string& cache_path, const struct stat& st, const ast& tree, size_t text_len) {
+    // create the cache directory and its parents
+    string dir = cache_path.substr(0, cache_path.rfind('/'));
+    for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+        mkdir(dir.substr(0, slash).c_str(), 0700);
+        if (slash == string::npos)
+            break;
+    }
+
+    script_cache_header header = {};
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.format = SCRIPT_CACHE_FORMAT;
+    header.node_size = sizeof(ast_node);
+    strncpy(header.version, SHELL_VERSION, sizeof(header.version));
+    header.script_size = text_len;
+    header.script_inode = st.st_ino;
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+    header.n_nodes = tree.n_nodes;
+
+    string tmp_path = cache_path + ".XXXXXX";
+    int fd = mkostemp(&tmp_path[0], O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    struct iovec parts[3] = {
+        { &header, sizeof(header) },
+        { (void*) tree.nodes, tree.n_nodes * sizeof(ast_node) },
+        { (void*) tree.text, text_len },
+    };
+    size_t total = parts[0].iov_len + parts[1].iov_len + parts[2].iov_len;
+
+    // writev can be partial for large scripts, finish it part by part
+    ssize_t written = writev(fd, parts, 3);
+    bool ok = written >= 0;
+    for (int i = 0; ok && i < 3; ++i) {
+        size_t len = parts[i].iov_len;
+        size_t done = min<size_t>(written, len);
+        written -= done;
+        while (ok && done < len) {
+            ssize_t n = write(fd, (char*) parts[i].iov_base + done, len - done);
+            ok = n > 0;
+            done += ok ? n : 0;
         }
+    }
+    close(fd);
+
+    struct stat tmp_st;
+    if (ok && stat(tmp_path.c_str(), &tmp_st) == 0 && (size_t) tmp_st.st_size == total
+        && rename(tmp_path.c_str(), cache_path.c_str()) == 0)
+        return;
+
+    unlink(tmp_path.c_str());
+}
 
-        perror("[shell] Error reading input.");
-        exit(EXIT_FAILURE);
+/*
+    Server mode
+    `shell --server <socket>` keeps one warm shell around, with its command
+    hash, script cache and built-ins ready, and runs the commands sent by
+    shell_client. Every connection is served by a forked copy of the server,
+    so a request can change its cwd and environment freely and requests run
+    concurrently. The wire format is described in shell_server.h.
+*/
+
+/**
+ * @brief Reads exactly len bytes
+ * @return true on success
+ */
+bool read_exact(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
     }
-    return line;
+    return true;
 }
 
 /**
- * @brief Parses a command line into tokens
- * @param line Input string to tokenize
- * @return Pair of {token array, token count}
+ * @brief Serves one request, runs in the forked copy of the server
+ * @param conn Connected socket
+ * @remark The fds of the client replace stdin, stdout and stderr, so the
+ * output of the command goes straight to the client without passing
+ * through the socket.
  */
-pair<char**, size_t> tokenize_line(char* line) {
-    if (!line)
-        return { nullptr, 0 };
-        
-    int tokens_list_len = 32;
-    const char* DELIM = " \t\r\n\a";
+void serve_connection(int conn) {
+    server_request req;
+    int fds[SERVER_N_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
 
-    char* token = nullptr;
-    char** tokens = (char**) malloc(sizeof(char*) * tokens_list_len);
-    
-    if (!tokens) {
-        cerr << "Error allocating memory for tokens" << endl;
-        exit(EXIT_FAILURE);
+    iovec iov = { &req, sizeof(req) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+
+    cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        cerr << "[shell] server: request without stdin, stdout and stderr" << '\n';
+        return;
     }
-    
-    token = strtok(line, DELIM);
-    int pos = 0;
-
-    while(token) {
-        tokens[pos++] = token;
-        token = strtok(NULL, DELIM);
-
-        // check if the tokens list is full
-        // if reserve the last element for the NULL terminator,
-        // execvp needs the last element to be NULL
-        if (pos >= tokens_list_len - 1) {
-            tokens_list_len *= 2;
-            
-            char** new_tokens = (char**)realloc(tokens, tokens_list_len * sizeof(char*));
-
-            if (!new_tokens) {
-                perror("[shell] Error allocating memory for tokens.");
-                // Since the resizing attempt failed, free the memory of existing
-                // tokens list
-                free(tokens);
-                exit(EXIT_FAILURE);
-            }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
 
-            // realloc attempt was successful
-            tokens = new_tokens;
-        }
+    // the rest of the header can arrive separately from the fds
+    if ((size_t) n < sizeof(req) && !read_exact(conn, (char*) &req + n, sizeof(req) - n))
+        return;
+
+    if (memcmp(req.magic, SERVER_REQUEST_MAGIC, sizeof(req.magic)) != 0
+        || req.version != SERVER_PROTOCOL_VERSION || req.payload_len > SERVER_MAX_PAYLOAD) {
+        cerr << "[shell] server: malformed request" << '\n';
+        return;
     }
 
-    // excevp requires the last element to be NULL.
-    tokens[pos] = nullptr;
-    
-    return { tokens, pos };
+    // lives till the copy exits, putenv keeps pointers into it
+    char* payload = (char*) malloc(req.payload_len + 1);
+    if (!payload || !read_exact(conn, payload, req.payload_len))
+        return;
+    payload[req.payload_len] = '\0';
+
+    // cwd, then the environment, then the command
+    char* end = payload + req.payload_len;
+    char* cwd = payload;
+    char* p = cwd + strlen(cwd) + 1;
+
+    clearenv();
+    for (uint32_t i = 0; i < req.n_env && p < end; ++i) {
+        putenv(p);
+        p += strlen(p) + 1;
+    }
+    import_environ();
+    const char* cmds = p < end ? p : "";
+
+    for (int fd = 0; fd < SERVER_N_FDS; ++fd) {
+        dup2(fds[fd], fd);
+        close(fds[fd]);
+    }
+
+    // exit ends the process that runs the commands, so run
+    // them one copy deeper and forward how that copy ended
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(conn);
+        int status = 1;
+        if (chdir(cwd) != 0)
+            cerr << "[shell] server: " << cwd << ": " << strerror(errno) << '\n';
+        else
+            status = run_string(cmds);
+        cout.flush();
+        exit(status);
+    }
+
+    int32_t status = 1;
+    int wstatus;
+    if (pid < 0) {
+        perror("[shell] Error forking child process.");
+    }
+    else {
+        pid_t r;
+        while ((r = waitpid(pid, &wstatus, 0)) == -1 && errno == EINTR);
+        if (r == pid && WIFEXITED(wstatus))
+            status = WEXITSTATUS(wstatus);
+        else if (r == pid && WIFSIGNALED(wstatus))
+            status = 128 + WTERMSIG(wstatus);
+    }
+
+    write_all(conn, (const char*) &status, sizeof(status));
 }
 
 /**
- * @brief Main shell loop that reads and executes commands
- * 
- * This function implements the shell's read-evaluate-print loop:
- * 1. Display prompt
- * 2. Read user input
- * 3. Parse input into tokens
- * 4. Execute command
- * 5. Repeat
+ * @brief Accepts requests on a Unix socket till the shell is killed
+ * @param socket_path Path of the socket, an old socket there is replaced
+ * @return Exit status, only returns if the socket can't be set up
  */
-void repl_loop() {
-    char* line;
-    char** args;
+int run_server(const char* socket_path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        cerr << "[shell] server: socket path too long: " << socket_path << '\n';
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, socket_path);
 
-    cout << "\n";
-    cout << "               ════════════════════════════════════               " << endl;
-    cout << "                      Shell lite started....                      " << endl;
-    cout << "               ════════════════════════════════════               " << endl;
-    cout << R"(
-    ███████╗██╗  ██╗███████╗██╗     ██╗         ██╗     ██╗████████╗███████╗
-    ██╔════╝██║  ██║██╔════╝██║     ██║         ██║     ██║╚══██╔══╝██╔════╝
-    ███████╗███████║█████╗  ██║     ██║         ██║     ██║   ██║   █████╗  
-    ╚════██║██╔══██║██╔══╝  ██║     ██║         ██║     ██║   ██║   ██╔══╝  
-    ███████║██║  ██║███████╗███████╗███████╗    ███████╗██║   ██║   ███████╗
-    ╚══════╝╚═╝  ╚═╝╚══════╝╚══════╝╚══════╝    ╚══════╝╚═╝   ╚═╝   ╚══════╝
-                                                                            
-    Type 'help' for available commands
-    )" << endl;
-    
-    while(true) {
-        print_prompt();
-        line = read_line();
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+
+    // only the user running the server may connect, the requests run as them
+    mode_t old_mask = umask(077);
+    bool bound = sock >= 0 && bind(sock, (sockaddr*) &addr, sizeof(addr)) == 0;
+    umask(old_mask);
+
+    if (!bound || listen(sock, SOMAXCONN) != 0) {
+        perror("[shell] Error setting up the server socket.");
+        return EXIT_FAILURE;
+    }
+    cerr << "[shell] serving on " << socket_path << '\n';
+
+    while (true) {
+        int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
 
-        if (sizeof(line) == 0) {
-            cout << "Empty input received, please enter a command" << endl;
+        // copies that are done, the server never waits for them otherwise
+        while (waitpid(-1, nullptr, WNOHANG) > 0);
+
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("[shell] Error accepting a connection.");
             continue;
         }
 
-        // tokenize the command
-        auto [args, n_args] = tokenize_line(line);
-        execute_cmd(args, n_args);
+        // pick up PATH changes once in the server, not in every copy
+        check_path_changes();
+        cout.flush();
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            serve_connection(conn);
+            _exit(0);
+        }
+        else if (pid < 0) {
+            perror("[shell] Error forking child process.");
+        }
+        close(conn);
+    }
+}
+
+/**
+ * @brief Picks the fastest character scanner the CPU supports
+ * @remark SHELL_LITE_SIMD=scalar|sse2|avx2 pins a scanner, an unsupported
+ * choice is ignored.
+ */
+void init_char_scanner() {
+    const char* choice = getenv("SHELL_LITE_SIMD");
+    const char_scanner* best = nullptr;
+    const char_scanner* chosen = nullptr;
 
-        // strtok when used for tokenization returns the ptr to 
-        // positions in the original string line. So, args is just
-        // a block of memory where each block is just pointing to
-        // addresses in the original line.
-        // Once free(line) happens, the string related memory is freed, 
-        // so args can also be freed using free(args) instead of freeing
-        // individual elements of args.
-        free(line);
-        free(args);
+    for (const char_scanner& scanner: char_scanners) {
+#ifdef SHELL_LITE_X86
+        if (strcmp(scanner.name, "avx2") == 0 && !__builtin_cpu_supports("avx2"))
+            continue;
+        if (strcmp(scanner.name, "sse2") == 0 && !__builtin_cpu_supports("sse2"))
+            continue;
+#endif
+        // later entries are faster
+        best = &scanner;
+        if (choice && strcmp(choice, scanner.name) == 0)
+            chosen = &scanner;
     }
+
+    active_scanner = chosen ? chosen : best;
 }
 
+#ifndef SHELL_LITE_NO_MAIN
 int main(int argc, char** argv) {
+    // cout is buffered instead of going through stdio, it is flushed before
+    // prompts, reads and spawns
+    ios::sync_with_stdio(false);
+
+    init_vars();
+    init_launch_backend();
+    init_char_scanner();
+
+    // shell -c "cmd"
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            cerr << "[shell] -c requires a command string" << '\n';
+            return EXIT_FAILURE;
+        }
+        interactive = false;
+        return run_string(argv[2]);
+    }
+
+    // shell --server /path/to/socket
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        if (argc < 3) {
+            cerr << "[shell] --server requires a socket path" << '\n';
+            return EXIT_FAILURE;
+        }
+        interactive = false;
+        return run_server(argv[2]);
+    }
+
+    // shell script.sh
+    if (argc > 1) {
+        interactive = false;
+        return run_script(argv[1]);
+    }
+
+    // commands piped in are run like a script, without banner and prompts
+    if (!isatty(STDIN_FILENO))
+        interactive = false;
+
     repl_loop();
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,135 @@
+/**
+ * @file shell_client.cpp
+ * @brief Runs a command on a warm shell started with `shell --server <socket>`
+ *
+ * The command runs in the working directory and with the environment of the
+ * client, reading and writing its stdin, stdout and stderr. The client exits
+ * with the status of the command.
+ *
+ * Usage: shell_client <socket> <command> [arg ...]
+ * The command and its arguments are joined with spaces and parsed by the server.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shell_server.h"
+
+// only libc is used, so that starting the client costs as little as possible
+
+extern char** environ;
+
+/**
+ * @brief Sends the request header along with stdin, stdout and stderr
+ * @return true on success
+ */
+bool send_header(int sock, const server_request& req) {
+    iovec iov = { (void*) &req, sizeof(req) };
+    char control[CMSG_SPACE(sizeof(int) * SERVER_N_FDS)] = {};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SERVER_N_FDS);
+    int fds[SERVER_N_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof(req);
+}
+
+/**
+ * @brief Writes a whole buffer
+ * @return true on success
+ */
+bool send_all(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: shell_client <socket> <command> [arg ...]\n");
+        return 2;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[shell_client] socket path too long: %s\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (sockaddr*) &addr, sizeof(addr)) != 0) {
+        perror("[shell_client] Error connecting to the shell server");
+        return 255;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, "/");
+
+    // cwd, environment and command, each NUL terminated
+    size_t len = strlen(cwd) + 1;
+    uint32_t n_env = 0;
+    for (char** env = environ; *env; ++env, ++n_env)
+        len += strlen(*env) + 1;
+    for (int i = 2; i < argc; ++i)
+        len += strlen(argv[i]) + 1;
+
+    char* payload = (char*) malloc(len);
+    char* p = stpcpy(payload, cwd) + 1;
+    for (char** env = environ; *env; ++env)
+        p = stpcpy(p, *env) + 1;
+    for (int i = 2; i < argc; ++i) {
+        p = stpcpy(p, argv[i]);
+        *p++ = i + 1 < argc ? ' ' : '\0';
+    }
+
+    server_request req = {};
+    memcpy(req.magic, SERVER_REQUEST_MAGIC, sizeof(req.magic));
+    req.version = SERVER_PROTOCOL_VERSION;
+    req.n_env = n_env;
+    req.payload_len = len;
+
+    if (!send_header(sock, req) || !send_all(sock, payload, len)) {
+        perror("[shell_client] Error sending the request");
+        return 255;
+    }
+
+    int32_t status;
+    size_t got = 0;
+    while (got < sizeof(status)) {
+        ssize_t n = recv(sock, (char*) &status + got, sizeof(status) - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "[shell_client] the server closed the connection without a status\n");
+            return 255;
+        }
+        got += n;
+    }
+
+    close(sock);
+    return status;
+}
@@ -0,0 +1,36 @@
+/**
+ * @file shell_plugin.h
+ * @brief Interface of built-ins loaded at runtime with `enable -f`
+ *
+ * A plugin is a shared object defining one shell_builtin per command, with
+ * SHELL_BUILTIN. `enable -f lib.so name` loads lib.so and looks up the
+ * symbol name_builtin, the command then runs inside the shell like the
+ * other built-ins, without a fork or exec. The function gets the
+ * NULL-terminated arguments, args[0] being the name of the command, and
+ * returns 1 on success and 0 on failure.
+ *
+ * Output should go through std::cout and std::cerr: the shell buffers its
+ * own output there, something written straight to fd 1 would come out ahead
+ * of it. Build with `g++ -std=c++17 -O2 -shared -fPIC plugin.cpp -o plugin.so`.
+ */
+#ifndef SHELL_PLUGIN_H
+#define SHELL_PLUGIN_H
+
+#include <cstdint>
+
+// bumped whenever shell_builtin or the calling convention changes
+const uint32_t SHELL_PLUGIN_API_VERSION = 1;
+
+struct shell_builtin {
+    uint32_t api_version;
+    const char* name;
+    int (*func)(char** args);
+    // line shown by help
+    const char* description;
+};
+
+// defines the built-in `name` of the plugin, loaded by `enable -f lib.so name`
+#define SHELL_BUILTIN(name, func, description) \
+    extern "C" const shell_builtin name##_builtin = { SHELL_PLUGIN_API_VERSION, #name, func, description };
+
+#endif
@@ -0,0 +1,33 @@
+/**
+ * @file shell_server.h
+ * @brief Wire format shared by the shell server mode and shell_client
+ *
+ * A client connects to the Unix socket of `shell --server <socket>` and sends
+ * one request: a server_request header followed by payload_len bytes of NUL
+ * terminated strings, the working directory, n_env environment entries and
+ * the command. stdin, stdout and stderr of the client are passed along with
+ * the header (SCM_RIGHTS), so the output of the command goes straight to
+ * them. The server answers with the exit status of the command as an int32_t.
+ */
+#ifndef SHELL_SERVER_H
+#define SHELL_SERVER_H
+
+#include <cstdint>
+
+const char SERVER_REQUEST_MAGIC[4] = {'S', 'L', 'R', 'Q'};
+const uint32_t SERVER_PROTOCOL_VERSION = 1;
+
+// requests larger than this are rejected
+const uint32_t SERVER_MAX_PAYLOAD = 16 << 20;
+
+// stdin, stdout and stderr of the client
+const int SERVER_N_FDS = 3;
+
+struct server_request {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_env;
+    uint32_t payload_len;
+};
+
+#endif